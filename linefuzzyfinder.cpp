@@ -1,32 +1,792 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <list>
+#include <map>
+#include <memory>
+#include <array>
+#include <tuple>
 #include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <queue>
+#include <functional>
+#include <new>
+#include <filesystem>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define SIMD_DISPATCH 1
+#else
+#define SIMD_DISPATCH 0
+#endif
 
 #define DEFAULT_PATH "./lepanto.txt"
 
+// The word number stored for words a document doesn't have
+#define UNKNOWN_WORD_ID UINT32_MAX
+// Given for the longest run a line shares with a query when it isn't known
+#define UNKNOWN_RUN SIZE_MAX
+
+// Settings given as "--name value" before the other arguments
+struct Options {
+    std::string simdLevel;
+    std::string tuningPath;
+    bool stats = false;
+    std::string outputPath;
+    std::string checkpointPath;
+    size_t checkpointInterval = 1000;
+    bool resume = false;
+    size_t threads = 1;
+    std::string pretokenizePath;
+    std::string saveIndexPath;
+    size_t memoryBudgetMegabytes = 1024;
+    bool memoryReport = false;
+    std::string jsonPath;
+    std::string baselinePath;
+    size_t repetitions = 5;
+    size_t maxSlowdownPercent = 10;
+    std::string slowQueryLogPath;
+    size_t slowQueryMilliseconds = 100;
+    size_t shards = 0;
+    std::string warmCachePath;
+    std::string resultCachePath;
+    bool sharePrefixes = false;
+    bool blocks = false;
+    size_t blockLimit = SIZE_MAX;
+    bool signatures = false;
+    bool approximate = false;
+    // Queued requests past which --serve searches with a time budget, none
+    // if 0
+    size_t degradeQueueDepth = 0;
+    size_t degradedMilliseconds = 5;
+};
+
+// Instruction set levels vectorized kernels are compiled for, in order
+enum class SimdLevel { Scalar, Sse2, Sse42, Avx2, Avx512 };
+
 void printUsage();
 
 bool readAllLines(const std::string& path, std::vector<std::string>& lines);
 
-int driverMain(int argc, char** argv);
+int parseOptions(int argc, char** argv, Options& options);
+
+int driverMain(int argc, char** argv, const Options& options);
+
+int benchmarkMain(int argc, char** argv, const Options& options);
+
+// Loads a document and searches it once like the interactive mode, printing
+// when each step finished, for the startup benchmark to run as a new process
+int startupProbeMain(int argc, char** argv, const Options& options);
+
+int serverMain(int argc, char** argv, const Options& options);
+
+// Builds a document's index file without holding the whole document in memory
+int buildIndexMain(int argc, char** argv, const Options& options);
+
+// Picks the best level the host supports, which is also used by default
+SimdLevel detectSimdLevel();
+// Returns false if the host doesn't support the level
+bool selectSimdLevel(SimdLevel level);
+SimdLevel selectedSimdLevel();
+const char* simdLevelName(SimdLevel level);
+bool parseSimdLevel(const std::string& name, SimdLevel& level);
+
+// Lowers the ASCII capital letters in the text, leaving other bytes alone
+void lowerAscii(char* text, size_t length);
+// Returns the position of the first non-ASCII byte from the beginning on, or
+// the length if there isn't one
+size_t findNonAscii(const char* text, size_t begin, size_t length);
+// Folds the case of every character in the UTF-8 line, skipping everything
+// but the ASCII letters if the line is known to be ASCII
+void foldCase(std::string& line, bool isAscii);
+
+// Longest common run kernels, which must all return the same result
+size_t countSharedNaive(const std::string& a, const std::string& b);
+size_t countSharedDiagonal(const std::string& a, const std::string& b);
+// Uses whichever kernel is fastest for the lengths of a and b
+size_t countSharedAdaptive(const std::string& a, const std::string& b);
+
+// Loads the adaptive kernel choices from the tuning file if it has them,
+// otherwise times the kernels to choose and saves the choices there
+void prepareRunKernels(const Options& options);
+// Times every kernel at every pair of length ranges to choose between them
+void calibrateRunKernels();
+bool loadRunKernelTuning(const std::string& path);
+bool saveRunKernelTuning(const std::string& path);
+void printRunKernelStats(std::ostream& stream);
+void printPruningStats(std::ostream& stream);
+
+// What each heap allocation is counted under while tracking memory
+enum class MemoryCategory {
+    Other, RawText, NormalizedText, WordMaps, RuneMaps, Vocabulary, LineTable,
+    Caches, Count
+};
+
+// Starts recording the size and category of every heap allocation
+void startMemoryTracking();
+// Prints the bytes still allocated under each category, with averages over
+// the lines given
+void printMemoryReport(std::ostream& stream, size_t lineCount,
+    size_t nonEmptyLineCount);
+
+// The category allocations made on this thread are counted under
+inline MemoryCategory& currentMemoryCategory() {
+    static thread_local MemoryCategory category = MemoryCategory::Other;
+    return category;
+}
+
+// Counts the allocations made on this thread while it exists under the
+// category, then goes back to the one before
+class MemoryCategoryScope {
+public:
+    explicit MemoryCategoryScope(MemoryCategory category)
+        : mPrevious(currentMemoryCategory()) {
+        currentMemoryCategory() = category;
+    }
+
+    ~MemoryCategoryScope() {
+        currentMemoryCategory() = mPrevious;
+    }
+
+    MemoryCategoryScope(const MemoryCategoryScope&) = delete;
+    MemoryCategoryScope& operator=(const MemoryCategoryScope&) = delete;
+
+private:
+    MemoryCategory mPrevious;
+};
+
+// Appends the bytes of a plain value in the host's byte order
+template<typename T>
+void appendBytes(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// Appends a number seven bits at a time, so small numbers take one byte
+inline void appendVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+// Appends a string as its length followed by its characters
+inline void appendString(std::string& out, const std::string& text) {
+    appendVarint(out, text.size());
+    out += text;
+}
+
+// Appends the text as a JSON string
+inline void appendJsonString(std::string& out, const std::string& text) {
+    out += '"';
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        }
+        else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+// Appends the number with as few digits as read back the same, or null for
+// infinities and NaN, which JSON has no numbers for
+inline void appendJsonNumber(std::string& out, double value) {
+    if (!std::isfinite(value)) {
+        out += "null";
+        return;
+    }
+    char number[32];
+    for (int precision = 1; precision <= 17; ++precision) {
+        std::snprintf(number, sizeof(number), "%.*g", precision, value);
+        if (std::strtod(number, nullptr) == value) {
+            break;
+        }
+    }
+    out += number;
+}
+
+// Roughly how many bytes a string allocates, none if it fits in the string
+inline size_t heapBytes(const std::string& text) {
+    static const size_t inlineCapacity = std::string().capacity();
+    return text.capacity() > inlineCapacity ? text.capacity() + 1 : 0;
+}
+
+// Roughly how many bytes a hash map allocates for its buckets and nodes, not
+// counting anything the keys and values allocate themselves
+template<typename Map>
+size_t heapBytes(const Map& map) {
+    const size_t nodeBytes =
+        sizeof(void*) + sizeof(typename Map::value_type) + sizeof(size_t);
+    return map.bucket_count() * sizeof(void*) + map.size() * nodeBytes;
+}
+
+// Reads values written by appendBytes, appendVarint and appendString back out
+// of a buffer, noting instead of reading past the end of it
+class ByteReader {
+public:
+    ByteReader(const char* begin, const char* end)
+        : mCursor(begin), mEnd(end) {
+    }
+
+    template<typename T>
+    T read() {
+        T value{};
+        if (has(sizeof(T))) {
+            std::memcpy(&value, mCursor, sizeof(T));
+            mCursor += sizeof(T);
+        }
+        return value;
+    }
+
+    uint64_t readVarint() {
+        uint64_t value = 0;
+        for (unsigned shift = 0; shift < 64 && has(1); shift += 7) {
+            const unsigned char byte = static_cast<unsigned char>(*mCursor++);
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (byte < 0x80) {
+                return value;
+            }
+        }
+        mFailed = true;
+        return 0;
+    }
+
+    std::string readString() {
+        const uint64_t length = readVarint();
+        if (!has(length)) {
+            return std::string();
+        }
+        std::string text(mCursor, length);
+        mCursor += length;
+        return text;
+    }
+
+    void skip(size_t size) {
+        if (has(size)) {
+            mCursor += size;
+        }
+    }
+
+    const char* position() const {
+        return mCursor;
+    }
+
+    bool failed() const {
+        return mFailed;
+    }
+
+    bool atEnd() const {
+        return mCursor == mEnd;
+    }
+
+    // Fails the reader for data it read fine but that makes no sense
+    void fail() {
+        mFailed = true;
+        mCursor = mEnd;
+    }
+
+private:
+    bool has(size_t size) {
+        if (static_cast<size_t>(mEnd - mCursor) < size) {
+            mFailed = true;
+            mCursor = mEnd;
+        }
+        return !mFailed;
+    }
+
+    const char* mCursor;
+    const char* mEnd;
+    bool mFailed = false;
+};
+
+// A whole file mapped read only into memory
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+        const int descriptor = ::open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) {
+            return;
+        }
+        struct stat status;
+        if (::fstat(descriptor, &status) == 0 && status.st_size > 0) {
+            mSize = static_cast<size_t>(status.st_size);
+            void* data = ::mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE,
+                descriptor, 0);
+            mData = data == MAP_FAILED ? nullptr : static_cast<char*>(data);
+        }
+        ::close(descriptor);
+    }
+
+    ~MappedFile() {
+        if (mData != nullptr) {
+            ::munmap(mData, mSize);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const {
+        return mData != nullptr;
+    }
+
+    const char* begin() const {
+        return mData;
+    }
+
+    const char* end() const {
+        return mData + mSize;
+    }
+
+private:
+    char* mData = nullptr;
+    size_t mSize = 0;
+};
+
+// Numbers each distinct word of a document in the order they first appear
+class Vocabulary {
+public:
+    // Returns the word's number, adding it if it's new
+    uint32_t add(const std::string& word) {
+        auto inserted =
+            mIds.emplace(word, static_cast<uint32_t>(mWords.size()));
+        if (inserted.second) {
+            mWords.push_back(&inserted.first->first);
+        }
+        return inserted.first->second;
+    }
+
+    // Returns the word's number, or UNKNOWN_WORD_ID if it isn't in here
+    uint32_t find(const std::string& word) const {
+        auto iter = mIds.find(word);
+        return iter != mIds.end() ? iter->second : UNKNOWN_WORD_ID;
+    }
+
+    const std::string& word(uint32_t id) const {
+        return *mWords[id];
+    }
+
+    size_t size() const {
+        return mWords.size();
+    }
+
+    // Roughly how many bytes the vocabulary allocates
+    size_t memoryBytes() const {
+        size_t bytes = heapBytes(mIds) +
+            mWords.capacity() * sizeof(const std::string*);
+        for (auto&& id : mIds) {
+            bytes += heapBytes(id.first);
+        }
+        return bytes;
+    }
+
+private:
+    std::unordered_map<std::string, uint32_t> mIds;
+    // Points into the keys of the map, which never move
+    std::vector<const std::string*> mWords;
+};
+
+// Shards of the word table, each locked on its own, so threads rarely wait
+#define WORD_TABLE_SHARDS 64
+
+// Where a word first appears in a document, as the line and how many words of
+// that line's word set come before it
+struct FirstAppearance {
+    size_t line = SIZE_MAX;
+    size_t rank = SIZE_MAX;
+
+    bool operator<(const FirstAppearance& other) const {
+        return line != other.line ? line < other.line : rank < other.rank;
+    }
+};
+
+// Collects the distinct words of a document from many threads at once, split
+// into shards by hash, keeping where each first appears so they can be
+// numbered the same as adding them to a Vocabulary in document order would,
+// however the threads happened to run
+class ConcurrentWordTable {
+public:
+    // Keeps the earliest appearance of each word
+    void note(const std::string& word, const FirstAppearance& appearance) {
+        Shard& shard =
+            mShards[std::hash<std::string>()(word) % WORD_TABLE_SHARDS];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto inserted = shard.words.emplace(word, appearance);
+        if (!inserted.second && appearance < inserted.first->second) {
+            inserted.first->second = appearance;
+        }
+    }
+
+    // Adds every word to the vocabulary in order of first appearance
+    void number(Vocabulary& vocabulary) const {
+        std::vector<std::pair<FirstAppearance, const std::string*>> words;
+        for (auto&& shard : mShards) {
+            for (auto&& word : shard.words) {
+                words.emplace_back(word.second, &word.first);
+            }
+        }
+        std::sort(words.begin(), words.end(),
+            [](const std::pair<FirstAppearance, const std::string*>& a,
+                const std::pair<FirstAppearance, const std::string*>& b) {
+                return a.first < b.first;
+            });
+        for (auto&& word : words) {
+            vocabulary.add(*word.second);
+        }
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, FirstAppearance> words;
+    };
+
+    std::array<Shard, WORD_TABLE_SHARDS> mShards;
+};
+
+// Tells whether each character of a line, visited in increasing order, breaks
+// words, with the UTF-8 handling compiled out for lines known to be ASCII
+template<bool Ascii>
+class WordBreaks {
+public:
+    bool at(const std::string& line, size_t i) {
+        const unsigned char c = static_cast<unsigned char>(line[i]);
+        if (Ascii || c < 0x80) {
+            return asciiBreaks()[c];
+        }
+        // Every byte of a multibyte character breaks the same way as its first
+        if (i >= mCharacterEnd) {
+            mCharacterEnd = i + 1;
+            const size_t length =
+                c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+            bool valid = length > 1 && i + length <= line.size();
+            for (size_t j = 1; valid && j < length; ++j) {
+                const unsigned char next =
+                    static_cast<unsigned char>(line[i + j]);
+                valid = (next & 0xC0) == 0x80;
+            }
+            if (valid) {
+                mCharacterEnd = i + length;
+                const std::string character(line, i, length);
+                mBreaks = character == "“" || character == "‘" ||
+                    character == "’" || character == "”" || character == "—";
+            }
+            else {
+                // Stray bytes break words if a separator could contain them
+                mBreaks = std::string("“‘’”—").find(line[i]) != std::string::npos;
+            }
+        }
+        return mBreaks;
+    }
+
+private:
+    static const std::array<bool, 128>& asciiBreaks() {
+        static const std::array<bool, 128> breaks = [] {
+            std::array<bool, 128> table = {};
+            for (char c : std::string(" (),.!:;\"")) {
+                table[static_cast<unsigned char>(c)] = true;
+            }
+            return table;
+        }();
+        return breaks;
+    }
+
+    size_t mCharacterEnd = 0;
+    bool mBreaks = false;
+};
+
+// Time spent on each term of the score, added up across every line scored
+struct ScoreTimes {
+    std::chrono::steady_clock::duration words{};
+    std::chrono::steady_clock::duration runes{};
+    // Bounding the shared sequence terms, to skip them when they can't help
+    std::chrono::steady_clock::duration bounds{};
+    std::chrono::steady_clock::duration fullShared{};
+    std::chrono::steady_clock::duration wordShared{};
+};
 
 class WordSet {
 public:
     WordSet(const std::string& wordSetLine) : mLine(wordSetLine) {
+        // Lines without multibyte characters skip all of the UTF-8 handling
+        mIsAscii = findNonAscii(mLine.data(), 0, mLine.size()) == mLine.size();
+        if (mIsAscii) {
+            normalize<true>();
+        }
+        else {
+            normalize<false>();
+        }
+    }
+
+    // Reads a word set written by writePretokenized, skipping the work of
+    // normalizing and counting it again, where the reader fails if it's cut off
+    WordSet(ByteReader& reader, const Vocabulary& vocabulary)
+        : mLine(reader.readString()) {
+        mIsAscii = reader.read<uint8_t>() != 0;
+        MemoryCategoryScope wordScope(MemoryCategory::WordMaps);
+        const uint64_t wordCount = reader.readVarint();
+        mWords.reserve(static_cast<size_t>(std::min<uint64_t>(wordCount, 256)));
+        for (uint64_t i = 0; i < wordCount && !reader.failed(); ++i) {
+            // Words are stored as one more than their number, or 0 if unknown
+            const uint64_t id = reader.readVarint();
+            std::string word = id > 0 && id <= vocabulary.size() ?
+                vocabulary.word(static_cast<uint32_t>(id - 1)) :
+                reader.readString();
+            mWords.emplace(std::move(word),
+                static_cast<size_t>(reader.readVarint()));
+        }
+        MemoryCategoryScope runeScope(MemoryCategory::RuneMaps);
+        const uint64_t runeCount = reader.readVarint();
+        for (uint64_t i = 0; i < runeCount && !reader.failed(); ++i) {
+            const uint8_t rune = reader.read<uint8_t>();
+            const uint32_t count = static_cast<uint32_t>(reader.readVarint());
+            if (rune < 0x80) {
+                mAsciiRunes[rune] = count;
+            }
+            else {
+                mHighRunes[static_cast<char>(rune)] = count;
+                mHighRuneCount += count;
+            }
+        }
+    }
+
+    // Appends the normalized line and its counts, with the words the
+    // vocabulary has written as their numbers instead of their characters
+    void writePretokenized(std::string& out,
+        const Vocabulary& vocabulary) const {
+        appendString(out, mLine);
+        appendBytes(out, static_cast<uint8_t>(mIsAscii));
+        appendVarint(out, mWords.size());
+        for (auto&& word : mWords) {
+            const uint32_t id = vocabulary.find(word.first);
+            if (id == UNKNOWN_WORD_ID) {
+                appendVarint(out, 0);
+                appendString(out, word.first);
+            }
+            else {
+                appendVarint(out, uint64_t(id) + 1);
+            }
+            appendVarint(out, word.second);
+        }
+        const size_t asciiRuneCount = static_cast<size_t>(std::count_if(
+            mAsciiRunes.begin(), mAsciiRunes.end(),
+            [](uint32_t count) { return count > 0; }));
+        appendVarint(out, asciiRuneCount + mHighRunes.size());
+        for (size_t rune = 0; rune < mAsciiRunes.size(); ++rune) {
+            if (mAsciiRunes[rune] > 0) {
+                appendBytes(out, static_cast<uint8_t>(rune));
+                appendVarint(out, mAsciiRunes[rune]);
+            }
+        }
+        for (auto&& rune : mHighRunes) {
+            appendBytes(out, static_cast<uint8_t>(rune.first));
+            appendVarint(out, rune.second);
+        }
+    }
+
+    // Moves the reader past a word set written by writePretokenized
+    static void skipPretokenized(ByteReader& reader) {
+        reader.skip(static_cast<size_t>(reader.readVarint()));
+        reader.skip(sizeof(uint8_t));
+        const uint64_t wordCount = reader.readVarint();
+        for (uint64_t i = 0; i < wordCount && !reader.failed(); ++i) {
+            if (reader.readVarint() == 0) {
+                reader.skip(static_cast<size_t>(reader.readVarint()));
+            }
+            reader.readVarint();
+        }
+        const uint64_t runeCount = reader.readVarint();
+        for (uint64_t i = 0; i < runeCount && !reader.failed(); ++i) {
+            reader.skip(sizeof(uint8_t));
+            reader.readVarint();
+        }
+    }
+
+    bool isAscii() const {
+        return mIsAscii;
+    }
+
+    size_t length() const {
+        return mLine.size();
+    }
+
+    const std::string& normalizedLine() const {
+        return mLine;
+    }
+
+    const std::unordered_map<std::string, size_t>& words() const {
+        return mWords;
+    }
+
+    const std::array<uint32_t, 128>& asciiRunes() const {
+        return mAsciiRunes;
+    }
+
+    size_t highRuneCount() const {
+        return mHighRuneCount;
+    }
+
+    // Roughly how many bytes the word set allocates, not counting itself
+    size_t memoryBytes() const {
+        size_t bytes = heapBytes(mLine) + heapBytes(mWords) +
+            heapBytes(mHighRunes);
+        for (auto&& word : mWords) {
+            bytes += heapBytes(word.first);
+        }
+        return bytes;
+    }
+
+    // Returns [-1, 1] where 0 is fully dissimilar and 1 is a perfect match
+    // Prioritizes making sure the other word set is contained in this word set
+    double measureContainment(const WordSet& other) const {
+        return other.mIsAscii ? measureContainment<true, false>(other) :
+            measureContainment<false, false>(other);
+    }
+
+    // Same as above, but with the handling of multibyte characters compiled
+    // out where the caller knows the other word set or this one is ASCII
+    template<bool AsciiOther, bool AsciiThis>
+    double measureContainment(const WordSet& other) const {
+        // Early out for perfect matches
+        if (mLine == other.mLine) {
+            return 1.0;
+        }
+
+        // Without taking into account ordering, search for words and characters
+        // Gives a general sense of the match that is more kind to human error
+        const double words = measureContainment(mWords, other.mWords);
+        const double runes = measureRunes<AsciiOther, AsciiThis>(other);
+
+        // Find the longest common sequence of the line and scale to range
+        const double fullShared = measureShared(mLine, other.mLine) * 2 - 1;
+        // Find the average longest common sequence of words and scale to range
+        const double wordShared = measureShared(mWords, other.mWords) * 2 - 1;
+
+        // Weight and then scale down to the output range
+        return (words + runes + fullShared + wordShared) / 4;
+    }
+
+    // Same as above, but when the cheap terms prove the score is below the
+    // minimum, skips the shared sequence terms and returns the proof instead:
+    // a bound on the score that is itself below the minimum. The longest run
+    // the lines share can be given if it's already known, and each term is
+    // timed if there are times to add to
+    template<bool AsciiOther, bool AsciiThis>
+    double measureContainment(const WordSet& other, double minimum,
+        bool& bounded, size_t knownRun = UNKNOWN_RUN,
+        ScoreTimes* times = nullptr) const {
+        bounded = false;
+        if (mLine == other.mLine) {
+            return 1.0;
+        }
+        std::chrono::steady_clock::time_point start;
+        if (times) {
+            start = std::chrono::steady_clock::now();
+        }
+        auto lap = [times, &start](
+            std::chrono::steady_clock::duration ScoreTimes::*term) {
+            if (times) {
+                const auto now = std::chrono::steady_clock::now();
+                times->*term += now - start;
+                start = now;
+            }
+        };
+        const double words = measureContainment(mWords, other.mWords);
+        lap(&ScoreTimes::words);
+        const double runes = measureRunes<AsciiOther, AsciiThis>(other);
+        lap(&ScoreTimes::runes);
+
+        // The bounds round the same way as the terms they bound, so a score
+        // can never come out above its bound, and a known run's is exact
+        const size_t runLimit = knownRun != UNKNOWN_RUN ? knownRun :
+            countCommonRunes<AsciiOther, AsciiThis>(other);
+        const double fullBound =
+            boundShared(mLine, other.mLine, runLimit) * 2 - 1;
+        const double wordBound = boundShared(mWords, other.mWords) * 2 - 1;
+        const double bound = (words + runes + fullBound + wordBound) / 4;
+        lap(&ScoreTimes::bounds);
+        if (bound < minimum) {
+            bounded = true;
+            return bound;
+        }
+
+        const double fullShared = knownRun != UNKNOWN_RUN ? fullBound :
+            measureShared(mLine, other.mLine) * 2 - 1;
+        lap(&ScoreTimes::fullShared);
+        const double wordShared = measureShared(mWords, other.mWords) * 2 - 1;
+        lap(&ScoreTimes::wordShared);
+        return (words + runes + fullShared + wordShared) / 4;
+    }
+
+    // Same as above, but timing each term and adding the times up
+    double measureContainment(const WordSet& other, ScoreTimes& times) const {
+        if (mLine == other.mLine) {
+            return 1.0;
+        }
+        auto start = std::chrono::steady_clock::now();
+        auto lap = [&start](std::chrono::steady_clock::duration& time) {
+            const auto now = std::chrono::steady_clock::now();
+            time += now - start;
+            start = now;
+        };
+        const double words = measureContainment(mWords, other.mWords);
+        lap(times.words);
+        const double runes = measureRunes<false, false>(other);
+        lap(times.runes);
+        const double fullShared = measureShared(mLine, other.mLine) * 2 - 1;
+        lap(times.fullShared);
+        const double wordShared = measureShared(mWords, other.mWords) * 2 - 1;
+        lap(times.wordShared);
+        return (words + runes + fullShared + wordShared) / 4;
+    }
+
+private:
+    template<bool Ascii>
+    void normalize() {
         // We don't care about the casing
-        std::for_each(mLine.begin(), mLine.end(), [](char& c) {
-            c = static_cast<char>(std::tolower(c));
-        });
+        foldCase(mLine, Ascii);
 
         // We only need one word break at a time since we only care about words
         // If we remove it now, we won't have to later over and over again
         // That will make comparisons where we only care about words easier
+        WordBreaks<Ascii> compactingBreaks;
         bool isBreakingWord = true;
         for (size_t begin = 0, end = 0; end < mLine.size(); ++end) {
-            if (!doesBreakWord(mLine[end])) {
+            if (!compactingBreaks.at(mLine, end)) {
                 mLine[begin++] = mLine[end];
                 isBreakingWord = false;
             }
@@ -36,10 +796,12 @@ public:
             }
         }
 
+        WordBreaks<Ascii> countingBreaks;
+        MemoryCategoryScope wordScope(MemoryCategory::WordMaps);
         for (size_t begin = 0, end = 0; end <= mLine.size(); ++end) {
             // Count each word's appearances in the list of words
             const bool unended = end < mLine.size();
-            const bool breaksWord = unended && doesBreakWord(mLine[end]);
+            const bool breaksWord = unended && countingBreaks.at(mLine, end);
             if (end > begin && (breaksWord || end >= mLine.size())) {
                 std::string word(mLine.substr(begin, end - begin));
                 if (auto iter = mWords.find(word); iter != mWords.end()) {
@@ -52,39 +814,80 @@ public:
             }
             // Count each character's appearances in the list of words
             if (unended) {
-                if (auto iter = mRunes.find(mLine[end]); iter != mRunes.end()) {
-                    ++iter->second;
+                const unsigned char rune =
+                    static_cast<unsigned char>(mLine[end]);
+                if (Ascii || rune < 0x80) {
+                    ++mAsciiRunes[rune];
                 }
                 else {
-                    mRunes.emplace(mLine[end], 1);
+                    MemoryCategoryScope runeScope(MemoryCategory::RuneMaps);
+                    ++mHighRunes[mLine[end]];
+                    ++mHighRuneCount;
                 }
             }
         }
     }
 
-    // Returns [-1, 1] where 0 is fully dissimilar and 1 is a perfect match
-    // Prioritizes making sure the other word set is contained in this word set
-    double measureContainment(const WordSet& other) const {
-        // Early out for perfect matches
-        if (mLine == other.mLine) {
-            return 1.0;
+    // Same as measuring the containment of the rune counts like the word
+    // counts, but with ASCII runes counted in flat arrays so they can be
+    // compared without any hashing
+    template<bool AsciiOther, bool AsciiThis>
+    double measureRunes(const WordSet& other) const {
+        // The sums are whole numbers, so counting with integers doesn't change
+        // the result no matter the order
+        int64_t found = 1, possible = 1;
+        for (size_t rune = 0; rune < mAsciiRunes.size(); ++rune) {
+            const int64_t mine = mAsciiRunes[rune];
+            const int64_t theirs = other.mAsciiRunes[rune];
+            found += mine == 0 ? -theirs : std::min(mine, theirs);
+            possible += theirs == 0 ? 0 : std::max(mine, theirs);
         }
+        if constexpr (!AsciiOther) {
+            if (AsciiThis || mIsAscii) {
+                // None of the other set's multibyte runes can be found here
+                const int64_t missing =
+                    static_cast<int64_t>(other.mHighRuneCount);
+                found -= missing;
+                possible += missing;
+            }
+            else {
+                for (auto&& item : other.mHighRunes) {
+                    const int64_t theirs = static_cast<int64_t>(item.second);
+                    if (auto iter = mHighRunes.find(item.first);
+                        iter != mHighRunes.end()) {
+                        const int64_t mine = static_cast<int64_t>(iter->second);
+                        found += std::min(mine, theirs);
+                        possible += std::max(mine, theirs);
+                    }
+                    else {
+                        found -= theirs;
+                        possible += theirs;
+                    }
+                }
+            }
+        }
+        return static_cast<double>(found) / static_cast<double>(possible);
+    }
 
-        // Without taking into account ordering, search for words and characters
-        // Gives a general sense of the match that is more kind to human error
-        const double words = measureContainment(mWords, other.mWords);
-        const double runes = measureContainment(mRunes, other.mRunes);
-
-        // Find the longest common sequence of the line and scale to range
-        const double fullShared = measureShared(mLine, other.mLine) * 2 - 1;
-        // Find the average longest common sequence of words and scale to range
-        const double wordShared = measureShared(mWords, other.mWords) * 2 - 1;
-
-        // Weight and then scale down to the output range
-        return (words + runes + fullShared + wordShared) / 4;
+    // How many of the other set's runes are also found here, which no shared
+    // sequence of the lines can be longer than
+    template<bool AsciiOther, bool AsciiThis>
+    size_t countCommonRunes(const WordSet& other) const {
+        size_t common = 0;
+        for (size_t rune = 0; rune < mAsciiRunes.size(); ++rune) {
+            common += std::min(mAsciiRunes[rune], other.mAsciiRunes[rune]);
+        }
+        if constexpr (!AsciiOther && !AsciiThis) {
+            for (auto&& item : other.mHighRunes) {
+                if (auto iter = mHighRunes.find(item.first);
+                    iter != mHighRunes.end()) {
+                    common += std::min(iter->second, item.second);
+                }
+            }
+        }
+        return common;
     }
 
-private:
     // Returns [-1, 1] where -1 is no similar words found and 1 is all words
     // found and with the exact number of appearances in both sets
     template<typename T>
@@ -111,247 +914,7315 @@ private:
                         itemsPossible += static_cast<double>(item.second);
                     }
                 }
-                else {
-                    // An item we searched for, but could not find is very bad
-                    itemsFound -= static_cast<double>(item.second);
-                    itemsPossible += static_cast<double>(item.second);
+                else {
+                    // An item we searched for, but could not find is very bad
+                    itemsFound -= static_cast<double>(item.second);
+                    itemsPossible += static_cast<double>(item.second);
+                }
+            }
+        }
+        return itemsFound / itemsPossible;
+    }
+
+    // Returns the longest string of consecutive matching characters
+    static size_t countShared(const std::string& a, const std::string& b) {
+        return countSharedAdaptive(a, b);
+    }
+
+    // Returns the longest string of consecutive matching characters divided by
+    // the average length of the strings (using the average length penalizes
+    // having different lengths, while using the shorter string's length, the
+    // longest possible sequence given the lengths, would treat one being a
+    // substring of the other as a perfect match)
+    static double measureShared(const std::string& a, const std::string& b) {
+        const double sizeSum = static_cast<double>(a.size() + b.size());
+        return static_cast<double>(countShared(a, b) * 2) / sizeSum;
+    }
+
+    // Searches each of the items of a for the longest shared sequence with b
+    // Returns the longest string of consecutive matching characters of items in
+    // a with b and divided by the average length of the strings (using the
+    // average length penalizes having different lengths, while using the
+    // shorter string's length, the longest possible sequence given the lengths,
+    // would treat one being a substring of the other as a perfect match)
+    static double measureShared(
+        const std::unordered_map<std::string, size_t>& a,
+        const std::string& b) {
+        // We only care about the best match
+        double bestShared = 0;
+        for (auto&& pair : a) {
+            const double shared = measureShared(pair.first, b);
+            bestShared = shared > bestShared ? shared : bestShared;
+        }
+        return bestShared;
+    }
+
+    // For each item of b, searches each of the items of a for the longest
+    // shared sequence with the item of b
+    // Returns the average of the lengths of the shared sequences from each
+    // found best match for each item in b
+    static double measureShared(
+        const std::unordered_map<std::string, size_t>& a,
+        const std::unordered_map<std::string, size_t>& b) {
+        // We need to average the results
+        double measurementSum = 0;
+        for (auto&& pair : b) {
+            measurementSum += measureShared(a, pair.first);
+        }
+        return measurementSum / static_cast<double>(b.size());
+    }
+
+    // The most measureShared could return, since no shared sequence can be
+    // longer than the shorter of the strings
+    static double boundShared(const std::string& a, const std::string& b,
+        size_t limit = SIZE_MAX) {
+        const double sizeSum = static_cast<double>(a.size() + b.size());
+        const size_t longest = std::min({ a.size(), b.size(), limit });
+        return static_cast<double>(longest * 2) / sizeSum;
+    }
+
+    // Same as above, but for the average of best matches of the items of b
+    static double boundShared(
+        const std::unordered_map<std::string, size_t>& a,
+        const std::unordered_map<std::string, size_t>& b) {
+        double measurementSum = 0;
+        for (auto&& pair : b) {
+            double bestShared = 0;
+            for (auto&& item : a) {
+                const double shared = boundShared(item.first, pair.first);
+                bestShared = shared > bestShared ? shared : bestShared;
+            }
+            measurementSum += bestShared;
+        }
+        return measurementSum / static_cast<double>(b.size());
+    }
+
+    std::string mLine;
+    std::unordered_map<std::string, size_t> mWords;
+    // Runes are counted per byte, with multibyte characters' bytes kept apart
+    std::array<uint32_t, 128> mAsciiRunes = {};
+    std::unordered_map<char, size_t> mHighRunes;
+    size_t mHighRuneCount = 0;
+    bool mIsAscii = true;
+};
+
+#define EMPTY_FINGERPRINT 0xCBF29CE484222325ull
+
+// Documents with fewer lines than this are searched without scoring a sample
+// first, since the sample would be a large part of the search
+#define SEED_MINIMUM_LINES 1024
+// How many lines a search scores first to start with a strong best score
+#define SEED_SAMPLE_LINES 32
+// How many of the lines each word appears in are kept to seed searches with
+#define SEED_WORD_LINES 4
+// Most cells of the rows a search through shared prefixes keeps, past which
+// the query is searched for one line at a time instead
+#define PREFIX_ROW_CELLS (1 << 22)
+// How many lines a search with a deadline scores between reading the clock
+#define DEADLINE_CHECK_LINES 256
+
+// Lines all searches scored in full, and those only their bounds were needed
+// for since they couldn't beat the best score so far
+static std::atomic<uint64_t> linesScoredInFull{ 0 };
+static std::atomic<uint64_t> linesPrunedByBound{ 0 };
+// Blocks of lines searches went through, and those their bounds ruled out
+static std::atomic<uint64_t> blocksSearched{ 0 };
+static std::atomic<uint64_t> blocksSkipped{ 0 };
+// Lines searches passed over since their signatures ruled them out
+static std::atomic<uint64_t> linesFilteredBySignature{ 0 };
+
+// A word of a query as a block sees it, by its number in the document
+struct QueryWord {
+    uint32_t id = UNKNOWN_WORD_ID;
+    size_t count = 0;
+    size_t length = 0;
+};
+
+// What the lines of a block between empty lines have in common, enough to
+// bound the score any of them could get for a query without scoring them
+class BlockSummary {
+public:
+    // Starts out empty, with the block's first line at the position
+    explicit BlockSummary(size_t begin)
+        : mBegin(begin), mEnd(begin) {
+    }
+
+    size_t begin() const {
+        return mBegin;
+    }
+
+    size_t end() const {
+        return mEnd;
+    }
+
+    // Adds the line at the end of the block
+    void add(const WordSet& line, const Vocabulary& vocabulary) {
+        ++mEnd;
+        mMinLength = std::min(mMinLength, line.length());
+        mMaxLength = std::max(mMaxLength, line.length());
+        for (size_t rune = 0; rune < mAsciiRunes.size(); ++rune) {
+            mAsciiRunes[rune] =
+                std::max(mAsciiRunes[rune], line.asciiRunes()[rune]);
+        }
+        mHasHighRunes = mHasHighRunes || line.highRuneCount() > 0;
+        for (auto&& word : line.words()) {
+            const uint32_t id = vocabulary.find(word.first);
+            auto inserted = std::lower_bound(mWords.begin(), mWords.end(),
+                std::make_pair(id, size_t(0)));
+            if (inserted == mWords.end() || inserted->first != id) {
+                mWords.emplace(inserted, id, word.second);
+            }
+            else {
+                inserted->second = std::max(inserted->second, word.second);
+            }
+            auto length = std::lower_bound(mWordLengths.begin(),
+                mWordLengths.end(), word.first.size());
+            if (length == mWordLengths.end() || *length != word.first.size()) {
+                mWordLengths.insert(length, word.first.size());
+            }
+        }
+    }
+
+    // Returns a score no line of the block can beat for the query, with each
+    // term bounded the way Document's searches bound a line's, and rounding
+    // the same way, so the bound is never below a score it covers
+    double bound(const WordSet& query,
+        const std::vector<QueryWord>& queryWords) const {
+        // Missing words count against every line, and found ones for it at
+        // best as often as the query has them
+        double wordsFound = 1, fewestPossible = 1, mostPossible = 1;
+        for (auto&& word : queryWords) {
+            const double count = static_cast<double>(word.count);
+            const size_t most = mostAppearances(word.id);
+            wordsFound += most > 0 ? count : -count;
+            fewestPossible += count;
+            mostPossible += static_cast<double>(std::max(word.count, most));
+        }
+        // A negative ratio is closest to zero with the most possible
+        const double words = wordsFound >= 0 ?
+            wordsFound / fewestPossible : wordsFound / mostPossible;
+
+        // The same for the runes, where the multibyte ones are only known
+        // to be in some line or not, so all of them may be found
+        int64_t runesFound = 1, fewestRunes = 1, mostRunes = 1;
+        size_t commonRunes = 0;
+        for (size_t rune = 0; rune < mAsciiRunes.size(); ++rune) {
+            const int64_t theirs = query.asciiRunes()[rune];
+            const int64_t most = mAsciiRunes[rune];
+            if (theirs == 0) {
+                continue;
+            }
+            runesFound += most > 0 ? std::min(most, theirs) : -theirs;
+            fewestRunes += theirs;
+            mostRunes += std::max(most, theirs);
+            commonRunes += static_cast<size_t>(std::min(most, theirs));
+        }
+        const int64_t highRunes = static_cast<int64_t>(query.highRuneCount());
+        runesFound += mHasHighRunes ? highRunes : -highRunes;
+        fewestRunes += highRunes;
+        mostRunes += highRunes;
+        commonRunes += mHasHighRunes ? query.highRuneCount() : 0;
+        const bool mostKnown = !mHasHighRunes || highRunes == 0;
+        const double runes = runesFound >= 0 ?
+            static_cast<double>(runesFound) / static_cast<double>(fewestRunes) :
+            mostKnown ? static_cast<double>(runesFound) /
+                static_cast<double>(mostRunes) : 0.0;
+
+        // The run's bound peaks for lines as long as the runes allow
+        const size_t run = std::min(commonRunes, query.length());
+        const size_t length = std::min(std::max(run, mMinLength), mMaxLength);
+        const double fullShared = static_cast<double>(std::min(length, run) *
+            2) / static_cast<double>(length + query.length()) * 2 - 1;
+
+        // Each query word matches best with words about as long as itself
+        double wordSum = 0;
+        for (auto&& word : queryWords) {
+            double best = 0;
+            auto above = std::lower_bound(mWordLengths.begin(),
+                mWordLengths.end(), word.length);
+            if (above != mWordLengths.end()) {
+                best = boundShared(*above, word.length);
+            }
+            if (above != mWordLengths.begin()) {
+                best = std::max(best, boundShared(*(above - 1), word.length));
+            }
+            wordSum += best;
+        }
+        const double wordShared =
+            wordSum / static_cast<double>(queryWords.size()) * 2 - 1;
+
+        return (words + runes + fullShared + wordShared) / 4;
+    }
+
+    // Roughly how many bytes the summary allocates, not counting itself
+    size_t memoryBytes() const {
+        return mWords.capacity() * sizeof(mWords[0]) +
+            mWordLengths.capacity() * sizeof(mWordLengths[0]);
+    }
+
+private:
+    size_t mostAppearances(uint32_t id) const {
+        auto found = std::lower_bound(mWords.begin(), mWords.end(),
+            std::make_pair(id, size_t(0)));
+        return found != mWords.end() && found->first == id &&
+            id != UNKNOWN_WORD_ID ? found->second : 0;
+    }
+
+    static double boundShared(size_t a, size_t b) {
+        const double sizeSum = static_cast<double>(a + b);
+        return static_cast<double>(std::min(a, b) * 2) / sizeSum;
+    }
+
+    size_t mBegin;
+    size_t mEnd;
+    size_t mMinLength = SIZE_MAX;
+    size_t mMaxLength = 0;
+    // The most times any line has each rune, and each word by its number
+    std::array<uint32_t, 128> mAsciiRunes = {};
+    bool mHasHighRunes = false;
+    std::vector<std::pair<uint32_t, size_t>> mWords;
+    // Every length of word any line has, shortest first
+    std::vector<size_t> mWordLengths;
+};
+
+// Bits of a word's number picking each row it sets, so there are 1 << this
+// many rows for words
+#define SIGNATURE_WORD_ROW_BITS 8
+// How many rows each word sets, all of which a line with the word has set
+#define SIGNATURE_WORD_HASHES 2
+// Rows for each ASCII rune, set for lines with it at least 1, 2 and 4 times
+#define SIGNATURE_RUNE_LEVELS 3
+// Lines each word of a row has the bits of
+#define SIGNATURE_CHUNK_LINES 64
+
+// The words and runes of every line as rows of bits, one row per feature and
+// one bit per line, laid out bit-sliced like BitFunnel's. A search reads the
+// few rows its query's features are in and adds up what each line is missing
+// 64 lines at a time, which bounds the lines' scores without looking at any
+// of their words
+class SignatureIndex {
+public:
+    // Where a query's features are in the rows, and how often it has them
+    class Query {
+    private:
+        friend class SignatureIndex;
+
+        struct Word {
+            std::array<size_t, SIGNATURE_WORD_HASHES> rows;
+            size_t count = 0;
+        };
+
+        struct Rune {
+            size_t rune = 0;
+            size_t count = 0;
+        };
+
+        std::vector<Word> mWords;
+        std::vector<Rune> mRunes;
+        // How often the query has words no line has
+        size_t mUnknownWords = 0;
+        size_t mWordCount = 0;
+        size_t mRuneCount = 0;
+        size_t mHighRuneCount = 0;
+        size_t mLength = 0;
+        // Enough bits for the most any line can be missing
+        size_t mCounterBits = 0;
+    };
+
+    bool empty() const {
+        return mChunks == 0;
+    }
+
+    void build(const std::vector<std::pair<size_t, WordSet>>& lines,
+        const Vocabulary& vocabulary) {
+        mChunks = (lines.size() + SIGNATURE_CHUNK_LINES - 1) /
+            SIGNATURE_CHUNK_LINES;
+        mRows.assign(ROW_COUNT * mChunks, 0);
+        mWordCounts.resize(lines.size());
+        for (size_t position = 0; position < lines.size(); ++position) {
+            const WordSet& line = lines[position].second;
+            size_t wordCount = 0;
+            for (auto&& word : line.words()) {
+                const uint32_t id = vocabulary.find(word.first);
+                for (size_t hash = 0; hash < SIGNATURE_WORD_HASHES; ++hash) {
+                    set(wordRow(id, hash), position);
+                }
+                wordCount += word.second;
+            }
+            mWordCounts[position] = static_cast<uint16_t>(
+                std::min<size_t>(wordCount, UINT16_MAX));
+            for (size_t rune = 0; rune < line.asciiRunes().size(); ++rune) {
+                const size_t count = line.asciiRunes()[rune];
+                for (size_t level = 0; level < SIGNATURE_RUNE_LEVELS &&
+                    count >= (size_t(1) << level); ++level) {
+                    set(runeRow(rune, level), position);
+                }
+            }
+            if (line.highRuneCount() > 0) {
+                set(HIGH_RUNE_ROW, position);
+            }
+        }
+    }
+
+    Query prepare(const WordSet& query, const Vocabulary& vocabulary) const {
+        Query prepared;
+        for (auto&& word : query.words()) {
+            prepared.mWordCount += word.second;
+            const uint32_t id = vocabulary.find(word.first);
+            if (id == UNKNOWN_WORD_ID) {
+                prepared.mUnknownWords += word.second;
+                continue;
+            }
+            Query::Word feature;
+            for (size_t hash = 0; hash < SIGNATURE_WORD_HASHES; ++hash) {
+                feature.rows[hash] = wordRow(id, hash);
+            }
+            feature.count = word.second;
+            prepared.mWords.push_back(feature);
+        }
+        for (size_t rune = 0; rune < query.asciiRunes().size(); ++rune) {
+            const size_t count = query.asciiRunes()[rune];
+            if (count > 0) {
+                prepared.mRunes.push_back({ rune, count });
+                prepared.mRuneCount += count;
+            }
+        }
+        prepared.mHighRuneCount = query.highRuneCount();
+        prepared.mRuneCount += prepared.mHighRuneCount;
+        prepared.mLength = query.length();
+        // A missing rune counts twice against the runes' term
+        const size_t most =
+            std::max(prepared.mWordCount, 2 * prepared.mRuneCount);
+        while ((most >> prepared.mCounterBits) > 0) {
+            ++prepared.mCounterBits;
+        }
+        return prepared;
+    }
+
+    // Bounds the score of each line of the chunk for the query, with each
+    // term bounded like Document's searches bound a line's and rounding the
+    // same way, so no line can score above its bound. Found words and runes
+    // count for a line at best as often as the query has them, or as the
+    // rows show the line could have them
+    void bound(const Query& query, size_t chunk,
+        std::array<double, SIGNATURE_CHUNK_LINES>& bounds) const {
+        // How much of the query each line is missing, bit-sliced so each
+        // word of a counter has one bit of it for every line
+        Counter missingWords = {}, runeShortfall = {}, missingRunes = {};
+        const size_t bits = query.mCounterBits;
+        for (auto&& word : query.mWords) {
+            uint64_t has = ~uint64_t(0);
+            for (size_t row : word.rows) {
+                has &= rowAt(row, chunk);
+            }
+            add(missingWords, bits, ~has, word.count);
+        }
+        // A missing rune counts against the line as well as not for it
+        auto addMissing = [&](uint64_t lines, size_t count) {
+            add(runeShortfall, bits, lines, 2 * count);
+            add(missingRunes, bits, lines, count);
+        };
+        for (auto&& rune : query.mRunes) {
+            addMissing(~rowAt(runeRow(rune.rune, 0), chunk), rune.count);
+            // Lines with the rune fewer times than the query fall short
+            for (size_t level = 0; level + 1 < SIGNATURE_RUNE_LEVELS;
+                ++level) {
+                const size_t most = (size_t(2) << level) - 1;
+                if (rune.count <= most) {
+                    break;
+                }
+                const uint64_t lines = rowAt(runeRow(rune.rune, level),
+                    chunk) & ~rowAt(runeRow(rune.rune, level + 1), chunk);
+                add(runeShortfall, bits, lines, rune.count - most);
+                add(missingRunes, bits, lines, rune.count - most);
+            }
+        }
+        if (query.mHighRuneCount > 0) {
+            addMissing(~rowAt(HIGH_RUNE_ROW, chunk), query.mHighRuneCount);
+        }
+
+        const int64_t words = static_cast<int64_t>(query.mWordCount);
+        const int64_t runes = static_cast<int64_t>(query.mRuneCount);
+        for (size_t i = 0; i < SIGNATURE_CHUNK_LINES; ++i) {
+            const size_t position = chunk * SIGNATURE_CHUNK_LINES + i;
+            const size_t wordCount =
+                position < mWordCounts.size() ? mWordCounts[position] : 0;
+            const int64_t wordsFound = 1 + words - 2 * static_cast<int64_t>(
+                query.mUnknownWords + read(missingWords, bits, i));
+            // A negative ratio is closest to zero with the most possible,
+            // which is at most every word of the line on top of the query's
+            const double wordBound = wordsFound >= 0 ?
+                static_cast<double>(wordsFound) /
+                    static_cast<double>(1 + words) :
+                wordCount < UINT16_MAX ? static_cast<double>(wordsFound) /
+                    static_cast<double>(1 + words +
+                        static_cast<int64_t>(wordCount)) : 0.0;
+            const int64_t runesFound = 1 + runes -
+                static_cast<int64_t>(read(runeShortfall, bits, i));
+            const double runeBound = runesFound >= 0 ?
+                static_cast<double>(runesFound) /
+                    static_cast<double>(1 + runes) : 0.0;
+            // The run's bound peaks for lines as long as the runes allow
+            const size_t run = std::min(
+                query.mRuneCount - read(missingRunes, bits, i), query.mLength);
+            const double fullBound = static_cast<double>(run * 2) /
+                static_cast<double>(run + query.mLength) * 2 - 1;
+            bounds[i] = (wordBound + runeBound + fullBound + 1.0) / 4;
+        }
+    }
+
+    // Roughly how many bytes the index allocates, not counting itself
+    size_t memoryBytes() const {
+        return mRows.capacity() * sizeof(mRows[0]) +
+            mWordCounts.capacity() * sizeof(mWordCounts[0]);
+    }
+
+private:
+    using Counter = std::array<uint64_t, 64>;
+
+    static constexpr size_t WORD_ROWS = size_t(1) << SIGNATURE_WORD_ROW_BITS;
+    static constexpr size_t HIGH_RUNE_ROW =
+        WORD_ROWS + 128 * SIGNATURE_RUNE_LEVELS;
+    static constexpr size_t ROW_COUNT = HIGH_RUNE_ROW + 1;
+
+    // Fibonacci hashing of the word's number and which hash it is
+    static size_t wordRow(uint32_t id, size_t hash) {
+        const uint64_t key = (static_cast<uint64_t>(id) << 8) | hash;
+        return static_cast<size_t>(
+            (key * 0x9E3779B97F4A7C15ull) >> (64 - SIGNATURE_WORD_ROW_BITS));
+    }
+
+    static size_t runeRow(size_t rune, size_t level) {
+        return WORD_ROWS + rune * SIGNATURE_RUNE_LEVELS + level;
+    }
+
+    // Adds the amount to the counters of the lines given, carrying from
+    // each bit to the next for all of them at once
+    static void add(Counter& counter, size_t bits, uint64_t lines,
+        size_t amount) {
+        for (size_t bit = 0; (amount >> bit) > 0; ++bit) {
+            if (((amount >> bit) & 1) == 0) {
+                continue;
+            }
+            uint64_t carry = lines;
+            for (size_t slice = bit; carry != 0 && slice < bits; ++slice) {
+                const uint64_t next = counter[slice] & carry;
+                counter[slice] ^= carry;
+                carry = next;
+            }
+        }
+    }
+
+    static size_t read(const Counter& counter, size_t bits, size_t line) {
+        size_t value = 0;
+        for (size_t slice = 0; slice < bits; ++slice) {
+            value |= static_cast<size_t>((counter[slice] >> line) & 1) << slice;
+        }
+        return value;
+    }
+
+    uint64_t rowAt(size_t row, size_t chunk) const {
+        return mRows[row * mChunks + chunk];
+    }
+
+    void set(size_t row, size_t position) {
+        mRows[row * mChunks + position / SIGNATURE_CHUNK_LINES] |=
+            uint64_t(1) << (position % SIGNATURE_CHUNK_LINES);
+    }
+
+    size_t mChunks = 0;
+    // Each row's words one after another, for every line of the document
+    std::vector<uint64_t> mRows;
+    // How many words each line has, at most UINT16_MAX standing for more
+    std::vector<uint16_t> mWordCounts;
+};
+
+// Dimensions of the vectors lines are embedded as for the nearest neighbor
+// graph, which each character trigram of a line adds to
+#define ANN_DIMENSIONS 128
+// Links each node of the graph keeps to its nearest neighbors on each layer,
+// with twice as many on the bottom layer
+#define ANN_LINKS 16
+// How many of the nearest nodes found so far inserting a node keeps looking
+// around, and searching at least
+#define ANN_BUILD_BREADTH 100
+#define ANN_SEARCH_BREADTH 64
+// How many of the nearest lines the graph finds are scored exactly
+#define ANN_RERANK_LINES 32
+// Most layers a node can be on, far more than a document could need
+#define ANN_MAX_LEVEL 16
+// Nodes inserted into the graph together, each linked to the nodes found in
+// the graph as it was before the batch and to the batch's earlier nodes
+#define ANN_BUILD_BATCH 256
+
+// Nodes already seen by a search of the graph, cleared by starting a new
+// round rather than by clearing every mark
+class VisitedNodes {
+public:
+    void clear(size_t nodeCount) {
+        if (mMarks.size() < nodeCount) {
+            mMarks.resize(nodeCount, 0);
+        }
+        if (++mRound == 0) {
+            std::fill(mMarks.begin(), mMarks.end(), 0);
+            mRound = 1;
+        }
+    }
+
+    // Returns false if the node was already seen this round
+    bool visit(uint32_t node) {
+        if (mMarks[node] == mRound) {
+            return false;
+        }
+        mMarks[node] = mRound;
+        return true;
+    }
+
+private:
+    std::vector<uint32_t> mMarks;
+    uint32_t mRound = 0;
+};
+
+// Approximate nearest neighbors of the lines, as a hierarchical navigable
+// small world graph over each line's character trigrams hashed into a vector.
+// Searches go down the sparse upper layers greedily and then look around the
+// bottom one, which finds lines with trigrams like the query's without
+// looking at most of them
+class AnnIndex {
+public:
+    bool empty() const {
+        return mLevels.empty();
+    }
+
+    // Each trigram of the line with a space on either end adds or takes one
+    // from the dimension it hashes to, and the vector is scaled to length 1
+    static void embed(const std::string& line, float* vector) {
+        std::fill(vector, vector + ANN_DIMENSIONS, 0.0f);
+        const std::string padded = ' ' + line + ' ';
+        for (size_t i = 0; i + 3 <= padded.size(); ++i) {
+            uint32_t hash = 2166136261u;
+            for (size_t j = i; j < i + 3; ++j) {
+                hash = (hash ^ static_cast<unsigned char>(padded[j])) *
+                    16777619u;
+            }
+            vector[hash % ANN_DIMENSIONS] += (hash >> 31) != 0 ? 1.0f : -1.0f;
+        }
+        float length = 0;
+        for (size_t d = 0; d < ANN_DIMENSIONS; ++d) {
+            length += vector[d] * vector[d];
+        }
+        if (length > 0) {
+            const float scale = 1.0f / std::sqrt(length);
+            for (size_t d = 0; d < ANN_DIMENSIONS; ++d) {
+                vector[d] *= scale;
+            }
+        }
+    }
+
+    // Inserts the lines a batch at a time, finding each batch's links on that
+    // many threads from a graph nothing changes meanwhile and then linking
+    // them in order, so the graph is the same however many threads build it
+    void build(const std::vector<std::pair<size_t, WordSet>>& lines,
+        size_t threadCount) {
+        const size_t count = lines.size();
+        embedLines(lines);
+        // Each layer has about 1 / ANN_LINKS of the nodes of the one below
+        std::mt19937_64 random(12345);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        const double scale = 1.0 / std::log(static_cast<double>(ANN_LINKS));
+        mLevels.resize(count);
+        mUpperLinks.resize(count);
+        for (size_t node = 0; node < count; ++node) {
+            const double level = -std::log(1.0 - uniform(random)) * scale;
+            mLevels[node] = static_cast<uint8_t>(
+                std::min<double>(level, ANN_MAX_LEVEL));
+            mUpperLinks[node].assign(mLevels[node] * (ANN_LINKS + 1), 0);
+        }
+        mBaseLinks.assign(count * (2 * ANN_LINKS + 1), 0);
+        if (count == 0) {
+            return;
+        }
+        mEntry = 0;
+        mTopLevel = mLevels[0];
+
+        // Each node's chosen links on each of its layers
+        std::vector<std::vector<std::vector<uint32_t>>> chosen(ANN_BUILD_BATCH);
+        // Links back to the batch's nodes, as the node linked back, its
+        // layer and the node linking to it
+        std::vector<std::array<uint32_t, 3>> backLinks;
+        std::vector<size_t> groups;
+        for (size_t begin = 1; begin < count; begin += ANN_BUILD_BATCH) {
+            const size_t end = std::min<size_t>(begin + ANN_BUILD_BATCH, count);
+            forEachOnThreads(end - begin, threadCount,
+                [&](size_t i, VisitedNodes& visited) {
+                    chosen[i] = chooseLinks(static_cast<uint32_t>(begin + i),
+                        static_cast<uint32_t>(begin), visited);
+                });
+            backLinks.clear();
+            for (size_t node = begin; node < end; ++node) {
+                const auto& nodeChosen = chosen[node - begin];
+                for (size_t layer = 0; layer < nodeChosen.size(); ++layer) {
+                    uint32_t* nodeLinks = links(static_cast<uint32_t>(node),
+                        layer);
+                    nodeLinks[0] = static_cast<uint32_t>(
+                        nodeChosen[layer].size());
+                    std::copy(nodeChosen[layer].begin(),
+                        nodeChosen[layer].end(), nodeLinks + 1);
+                    for (uint32_t neighbor : nodeChosen[layer]) {
+                        backLinks.push_back({ neighbor,
+                            static_cast<uint32_t>(layer),
+                            static_cast<uint32_t>(node) });
+                    }
+                }
+                if (mLevels[node] > mTopLevel) {
+                    mEntry = static_cast<uint32_t>(node);
+                    mTopLevel = mLevels[node];
+                }
+            }
+            // Each node's links back are made in order by one thread, and
+            // different nodes' don't touch each other
+            std::sort(backLinks.begin(), backLinks.end());
+            groups.clear();
+            for (size_t i = 0; i < backLinks.size(); ++i) {
+                if (i == 0 || backLinks[i][0] != backLinks[i - 1][0] ||
+                    backLinks[i][1] != backLinks[i - 1][1]) {
+                    groups.push_back(i);
+                }
+            }
+            groups.push_back(backLinks.size());
+            forEachOnThreads(groups.size() - 1, threadCount,
+                [&](size_t group, VisitedNodes&) {
+                    for (size_t i = groups[group]; i < groups[group + 1];
+                        ++i) {
+                        link(backLinks[i][0], backLinks[i][2], backLinks[i][1]);
+                    }
+                });
+        }
+    }
+
+    // Returns the positions of up to count lines nearest the normalized
+    // query, nearest first
+    std::vector<uint32_t> search(const std::string& query, size_t count) const {
+        std::vector<uint32_t> nearest;
+        if (empty()) {
+            return nearest;
+        }
+        std::array<float, ANN_DIMENSIONS> vector;
+        embed(query, vector.data());
+        uint32_t entry = descend(vector.data(), mEntry, mTopLevel, 0);
+        static thread_local VisitedNodes visited;
+        auto found = searchLayer(vector.data(), entry,
+            std::max<size_t>(ANN_SEARCH_BREADTH, count), 0, visited);
+        for (size_t i = 0; i < found.size() && i < count; ++i) {
+            nearest.push_back(found[i].second);
+        }
+        return nearest;
+    }
+
+    // Appends the links of every node, leaving the vectors to be embedded
+    // again from the lines
+    void write(std::string& out) const {
+        appendVarint(out, mLevels.size());
+        appendVarint(out, mEntry);
+        for (uint32_t node = 0; node < mLevels.size(); ++node) {
+            appendBytes(out, mLevels[node]);
+            for (size_t level = 0; level <= mLevels[node]; ++level) {
+                const uint32_t* nodeLinks = links(node, level);
+                appendVarint(out, nodeLinks[0]);
+                for (uint32_t i = 1; i <= nodeLinks[0]; ++i) {
+                    appendVarint(out, nodeLinks[i]);
+                }
+            }
+        }
+    }
+
+    // Reads what write wrote for the lines, where the reader fails if it
+    // doesn't fit them
+    void read(ByteReader& reader,
+        const std::vector<std::pair<size_t, WordSet>>& lines) {
+        const uint64_t count = reader.readVarint();
+        const uint64_t entry = reader.readVarint();
+        if (count != lines.size() || (count > 0 && entry >= count)) {
+            reader.fail();
+            return;
+        }
+        mLevels.resize(lines.size());
+        mUpperLinks.resize(lines.size());
+        mBaseLinks.assign(lines.size() * (2 * ANN_LINKS + 1), 0);
+        mEntry = static_cast<uint32_t>(entry);
+        for (uint32_t node = 0; node < count && !reader.failed(); ++node) {
+            mLevels[node] = reader.read<uint8_t>();
+            if (mLevels[node] > ANN_MAX_LEVEL) {
+                reader.fail();
+                break;
+            }
+            mUpperLinks[node].assign(mLevels[node] * (ANN_LINKS + 1), 0);
+            for (size_t level = 0; level <= mLevels[node]; ++level) {
+                uint32_t* nodeLinks = links(node, level);
+                const uint64_t linkCount = reader.readVarint();
+                if (linkCount > maxLinks(level)) {
+                    reader.fail();
+                    break;
+                }
+                nodeLinks[0] = static_cast<uint32_t>(linkCount);
+                for (uint32_t i = 1; i <= nodeLinks[0]; ++i) {
+                    const uint64_t link = reader.readVarint();
+                    if (link >= count) {
+                        reader.fail();
+                    }
+                    nodeLinks[i] = static_cast<uint32_t>(link);
+                }
+            }
+        }
+        if (reader.failed()) {
+            mLevels.clear();
+            return;
+        }
+        mTopLevel = count > 0 ? mLevels[mEntry] : 0;
+        embedLines(lines);
+    }
+
+    // Roughly how many bytes the graph allocates, not counting itself
+    size_t memoryBytes() const {
+        size_t bytes = mVectors.capacity() * sizeof(mVectors[0]) +
+            mLevels.capacity() * sizeof(mLevels[0]) +
+            mBaseLinks.capacity() * sizeof(mBaseLinks[0]) +
+            mUpperLinks.capacity() * sizeof(mUpperLinks[0]);
+        for (auto&& nodeLinks : mUpperLinks) {
+            bytes += nodeLinks.capacity() * sizeof(nodeLinks[0]);
+        }
+        return bytes;
+    }
+
+private:
+    using Neighbor = std::pair<float, uint32_t>;
+
+    static size_t maxLinks(size_t level) {
+        return level == 0 ? 2 * ANN_LINKS : ANN_LINKS;
+    }
+
+    void embedLines(const std::vector<std::pair<size_t, WordSet>>& lines) {
+        mVectors.resize(lines.size() * ANN_DIMENSIONS);
+        for (size_t node = 0; node < lines.size(); ++node) {
+            embed(lines[node].second.normalizedLine(), at(node));
+        }
+    }
+
+    float* at(size_t node) {
+        return &mVectors[node * ANN_DIMENSIONS];
+    }
+
+    const float* at(size_t node) const {
+        return &mVectors[node * ANN_DIMENSIONS];
+    }
+
+    // Summed in lanes, which the compiler can keep in vector registers
+    // where it couldn't reorder one sum
+    static float similarity(const float* a, const float* b) {
+        std::array<float, 8> sums = {};
+        for (size_t d = 0; d < ANN_DIMENSIONS; d += sums.size()) {
+            for (size_t lane = 0; lane < sums.size(); ++lane) {
+                sums[lane] += a[d + lane] * b[d + lane];
+            }
+        }
+        return ((sums[0] + sums[4]) + (sums[1] + sums[5])) +
+            ((sums[2] + sums[6]) + (sums[3] + sums[7]));
+    }
+
+    // The link count followed by the links of the node on the layer
+    uint32_t* links(uint32_t node, size_t level) {
+        return level == 0 ? &mBaseLinks[node * (2 * ANN_LINKS + 1)] :
+            &mUpperLinks[node][(level - 1) * (ANN_LINKS + 1)];
+    }
+
+    const uint32_t* links(uint32_t node, size_t level) const {
+        return level == 0 ? &mBaseLinks[node * (2 * ANN_LINKS + 1)] :
+            &mUpperLinks[node][(level - 1) * (ANN_LINKS + 1)];
+    }
+
+    // Calls work(i, visited) for each i below count on that many threads,
+    // each with nodes of its own to mark visited
+    template<typename Work>
+    static void forEachOnThreads(size_t count, size_t threadCount,
+        const Work& work) {
+        std::atomic<size_t> next{ 0 };
+        auto run = [&] {
+            VisitedNodes visited;
+            for (size_t i = next++; i < count; i = next++) {
+                work(i, visited);
+            }
+        };
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < threadCount && i < count; ++i) {
+            threads.emplace_back(run);
+        }
+        run();
+        for (auto&& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // Follows the nearest links down from the top level to just above the
+    // bottom one given
+    uint32_t descend(const float* vector, uint32_t entry, size_t top,
+        size_t bottom) const {
+        float best = similarity(vector, at(entry));
+        for (size_t level = top; level > bottom; --level) {
+            for (bool moved = true; moved;) {
+                moved = false;
+                const uint32_t* nodeLinks = links(entry, level);
+                const uint32_t* neighbors = nodeLinks + 1;
+                const size_t count = nodeLinks[0];
+                for (size_t i = 0; i < count; ++i) {
+                    const float near = similarity(vector, at(neighbors[i]));
+                    if (near > best) {
+                        best = near;
+                        entry = neighbors[i];
+                        moved = true;
+                    }
+                }
+            }
+        }
+        return entry;
+    }
+
+    // Returns up to breadth of the nodes nearest the vector on the layer
+    // found from the entry, nearest first
+    std::vector<Neighbor> searchLayer(const float* vector, uint32_t entry,
+        size_t breadth, size_t level, VisitedNodes& visited) const {
+        visited.clear(mLevels.size());
+        visited.visit(entry);
+        // Nearest first to look around, and farthest first to drop
+        std::priority_queue<Neighbor> candidates;
+        std::priority_queue<Neighbor, std::vector<Neighbor>,
+            std::greater<Neighbor>> found;
+        const float near = similarity(vector, at(entry));
+        candidates.emplace(near, entry);
+        found.emplace(near, entry);
+        while (!candidates.empty()) {
+            const Neighbor candidate = candidates.top();
+            if (candidate.first < found.top().first &&
+                found.size() >= breadth) {
+                break;
+            }
+            candidates.pop();
+            const uint32_t* nodeLinks = links(candidate.second, level);
+            const uint32_t* neighbors = nodeLinks + 1;
+            const size_t count = nodeLinks[0];
+            for (size_t i = 0; i < count; ++i) {
+                if (!visited.visit(neighbors[i])) {
+                    continue;
+                }
+                const float similar = similarity(vector, at(neighbors[i]));
+                if (found.size() < breadth || similar > found.top().first) {
+                    candidates.emplace(similar, neighbors[i]);
+                    found.emplace(similar, neighbors[i]);
+                    if (found.size() > breadth) {
+                        found.pop();
+                    }
+                }
+            }
+        }
+        std::vector<Neighbor> nearest(found.size());
+        for (size_t i = nearest.size(); i-- > 0; found.pop()) {
+            nearest[i] = found.top();
+        }
+        return nearest;
+    }
+
+    // Keeps the nearest candidates that are nearer the vector than any kept
+    // before them, so the links reach out in different directions
+    std::vector<uint32_t> selectNeighbors(
+        const std::vector<Neighbor>& candidates, size_t count) const {
+        std::vector<uint32_t> kept;
+        for (auto&& candidate : candidates) {
+            if (kept.size() >= count) {
+                break;
+            }
+            const float* vector = at(candidate.second);
+            bool diverse = true;
+            for (uint32_t other : kept) {
+                if (similarity(vector, at(other)) > candidate.first) {
+                    diverse = false;
+                    break;
+                }
+            }
+            if (diverse) {
+                kept.push_back(candidate.second);
+            }
+        }
+        return kept;
+    }
+
+    // Picks the node's links on each of its layers from the nodes nearest it
+    // in the graph and the nodes of its batch before it, which the graph
+    // doesn't link to yet
+    std::vector<std::vector<uint32_t>> chooseLinks(uint32_t node,
+        uint32_t batchBegin, VisitedNodes& visited) const {
+        const float* vector = at(node);
+        const size_t level = mLevels[node];
+        std::vector<std::vector<uint32_t>> chosen(level + 1);
+        uint32_t entry = descend(vector, mEntry, mTopLevel, level);
+        for (size_t layer = level + 1; layer-- > 0;) {
+            std::vector<Neighbor> candidates;
+            if (layer <= mTopLevel) {
+                candidates = searchLayer(vector, entry, ANN_BUILD_BREADTH,
+                    layer, visited);
+                entry = candidates.front().second;
+            }
+            for (uint32_t other = batchBegin; other < node; ++other) {
+                if (mLevels[other] >= layer) {
+                    candidates.emplace_back(similarity(vector, at(other)),
+                        other);
+                }
+            }
+            std::sort(candidates.begin(), candidates.end(),
+                std::greater<Neighbor>());
+            chosen[layer] = selectNeighbors(candidates, ANN_LINKS);
+        }
+        return chosen;
+    }
+
+    // Links the neighbor back to the node, dropping its links that stop
+    // being worth keeping if it has too many
+    void link(uint32_t neighbor, uint32_t node, size_t level) {
+        uint32_t* neighborLinks = links(neighbor, level);
+        if (neighborLinks[0] < maxLinks(level)) {
+            neighborLinks[++neighborLinks[0]] = node;
+            return;
+        }
+        const float* vector = at(neighbor);
+        std::vector<Neighbor> candidates;
+        candidates.emplace_back(similarity(vector, at(node)), node);
+        for (uint32_t i = 1; i <= neighborLinks[0]; ++i) {
+            candidates.emplace_back(
+                similarity(vector, at(neighborLinks[i])), neighborLinks[i]);
+        }
+        std::sort(candidates.begin(), candidates.end(),
+            std::greater<Neighbor>());
+        const std::vector<uint32_t> kept =
+            selectNeighbors(candidates, maxLinks(level));
+        neighborLinks[0] = static_cast<uint32_t>(kept.size());
+        std::copy(kept.begin(), kept.end(), neighborLinks + 1);
+    }
+
+    // Each line's vector, one after another
+    std::vector<float> mVectors;
+    // The highest layer each node is on, and its links on the bottom layer
+    // and on each layer above it
+    std::vector<uint8_t> mLevels;
+    std::vector<uint32_t> mBaseLinks;
+    std::vector<std::vector<uint32_t>> mUpperLinks;
+    uint32_t mEntry = 0;
+    size_t mTopLevel = 0;
+};
+
+class Document {
+public:
+    // Facts about the whole document gathered while loading it
+    struct Facts {
+        bool isAscii = true;
+        size_t maxLineLength = 0;
+        size_t vocabularySize = 0;
+    };
+
+    // Only loads the lines from begin to end if given, still numbering them
+    // as in the whole document. Loading on more than one thread gives the
+    // same document
+    Document(const std::vector<std::string>& documentLines, size_t begin = 0,
+        size_t end = SIZE_MAX, size_t threadCount = 1) {
+        end = std::min(end, documentLines.size());
+        begin = std::min(begin, end);
+        if (threadCount > 1) {
+            loadInParallel(documentLines, begin, end, threadCount);
+            prepareSeeding();
+            return;
+        }
+        // Sized up front so the table is counted apart from what fills it
+        {
+            MemoryCategoryScope scope(MemoryCategory::LineTable);
+            mNonEmtpyLines.reserve(static_cast<size_t>(std::count_if(
+                documentLines.begin() + static_cast<std::ptrdiff_t>(begin),
+                documentLines.begin() + static_cast<std::ptrdiff_t>(end),
+                [](const std::string& line) { return line.size() > 0; })));
+        }
+        for (size_t i = begin; i < end; ++i) {
+            addLine(i, documentLines[i]);
+        }
+        mFacts.vocabularySize = mVocabulary.size();
+        prepareSeeding();
+    }
+
+    // Tells the constructor below to only outline the document
+    struct Outline {};
+
+    // Only fingerprints the document, and numbers its words if asked to,
+    // keeping none of its lines, for when they're searched somewhere else
+    Document(const std::vector<std::string>& documentLines, Outline,
+        bool numberWords) {
+        for (auto&& line : documentLines) {
+            mFingerprint = fingerprintLine(mFingerprint, line);
+            if (!numberWords || line.empty()) {
+                continue;
+            }
+            // Numbered in the same order as adding the line would
+            const WordSet wordSet(line);
+            mFacts.isAscii = mFacts.isAscii && wordSet.isAscii();
+            mFacts.maxLineLength =
+                std::max(mFacts.maxLineLength, wordSet.length());
+            MemoryCategoryScope scope(MemoryCategory::Vocabulary);
+            for (auto&& word : wordSet.words()) {
+                mVocabulary.add(word.first);
+            }
+        }
+        mFacts.vocabularySize = mVocabulary.size();
+    }
+
+    // Loads lines numbered however the caller likes, in increasing order,
+    // such as the lines of one segment of an edited document
+    explicit Document(
+        const std::vector<std::pair<size_t, std::string>>& numberedLines) {
+        {
+            MemoryCategoryScope scope(MemoryCategory::LineTable);
+            mNonEmtpyLines.reserve(static_cast<size_t>(std::count_if(
+                numberedLines.begin(), numberedLines.end(),
+                [](const std::pair<size_t, std::string>& line) {
+                    return line.second.size() > 0;
+                })));
+        }
+        for (auto&& line : numberedLines) {
+            addLine(line.first, line.second);
+        }
+        mFacts.vocabularySize = mVocabulary.size();
+        prepareSeeding();
+    }
+
+    // Reads a document written by writeIndex for lineCount lines, where the
+    // reader fails if it's cut off or refers to lines past the end
+    Document(ByteReader& reader, size_t lineCount) {
+        mFingerprint = reader.read<uint64_t>();
+        mFacts.isAscii = reader.read<uint8_t>() != 0;
+        mFacts.maxLineLength = static_cast<size_t>(reader.readVarint());
+        const uint64_t vocabularySize = reader.readVarint();
+        {
+            MemoryCategoryScope scope(MemoryCategory::Vocabulary);
+            for (uint64_t i = 0; i < vocabularySize && !reader.failed(); ++i) {
+                mVocabulary.add(reader.readString());
+            }
+        }
+        // The word sets refer to words by number, so they must all be there
+        if (mVocabulary.size() != vocabularySize) {
+            reader.fail();
+        }
+        mFacts.vocabularySize = mVocabulary.size();
+        const uint64_t nonEmptyCount = reader.readVarint();
+        {
+            MemoryCategoryScope scope(MemoryCategory::LineTable);
+            mNonEmtpyLines.reserve(static_cast<size_t>(
+                std::min<uint64_t>(nonEmptyCount, lineCount)));
+        }
+        MemoryCategoryScope scope(MemoryCategory::NormalizedText);
+        for (uint64_t i = 0; i < nonEmptyCount && !reader.failed(); ++i) {
+            const uint64_t lineIndex = reader.readVarint();
+            if (lineIndex >= lineCount) {
+                reader.fail();
+                break;
+            }
+            mNonEmtpyLines.emplace_back(static_cast<size_t>(lineIndex),
+                WordSet(reader, mVocabulary));
+        }
+        // A nearest neighbor graph is only there if it was built
+        if (!reader.failed() && !reader.atEnd()) {
+            MemoryCategoryScope graphScope(MemoryCategory::LineTable);
+            mAnn.read(reader, mNonEmtpyLines);
+        }
+        if (!reader.failed()) {
+            prepareSeeding();
+        }
+    }
+
+    // Appends everything built from the lines, so the document can be read
+    // back without normalizing and counting them again
+    void writeIndex(std::string& out) const {
+        appendBytes(out, mFingerprint);
+        appendBytes(out, static_cast<uint8_t>(mFacts.isAscii));
+        appendVarint(out, mFacts.maxLineLength);
+        appendVarint(out, mVocabulary.size());
+        for (uint32_t id = 0; id < mVocabulary.size(); ++id) {
+            appendString(out, mVocabulary.word(id));
+        }
+        appendVarint(out, mNonEmtpyLines.size());
+        for (auto&& line : mNonEmtpyLines) {
+            appendVarint(out, line.first);
+            line.second.writePretokenized(out, mVocabulary);
+        }
+        if (!mAnn.empty()) {
+            mAnn.write(out);
+        }
+    }
+
+    // Roughly how many bytes the document takes
+    size_t memoryBytes() const {
+        size_t bytes = sizeof(Document) + mVocabulary.memoryBytes() +
+            mNonEmtpyLines.capacity() * sizeof(mNonEmtpyLines[0]) +
+            mByText.capacity() * sizeof(mByText[0]) +
+            mBlocks.capacity() * sizeof(mBlocks[0]) +
+            mSignatures.memoryBytes() + mAnn.memoryBytes() +
+            mSharedPrefixes.capacity() * sizeof(mSharedPrefixes[0]) +
+            mByLength.capacity() * sizeof(mByLength[0]) +
+            mWordLines.capacity() * sizeof(mWordLines[0]);
+        for (auto&& line : mNonEmtpyLines) {
+            bytes += line.second.memoryBytes();
+        }
+        for (auto&& block : mBlocks) {
+            bytes += block.memoryBytes();
+        }
+        return bytes;
+    }
+
+    const Facts& facts() const {
+        return mFacts;
+    }
+
+    size_t nonEmptyLineCount() const {
+        return mNonEmtpyLines.size();
+    }
+
+    const Vocabulary& vocabulary() const {
+        return mVocabulary;
+    }
+
+    // Identifies the document's exact contents, so files made from it can
+    // tell if they still match it
+    uint64_t fingerprint() const {
+        return mFingerprint;
+    }
+
+    // FNV-1a over each line followed by a line break, starting from
+    // EMPTY_FINGERPRINT, so documents never loaded whole get the same one
+    static uint64_t fingerprintLine(uint64_t hash, const std::string& line) {
+        for (char c : line) {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001B3ull;
+        }
+        return (hash ^ '\n') * 0x100000001B3ull;
+    }
+
+    void printStats(std::ostream& stream) const {
+        stream << "Document: " << mNonEmtpyLines.size() << " non-empty lines, "
+            << (mFacts.isAscii ? "ASCII only" : "has multibyte characters")
+            << ", longest line " << mFacts.maxLineLength << " bytes, "
+            << mFacts.vocabularySize << " distinct words";
+        if (!mByText.empty()) {
+            size_t shared = 0, total = 0;
+            for (size_t i = 0; i < mByText.size(); ++i) {
+                shared += mSharedPrefixes[i];
+                total += mNonEmtpyLines[mByText[i]].second.length();
+            }
+            stream << ", " << 100.0 * static_cast<double>(shared) /
+                static_cast<double>(std::max<size_t>(total, 1))
+                << "% of the text in shared prefixes";
+        }
+        if (!mBlocks.empty()) {
+            stream << ", " << mBlocks.size() << " blocks";
+        }
+        if (!mSignatures.empty()) {
+            stream << ", " << mSignatures.memoryBytes() / 1024
+                << " KiB of signatures";
+        }
+        if (!mAnn.empty()) {
+            stream << ", " << mAnn.memoryBytes() / 1024
+                << " KiB of nearest neighbor graph";
+        }
+        stream << '\n';
+    }
+
+    // Groups the lines into blocks separated by empty lines, like stanzas or
+    // paragraphs, summarizing each so searches can rule out whole blocks.
+    // With a limit, searches only go through that many of the blocks most
+    // likely to have the best line, which may miss it
+    void groupBlocks(size_t searchLimit = SIZE_MAX) {
+        mBlockLimit = searchLimit;
+        MemoryCategoryScope scope(MemoryCategory::LineTable);
+        mBlocks.clear();
+        for (size_t position = 0; position < mNonEmtpyLines.size();
+            ++position) {
+            const bool follows = position > 0 &&
+                mNonEmtpyLines[position - 1].first + 1 ==
+                mNonEmtpyLines[position].first;
+            if (!follows) {
+                mBlocks.emplace_back(position);
+            }
+            mBlocks.back().add(mNonEmtpyLines[position].second, mVocabulary);
+        }
+    }
+
+    // Keeps the words and runes of each line in the bit-sliced rows of a
+    // signature index, so searches can rule out lines many at a time
+    void buildSignatures() {
+        MemoryCategoryScope scope(MemoryCategory::LineTable);
+        mSignatures.build(mNonEmtpyLines, mVocabulary);
+    }
+
+    // Makes searches only score the lines a nearest neighbor graph finds
+    // nearest the query, building the graph on that many threads unless it
+    // was loaded with the document. Far faster for large documents, but may
+    // miss the best line
+    void searchApproximately(size_t threadCount) {
+        if (mAnn.empty()) {
+            MemoryCategoryScope scope(MemoryCategory::LineTable);
+            mAnn.build(mNonEmtpyLines, threadCount);
+        }
+        mApproximate = true;
+    }
+
+    // Orders the lines by their normalized text, so the lines starting the
+    // same way come together, as they would in a trie. Searches then find
+    // the longest run each line shares with the query with one row per
+    // character of the trie, instead of one per character of every line
+    void sharePrefixes() {
+        {
+            MemoryCategoryScope scope(MemoryCategory::LineTable);
+            mByText.resize(mNonEmtpyLines.size());
+            mSharedPrefixes.resize(mNonEmtpyLines.size());
+        }
+        std::iota(mByText.begin(), mByText.end(), size_t(0));
+        std::sort(mByText.begin(), mByText.end(), [this](size_t a, size_t b) {
+            return mNonEmtpyLines[a].second.normalizedLine() <
+                mNonEmtpyLines[b].second.normalizedLine();
+        });
+        for (size_t i = 1; i < mByText.size(); ++i) {
+            const std::string& previous =
+                mNonEmtpyLines[mByText[i - 1]].second.normalizedLine();
+            const std::string& line =
+                mNonEmtpyLines[mByText[i]].second.normalizedLine();
+            const size_t length = std::min(previous.size(), line.size());
+            size_t shared = 0;
+            while (shared < length && previous[shared] == line[shared]) {
+                ++shared;
+            }
+            mSharedPrefixes[i] = shared;
+        }
+    }
+
+    // What a search did and where its time went
+    struct SearchProfile {
+        const char* strategy = "";
+        size_t linesScored = 0;
+        // Lines a bound or a signature showed couldn't replace the best
+        size_t linesPruned = 0;
+        // Lines never looked at: after a perfect match, in skipped blocks,
+        // past the deadline, or replaced since by edits
+        size_t linesSkipped = 0;
+        double bestScore = -1.0;
+        ScoreTimes times;
+    };
+
+    // Lets every line through where a search takes a filter
+    struct EveryLine {
+        bool operator()(size_t) const {
+            return true;
+        }
+    };
+
+    // When a search stops looking, giving the best line it found by then,
+    // which may not be the best there is
+    struct Deadline {
+        std::chrono::steady_clock::time_point time;
+        // Set by the search that stopped before the end
+        bool reached = false;
+    };
+
+    // Returns the index of the line that best matches the words given
+    size_t fuzzyFind(const WordSet& wordSet) const {
+        double bestScore;
+        return fuzzyFind(wordSet, bestScore);
+    }
+
+    // Same as above, also giving the best line's score, or -1 if no line
+    // scored higher than that and the line given is 0
+    size_t fuzzyFind(const WordSet& wordSet, double& bestScore) const {
+        return fuzzyFind(wordSet, bestScore, EveryLine());
+    }
+
+    // Same as above, only scoring the lines isLive(lineIndex) is true for,
+    // stopping at the deadline if there is one, and recording what the search
+    // did in the profile if there is one, which makes it slower
+    template<typename IsLive>
+    size_t fuzzyFind(const WordSet& wordSet, double& bestScore,
+        const IsLive& isLive, Deadline* deadline = nullptr,
+        SearchProfile* profile = nullptr) const {
+        if (mApproximate) {
+            return findApproximately(wordSet, bestScore, isLive, profile);
+        }
+        // Pick the scoring with as much of the UTF-8 handling compiled out as
+        // the query and the document allow
+        if (wordSet.isAscii()) {
+            return fuzzyFind<true, false>(wordSet, bestScore, isLive, deadline,
+                profile);
+        }
+        if (mFacts.isAscii) {
+            return fuzzyFind<false, true>(wordSet, bestScore, isLive, deadline,
+                profile);
+        }
+        return fuzzyFind<false, false>(wordSet, bestScore, isLive, deadline,
+            profile);
+    }
+
+private:
+    template<bool AsciiQuery, bool AsciiDocument, typename IsLive>
+    size_t fuzzyFind(const WordSet& wordSet, double& bestScore,
+        const IsLive& isLive, Deadline* deadline,
+        SearchProfile* profile) const {
+        // Ties go to the earliest line, so the best is kept by position, and
+        // there is none until a line scores above -1
+        const size_t none = mNonEmtpyLines.size();
+        size_t bestPosition = none;
+        bestScore = -1.0;
+        uint64_t scoredInFull = 0, prunedByBound = 0;
+        std::vector<size_t> runs;
+        findRuns(wordSet.normalizedLine(), runs);
+        // What a line there has to score to replace the best
+        auto minimumAt = [&](size_t position) {
+            const bool wins = bestPosition != none && position < bestPosition;
+            return wins ? bestScore : std::nextafter(bestScore, 2.0);
+        };
+        // Only lines that would replace the best are scored in full
+        auto score = [&](size_t position) {
+            auto&& line = mNonEmtpyLines[position];
+            const double minimum = minimumAt(position);
+            bool bounded;
+            const double score = line.second.measureContainment<
+                AsciiQuery, AsciiDocument>(wordSet, minimum, bounded,
+                    runs.empty() ? UNKNOWN_RUN : runs[position],
+                    profile ? &profile->times : nullptr);
+            ++(bounded ? prunedByBound : scoredInFull);
+            if (score >= minimum) {
+                bestPosition = position;
+                bestScore = score;
+            }
+        };
+
+        // A good score from a sample lets the scan below skip far more lines
+        std::array<size_t, SEED_SAMPLE_LINES> sample;
+        const size_t sampleSize = sampleLines(wordSet, sample);
+        for (size_t i = 0; i < sampleSize; ++i) {
+            if (isLive(mNonEmtpyLines[sample[i]].first)) {
+                score(sample[i]);
+            }
+        }
+
+        // Lines whose signatures show they can't replace the best are passed
+        // over without looking at their words, bounding a chunk at a time
+        const bool filtered = !mSignatures.empty() && !wordSet.words().empty();
+        SignatureIndex::Query signatureQuery;
+        if (filtered) {
+            signatureQuery = mSignatures.prepare(wordSet, mVocabulary);
+        }
+        std::array<double, SIGNATURE_CHUNK_LINES> chunkBounds;
+        size_t boundedChunk = SIZE_MAX;
+        uint64_t filteredOut = 0;
+        auto passes = [&](size_t position) {
+            if (!filtered) {
+                return true;
+            }
+            const size_t chunk = position / SIGNATURE_CHUNK_LINES;
+            if (chunk != boundedChunk) {
+                mSignatures.bound(signatureQuery, chunk, chunkBounds);
+                boundedChunk = chunk;
+            }
+            if (chunkBounds[position % SIGNATURE_CHUNK_LINES] <
+                minimumAt(position)) {
+                ++filteredOut;
+                return false;
+            }
+            return true;
+        };
+
+        size_t* sampleEnd = sample.data() + sampleSize;
+        std::sort(sample.data(), sampleEnd);
+        // Past the deadline, the lines not scanned yet are left unscored
+        auto isLate = [&](size_t linesScanned) {
+            if (deadline == nullptr ||
+                linesScanned % DEADLINE_CHECK_LINES != 0) {
+                return false;
+            }
+            if (std::chrono::steady_clock::now() >= deadline->time) {
+                deadline->reached = true;
+            }
+            return deadline->reached;
+        };
+        bool stopped = false;
+        auto scan = [&](size_t begin, size_t end) {
+            const size_t* sampled =
+                std::lower_bound(sample.data(), sampleEnd, begin);
+            for (size_t position = begin; position < end; ++position) {
+                // Nothing after a perfect match can take its place
+                if (bestScore == 1.0 && position >= bestPosition) {
+                    break;
+                }
+                if (isLate(position - begin)) {
+                    stopped = true;
+                    break;
+                }
+                if (sampled < sampleEnd && *sampled == position) {
+                    ++sampled;
+                    continue;
+                }
+                if (isLive(mNonEmtpyLines[position].first) &&
+                    passes(position)) {
+                    score(position);
+                }
+            }
+        };
+
+        // Without words to bound blocks by, every line is scanned
+        if (mBlocks.empty() || wordSet.words().empty()) {
+            scan(0, none);
+        }
+        else {
+            // Blocks are searched most promising first, skipping those whose
+            // bounds show none of their lines could replace the best
+            std::vector<QueryWord> queryWords;
+            for (auto&& word : wordSet.words()) {
+                queryWords.push_back({ mVocabulary.find(word.first),
+                    word.second, word.first.size() });
+            }
+            std::vector<std::pair<double, size_t>> ranked;
+            ranked.reserve(mBlocks.size());
+            for (size_t i = 0; i < mBlocks.size(); ++i) {
+                ranked.emplace_back(mBlocks[i].bound(wordSet, queryWords), i);
+            }
+            std::sort(ranked.begin(), ranked.end(),
+                [](const std::pair<double, size_t>& a,
+                    const std::pair<double, size_t>& b) {
+                    return a.first > b.first ||
+                        (a.first == b.first && a.second < b.second);
+                });
+            uint64_t searched = 0, skipped = 0;
+            for (auto&& block : ranked) {
+                const BlockSummary& summary = mBlocks[block.second];
+                if (stopped || searched >= mBlockLimit ||
+                    block.first < minimumAt(summary.begin())) {
+                    ++skipped;
+                    continue;
+                }
+                ++searched;
+                scan(summary.begin(), summary.end());
+            }
+            blocksSearched.fetch_add(searched, std::memory_order_relaxed);
+            blocksSkipped.fetch_add(skipped, std::memory_order_relaxed);
+        }
+        linesScoredInFull.fetch_add(scoredInFull, std::memory_order_relaxed);
+        linesPrunedByBound.fetch_add(prunedByBound, std::memory_order_relaxed);
+        linesFilteredBySignature.fetch_add(filteredOut,
+            std::memory_order_relaxed);
+        if (profile) {
+            profile->strategy = AsciiQuery ? "ascii query" :
+                AsciiDocument ? "ascii document" : "utf-8";
+            profile->linesScored += scoredInFull;
+            profile->linesPruned += prunedByBound + filteredOut;
+            profile->linesSkipped +=
+                none - scoredInFull - prunedByBound - filteredOut;
+            profile->bestScore = bestScore;
+        }
+        return bestPosition != none ? mNonEmtpyLines[bestPosition].first : 0;
+    }
+
+    // Scores the lines the graph finds nearest the query, the best score
+    // winning and then the first line
+    template<typename IsLive>
+    size_t findApproximately(const WordSet& wordSet, double& bestScore,
+        const IsLive& isLive, SearchProfile* profile) const {
+        std::vector<uint32_t> nearest =
+            mAnn.search(wordSet.normalizedLine(), ANN_RERANK_LINES);
+        std::sort(nearest.begin(), nearest.end());
+        bestScore = -1.0;
+        size_t bestLine = 0;
+        size_t scored = 0;
+        for (uint32_t position : nearest) {
+            auto&& line = mNonEmtpyLines[position];
+            if (!isLive(line.first)) {
+                continue;
+            }
+            const double score = profile ?
+                line.second.measureContainment(wordSet, profile->times) :
+                line.second.measureContainment(wordSet);
+            ++scored;
+            if (score > bestScore) {
+                bestScore = score;
+                bestLine = line.first;
+            }
+        }
+        linesScoredInFull.fetch_add(scored, std::memory_order_relaxed);
+        if (profile) {
+            profile->strategy = "approximate";
+            profile->linesScored += scored;
+            profile->linesSkipped += mNonEmtpyLines.size() - scored;
+            profile->bestScore = bestScore;
+        }
+        return bestLine;
+    }
+
+    // Finds the longest run each line shares with the query, if the lines
+    // share prefixes, leaving the runs empty otherwise. Row d of the table
+    // holds the runs ending at character d of the line and each character of
+    // the query, so a line only needs the rows past the prefix it shares
+    // with the line before it
+    void findRuns(const std::string& query, std::vector<size_t>& runs) const {
+        const size_t width = query.size() + 1;
+        if (mByText.empty() ||
+            (mFacts.maxLineLength + 1) * width > PREFIX_ROW_CELLS) {
+            return;
+        }
+        // Only the cells where the characters match can hold a run, so each
+        // row only visits where the query has the line's character
+        std::array<uint32_t, 257> matchesBegin = {};
+        for (char c : query) {
+            ++matchesBegin[static_cast<unsigned char>(c) + 1];
+        }
+        for (size_t c = 1; c < matchesBegin.size(); ++c) {
+            matchesBegin[c] += matchesBegin[c - 1];
+        }
+        std::vector<uint32_t> matches(query.size());
+        {
+            std::array<uint32_t, 256> next;
+            std::copy(matchesBegin.begin(), matchesBegin.end() - 1,
+                next.begin());
+            for (size_t j = 0; j < query.size(); ++j) {
+                matches[next[static_cast<unsigned char>(query[j])]++] =
+                    static_cast<uint32_t>(j);
+            }
+        }
+
+        runs.resize(mNonEmtpyLines.size());
+        // Cells are never cleared, so one is only read when its characters
+        // match, which means it was written for the line being searched
+        std::vector<uint32_t> rows((mFacts.maxLineLength + 1) * width);
+        // The longest run in the first d characters, for each d
+        std::vector<size_t> longest(mFacts.maxLineLength + 1);
+        for (size_t i = 0; i < mByText.size(); ++i) {
+            const std::string& line =
+                mNonEmtpyLines[mByText[i]].second.normalizedLine();
+            for (size_t d = mSharedPrefixes[i]; d < line.size(); ++d) {
+                const uint32_t* above = &rows[d * width];
+                uint32_t* row = &rows[(d + 1) * width];
+                const unsigned char c = static_cast<unsigned char>(line[d]);
+                size_t best = longest[d];
+                for (uint32_t m = matchesBegin[c]; m < matchesBegin[c + 1];
+                    ++m) {
+                    const size_t j = matches[m];
+                    const bool extends =
+                        d > 0 && j > 0 && line[d - 1] == query[j - 1];
+                    row[j + 1] = extends ? above[j] + 1 : 1;
+                    best = std::max<size_t>(best, row[j + 1]);
+                }
+                longest[d + 1] = best;
+            }
+            runs[mByText[i]] = longest[line.size()];
+        }
+    }
+
+    // Fills the sample with up to SEED_SAMPLE_LINES positions of lines likely
+    // to score well: lines with the query's rarest words, then lines about as
+    // long as the query, then lines spread evenly over the document
+    // Returns how many it picked, which is none for short documents
+    size_t sampleLines(const WordSet& wordSet,
+        std::array<size_t, SEED_SAMPLE_LINES>& sample) const {
+        if (mByLength.empty()) {
+            return 0;
+        }
+        size_t sampleSize = 0;
+        auto pick = [&](size_t position) {
+            if (sampleSize < sample.size() && std::find(sample.begin(),
+                sample.begin() + static_cast<std::ptrdiff_t>(sampleSize),
+                position) == sample.begin() +
+                    static_cast<std::ptrdiff_t>(sampleSize)) {
+                sample[sampleSize++] = position;
+            }
+        };
+
+        // Rare words pick out the few lines that can share them
+        std::vector<const WordLines*> words;
+        for (auto&& word : wordSet.words()) {
+            const uint32_t id = mVocabulary.find(word.first);
+            if (id != UNKNOWN_WORD_ID) {
+                words.push_back(&mWordLines[id]);
+            }
+        }
+        std::sort(words.begin(), words.end(),
+            [](const WordLines* a, const WordLines* b) {
+                return a->count < b->count;
+            });
+        const size_t wordPicks = sample.size() / 2;
+        for (auto&& word : words) {
+            const size_t kept = std::min<size_t>(word->count, SEED_WORD_LINES);
+            for (size_t i = 0; i < kept && sampleSize < wordPicks; ++i) {
+                pick(word->positions[i]);
+            }
+        }
+
+        // Shared sequences can't be long when the lengths are far apart
+        const size_t lengthPicks = sampleSize + sample.size() / 4;
+        const size_t nearest = static_cast<size_t>(std::lower_bound(
+            mByLength.begin(), mByLength.end(), wordSet.length(),
+            [this](size_t position, size_t length) {
+                return mNonEmtpyLines[position].second.length() < length;
+            }) - mByLength.begin());
+        for (size_t below = nearest, above = nearest;
+            sampleSize < lengthPicks &&
+                (below > 0 || above < mByLength.size());) {
+            if (above < mByLength.size()) {
+                pick(mByLength[above++]);
+            }
+            if (below > 0 && sampleSize < lengthPicks) {
+                pick(mByLength[--below]);
+            }
+        }
+
+        // Whatever is left over samples the whole document
+        const size_t spreadPicks = sample.size() - sampleSize;
+        for (size_t i = 0; i < spreadPicks; ++i) {
+            pick(mNonEmtpyLines.size() * (2 * i + 1) / (2 * spreadPicks));
+        }
+        return sampleSize;
+    }
+
+    // Indexes the lines by length and by word for sampling, once they're all
+    // loaded, if the document is long enough to sample
+    void prepareSeeding() {
+        if (mNonEmtpyLines.size() < SEED_MINIMUM_LINES) {
+            return;
+        }
+        {
+            MemoryCategoryScope scope(MemoryCategory::LineTable);
+            mByLength.resize(mNonEmtpyLines.size());
+        }
+        std::iota(mByLength.begin(), mByLength.end(), size_t(0));
+        std::stable_sort(mByLength.begin(), mByLength.end(),
+            [this](size_t a, size_t b) {
+                return mNonEmtpyLines[a].second.length() <
+                    mNonEmtpyLines[b].second.length();
+            });
+        {
+            MemoryCategoryScope scope(MemoryCategory::Vocabulary);
+            mWordLines.resize(mVocabulary.size());
+        }
+        for (size_t position = 0; position < mNonEmtpyLines.size();
+            ++position) {
+            for (auto&& word : mNonEmtpyLines[position].second.words()) {
+                const uint32_t id = mVocabulary.find(word.first);
+                if (id == UNKNOWN_WORD_ID) {
+                    continue;
+                }
+                WordLines& lines = mWordLines[id];
+                if (lines.count < SEED_WORD_LINES) {
+                    lines.positions[lines.count] = position;
+                }
+                ++lines.count;
+            }
+        }
+    }
+
+    // Normalizes and counts a part of the lines on each thread, collecting
+    // their words together, then numbers the words in order of appearance
+    void loadInParallel(const std::vector<std::string>& documentLines,
+        size_t begin, size_t end, size_t threadCount) {
+        std::vector<size_t> nonEmptyLines;
+        for (size_t i = begin; i < end; ++i) {
+            mFingerprint = fingerprintLine(mFingerprint, documentLines[i]);
+            if (documentLines[i].size() > 0) {
+                nonEmptyLines.push_back(i);
+            }
+        }
+        threadCount = std::max<size_t>(1,
+            std::min(threadCount, nonEmptyLines.size()));
+        std::vector<std::vector<std::pair<size_t, WordSet>>> parts(threadCount);
+        ConcurrentWordTable words;
+        auto work = [&](size_t part) {
+            const size_t partBegin = nonEmptyLines.size() * part / threadCount;
+            const size_t partEnd =
+                nonEmptyLines.size() * (part + 1) / threadCount;
+            // Lines come in order, so the first appearance in a part stays
+            std::unordered_map<std::string, FirstAppearance> partWords;
+            {
+                MemoryCategoryScope scope(MemoryCategory::NormalizedText);
+                parts[part].reserve(partEnd - partBegin);
+                for (size_t i = partBegin; i < partEnd; ++i) {
+                    const size_t lineIndex = nonEmptyLines[i];
+                    parts[part].emplace_back(lineIndex,
+                        documentLines[lineIndex]);
+                    size_t rank = 0;
+                    for (auto&& word : parts[part].back().second.words()) {
+                        partWords.emplace(word.first,
+                            FirstAppearance{ lineIndex, rank++ });
+                    }
+                }
+            }
+            MemoryCategoryScope scope(MemoryCategory::Vocabulary);
+            for (auto&& word : partWords) {
+                words.note(word.first, word.second);
+            }
+        };
+        std::vector<std::thread> threads;
+        for (size_t part = 1; part < threadCount; ++part) {
+            threads.emplace_back(work, part);
+        }
+        work(0);
+        for (auto&& thread : threads) {
+            thread.join();
+        }
+
+        {
+            MemoryCategoryScope scope(MemoryCategory::LineTable);
+            mNonEmtpyLines.reserve(nonEmptyLines.size());
+        }
+        for (auto&& part : parts) {
+            for (auto&& line : part) {
+                mFacts.isAscii = mFacts.isAscii && line.second.isAscii();
+                mFacts.maxLineLength =
+                    std::max(mFacts.maxLineLength, line.second.length());
+                mNonEmtpyLines.push_back(std::move(line));
+            }
+        }
+        MemoryCategoryScope scope(MemoryCategory::Vocabulary);
+        words.number(mVocabulary);
+        mFacts.vocabularySize = mVocabulary.size();
+    }
+
+    void addLine(size_t lineIndex, const std::string& line) {
+        mFingerprint = fingerprintLine(mFingerprint, line);
+        if (line.size() > 0) {
+            {
+                MemoryCategoryScope scope(MemoryCategory::NormalizedText);
+                mNonEmtpyLines.emplace_back(lineIndex, line);
+            }
+            // Each line knows its own facts, so only the totals go here
+            const WordSet& wordSet = mNonEmtpyLines.back().second;
+            mFacts.isAscii = mFacts.isAscii && wordSet.isAscii();
+            mFacts.maxLineLength =
+                std::max(mFacts.maxLineLength, wordSet.length());
+            MemoryCategoryScope scope(MemoryCategory::Vocabulary);
+            for (auto&& word : wordSet.words()) {
+                mVocabulary.add(word.first);
+            }
+        }
+    }
+
+    Facts mFacts;
+    Vocabulary mVocabulary;
+    uint64_t mFingerprint = EMPTY_FINGERPRINT;
+    // Only need to search the lines that aren't empty
+    // Keep the original line numbers though, so we can return the correct line
+    std::vector<std::pair<size_t, WordSet>> mNonEmtpyLines;
+
+    // When grouped, the blocks of lines between empty lines, and how many of
+    // the most promising a search goes through at most
+    std::vector<BlockSummary> mBlocks;
+    size_t mBlockLimit = SIZE_MAX;
+
+    // When built, every line's words and runes as rows of bits
+    SignatureIndex mSignatures;
+
+    // When built or loaded, the lines' nearest neighbors, and whether
+    // searches only score those nearest the query
+    AnnIndex mAnn;
+    bool mApproximate = false;
+
+    // When sharing prefixes, the positions of the non-empty lines in order of
+    // their normalized text, and how much each shares with the one before
+    std::vector<size_t> mByText;
+    std::vector<size_t> mSharedPrefixes;
+
+    // How many lines a word appears in, and the first few of them
+    struct WordLines {
+        size_t count = 0;
+        std::array<size_t, SEED_WORD_LINES> positions;
+    };
+    // For sampling, the positions of the non-empty lines from shortest to
+    // longest, and the lines each word appears in by the word's number
+    std::vector<size_t> mByLength;
+    std::vector<WordLines> mWordLines;
+};
+
+int main(int argc, char** argv) {
+    // Options come first and apply to every mode, so handle them up front
+    Options options;
+    const int optionCount = parseOptions(argc, argv, options);
+    if (optionCount < 0) {
+        printUsage();
+        return 1;
+    }
+    // Only what's allocated from here on is counted
+    if (options.memoryReport) {
+        startMemoryTracking();
+    }
+    if (!options.simdLevel.empty()) {
+        SimdLevel level;
+        if (!parseSimdLevel(options.simdLevel, level)) {
+            std::cout << "Unknown SIMD level: " << options.simdLevel
+                << std::endl;
+            printUsage();
+            return 1;
+        }
+        if (!selectSimdLevel(level)) {
+            std::cout << "SIMD level not supported by this CPU: "
+                << options.simdLevel << std::endl;
+            return 1;
+        }
+    }
+    // Hide the options from the modes below by moving the program name after
+    argv[optionCount] = argv[0];
+    argc -= optionCount;
+    argv += optionCount;
+
+    // If no arguments, use a defalt text file location and wait for input
+    if (argc <= 1) {
+        // Prompt now so the display is not delayed by the document loading
+        std::cout << '>';
+        std::cout.flush();
+        // The document should be loaded quite quickly while waiting for input
+        prepareRunKernels(options);
+        std::vector<std::string> defaultDocumentLines;
+        {
+            MemoryCategoryScope scope(MemoryCategory::RawText);
+            readAllLines(DEFAULT_PATH, defaultDocumentLines);
+        }
+        if (defaultDocumentLines.empty()) {
+            std::cout << "Could not open default source file: " << DEFAULT_PATH
+                << std::endl;
+            printUsage();
+            return 1;
+        }
+        Document document(defaultDocumentLines);
+        // Fetch a line of input for the word set
+        std::string wordSetLine;
+        std::getline(std::cin, wordSetLine);
+        // Search the loaded document for the word set and output the match
+        size_t documentLineIndex = document.fuzzyFind(WordSet(wordSetLine));
+        std::cout << defaultDocumentLines[documentLineIndex] << std::endl;
+        if (options.stats) {
+            document.printStats(std::cerr);
+            printRunKernelStats(std::cerr);
+            printPruningStats(std::cerr);
+        }
+        if (options.memoryReport) {
+            printMemoryReport(std::cerr, defaultDocumentLines.size(),
+                document.nonEmptyLineCount());
+        }
+        return 0;
+    }
+    // Kernel benchmarks don't need a document
+    if (argv[1] == std::string("--benchmark")) {
+        return benchmarkMain(argc, argv, options);
+    }
+    if (argv[1] == std::string("--startup-probe")) {
+        return startupProbeMain(argc, argv, options);
+    }
+    // Serving keeps running, answering requests for any registered document
+    if (argv[1] == std::string("--serve")) {
+        return serverMain(argc, argv, options);
+    }
+    if (argv[1] == std::string("--build-index")) {
+        return buildIndexMain(argc, argv, options);
+    }
+    // Otherwise, expect the format matching the CLI driver usage
+    return driverMain(argc, argv, options);
+}
+
+void printUsage() {
+    std::cout <<
+        "linefuzzyfinder\n"
+        "\n"
+        "NAME\n"
+        "\tlinefuzzyfinder - finds a line similar to input words\n"
+        "\n"
+        "SYNOPSIS\n"
+        "\tUsage: linefuzzyfinder [options] [-d documentFilepath] "
+        "[-i wordSetFilepath]\n"
+        "\tUsage: linefuzzyfinder [options] [-d documentFilepath] [-c ...]\n"
+        "\tUsage: linefuzzyfinder [options] [-d documentFilepath] "
+        "[-b pretokenizedFilepath]\n"
+        "\tUsage: linefuzzyfinder [options] --benchmark\n"
+        "\tUsage: linefuzzyfinder [options] --benchmark startup "
+        "[documentFilepath]\n"
+        "\tUsage: linefuzzyfinder [options] --benchmark approximate "
+        "[documentFilepath]\n"
+        "\tUsage: linefuzzyfinder [options] --serve registryFilepath\n"
+        "\tUsage: linefuzzyfinder [options] --build-index documentFilepath "
+        "indexFilepath\n"
+        "\n"
+        "DESCRIPTION\n"
+        "\tlinefuzzyfinder is a pattern matcher that finds the most similar "
+        "line of text from a document to a set of words. The set of words can "
+        "be provided as a file with each set on its own line, or as quoted sets"
+        " of words on the command line.\n"
+        "\n"
+        "EXAMPLES\n"
+        "\tlinefuzzyfinder -d ./lepanto.txt -i ./testInputs.txt\n"
+        "\t\tFinds the closest matching lines in \"./lepanto.txt\" to each set "
+        "of words on each line of \"./testInputs.txt\".\n"
+        "\n"
+        "\tlinefuzzyfinder -d ./lepanto.txt -c \"his head a flag\" \"test word "
+        "set two\" \"set three\"\n"
+        "\t\tFinds the closest matching lines in \"./lepanto.txt\" to each set "
+        "of words given in quotes.\n"
+        "\n"
+        "\tlinefuzzyfinder --pretokenize ./testInputs.bin -d ./lepanto.txt -i "
+        "./testInputs.txt\n"
+        "\t\tNormalizes and counts the words of each set of words on each line "
+        "of \"./testInputs.txt\" ahead of time, saving them to "
+        "\"./testInputs.bin\" for searching \"./lepanto.txt\" later.\n"
+        "\n"
+        "\tlinefuzzyfinder -d ./lepanto.txt -b ./testInputs.bin\n"
+        "\t\tFinds the closest matching lines in \"./lepanto.txt\" to each set "
+        "of words saved in \"./testInputs.bin\".\n"
+        "\n"
+        "\tlinefuzzyfinder --benchmark\n"
+        "\t\tTimes the longest common run kernels against each other across "
+        "several string length distributions, and case folding across several "
+        "languages.\n"
+        "\n"
+        "\tlinefuzzyfinder --json ./new.json --baseline ./old.json "
+        "--benchmark\n"
+        "\t\tRuns the benchmarks, saves the results to \"./new.json\" and "
+        "fails if any is significantly slower than in \"./old.json\", saved "
+        "the same way before.\n"
+        "\n"
+        "\tlinefuzzyfinder --benchmark startup ./lepanto.txt\n"
+        "\t\tTimes new processes loading copies of \"./lepanto.txt\" "
+        "repeated to several sizes and searching them once like the interactive "
+        "mode, from the text and from an index file, with the file cached and "
+        "dropped from the cache. Reports starting the process, preparing the "
+        "kernels, loading the document and the first search separately.\n"
+        "\n"
+        "\tlinefuzzyfinder --threads 4 --benchmark approximate ./lepanto.txt\n"
+        "\t\tBuilds the nearest neighbor graph of --approximate for "
+        "\"./lepanto.txt\" on 4 threads and searches it for lines of the "
+        "document with a word dropped and two swapped. Reports the build time, "
+        "the memory the graph takes, the time per search against searching "
+        "every line, and how often the graph found a line with the best "
+        "score.\n"
+        "\n"
+        "\tlinefuzzyfinder --memory-budget 256 --serve ./registry.txt\n"
+        "\t\tAnswers requests from standard input against the documents named "
+        "in \"./registry.txt\", which has a name and a document path on each "
+        "line. Each request is a document name and a set of words separated by "
+        "a tab, answered by the name, the found line's index and the line "
+        "separated by tabs. \"stats\" lists the documents ending with an empty "
+        "line, and \"quit\" stops. Documents are loaded when first searched, "
+        "and the least recently searched ones are dropped to stay within 256 "
+        "megabytes. Each is saved next to itself as an index file with "
+        "\".index\" added to its name to reload it quickly. \"!set\", a name, "
+        "a line index and a new text replaces or adds a line, and \"!delete\", "
+        "a name and a line index empties one, all separated by tabs. Edits "
+        "are logged next to the document with \".log\" added to its name, and "
+        "reloading it redoes those made since its index was last saved.\n"
+        "\n"
+        "OPTIONS\n"
+        "\t--simd scalar|sse2|sse4.2|avx2|avx512\n"
+        "\t\tForces the vectorized kernels to use the given instruction set "
+        "instead of the best one the CPU supports.\n"
+        "\n"
+        "\t--tuning tuningFilepath\n"
+        "\t\tLoads the longest common run kernel choices from the file instead "
+        "of timing the kernels at startup, or saves them there if it doesn't "
+        "have them yet.\n"
+        "\n"
+        "\t--stats\n"
+        "\t\tPrints after searching which kernels were chosen and how often "
+        "they ran, how many lines were scored in full, pruned by their bounds "
+        "and ruled out by --signatures, and how many --blocks were searched "
+        "and skipped.\n"
+        "\n"
+        "\t--threads count\n"
+        "\t\tSearches for that many word sets at once, still writing the "
+        "results in order. Also loads the document on that many threads, "
+        "giving the same document.\n"
+        "\n"
+        "\t--shards count\n"
+        "\t\tInstead of --threads, splits the document into that many parts, "
+        "each kept and searched by a thread of its own pinned to its own core, "
+        "with every word set searched in every part at once. Gives the same "
+        "results.\n"
+        "\n"
+        "\t--output outputFilepath\n"
+        "\t\tWrites the results to the file instead of the console.\n"
+        "\n"
+        "\t--checkpoint checkpointFilepath\n"
+        "\t\tRecords how many word sets are done and how much output they "
+        "wrote every so often. Requires --output.\n"
+        "\n"
+        "\t--checkpoint-interval count\n"
+        "\t\tHow many word sets to search between checkpoints, 1000 by "
+        "default.\n"
+        "\n"
+        "\t--resume\n"
+        "\t\tContinues from the checkpoint if there is one, dropping any "
+        "output written after it, so the output ends up the same as if the job "
+        "never stopped.\n"
+        "\n"
+        "\t--pretokenize pretokenizedFilepath\n"
+        "\t\tSaves the sets of words to the file ready to search the document "
+        "with -b instead of searching now. The file only works with the exact "
+        "document it was made for.\n"
+        "\n"
+        "\t--save-index indexFilepath\n"
+        "\t\tSaves the document to the file already normalized and counted "
+        "instead of searching now. The file can be given to -d instead of the "
+        "document to load it faster.\n"
+        "\n"
+        "\t--share-prefixes\n"
+        "\t\tOrders the document's lines like a trie, so the longest run each "
+        "line shares with a set of words is worked out once for each prefix "
+        "lines share. Gives the same results, faster when many lines start "
+        "the same way, such as logs.\n"
+        "\n"
+        "\t--blocks\n"
+        "\t\tGroups the document's lines into blocks separated by empty "
+        "lines, like stanzas or paragraphs, and searches the blocks most "
+        "likely to have the best line first, skipping those shown unable to "
+        "have it. Gives the same results.\n"
+        "\n"
+        "\t--block-limit count\n"
+        "\t\tLike --blocks, but only searches that many of the most likely "
+        "blocks, which is faster but may miss the best line.\n"
+        "\n"
+        "\t--signatures\n"
+        "\t\tKeeps which words and runes each line has as rows of bits, one "
+        "bit per line, so searches can rule out 64 lines at a time before "
+        "looking at their words. Gives the same results, faster for large "
+        "documents, and takes about 80 bytes per line.\n"
+        "\n"
+        "\t--approximate\n"
+        "\t\tEmbeds each line as a vector of its hashed character trigrams "
+        "and links the lines into a nearest neighbor graph, built on "
+        "--threads threads. Searches only score the lines the graph finds "
+        "nearest the words, which is far faster for large documents but may "
+        "miss the best line. The graph is saved with --save-index, and used "
+        "from the index instead of being built again.\n"
+        "\n"
+        "\t--result-cache resultsFilepath\n"
+        "\t\tLooks each set of words up in the file before searching for it, "
+        "and saves the lines found there, so later runs against the same "
+        "document skip searching for the same words again. Results from a "
+        "different document are dropped.\n"
+        "\n"
+        "\t--memory-budget megabytes\n"
+        "\t\tHow much memory the documents loaded by --serve may take, or "
+        "--build-index may use, 1024 by default.\n"
+        "\n"
+        "\t--repetitions count\n"
+        "\t\tHow many times --benchmark measures everything, 5 by default. "
+        "The median is reported.\n"
+        "\n"
+        "\t--json resultsFilepath\n"
+        "\t\tSaves the --benchmark results to the file as JSON, with every "
+        "repetition, the median and its 95% confidence interval.\n"
+        "\n"
+        "\t--baseline resultsFilepath\n"
+        "\t\tCompares the --benchmark results with ones saved by --json, "
+        "exiting with 1 if any got slower. A benchmark is slower when its "
+        "confidence interval is entirely above the baseline's and its median "
+        "grew by more than --max-slowdown percent or by more than the width of "
+        "the baseline's interval, whichever is more.\n"
+        "\n"
+        "\t--max-slowdown percent\n"
+        "\t\tThe smallest slowdown --baseline fails on, 10 by default.\n"
+        "\n"
+        "\t--slow-query-log logFilepath\n"
+        "\t\tAppends each --serve request slower than --slow-query-ms to the "
+        "file as a line of JSON, with the normalized words, how many lines "
+        "were scored, the time spent on each part of the score and the found "
+        "line. The details come from the search that answered the request, "
+        "which times its own parts while the log is on, so every search "
+        "runs somewhat slower. Writing the log happens on another thread "
+        "after answering.\n"
+        "\n"
+        "\t--slow-query-ms milliseconds\n"
+        "\t\tHow long a request takes before --slow-query-log records it, 100 "
+        "by default.\n"
+        "\n"
+        "\t--warm-cache queriesFilepath\n"
+        "\t\tSaves the queries --serve answered most often to the file when "
+        "it stops. When it starts, loads the documents they were for and "
+        "searches for them again on a low priority thread while answering "
+        "requests, so their results are cached before they're asked for.\n"
+        "\n"
+        "\t--degrade-at count\n"
+        "\t\tOnce that many --serve requests are waiting, gives each search "
+        "only --degraded-ms to find its line, answering with the best found "
+        "by then and marking the answer approximate if the search was cut "
+        "short. Searches are exact again once the queue is down to a quarter "
+        "of that.\n"
+        "\n"
+        "\t--degraded-ms milliseconds\n"
+        "\t\tHow long a search may take while --degrade-at is in effect, 5 "
+        "by default.\n"
+        "\n"
+        "\t--memory-report\n"
+        "\t\tCounts every allocation by what it's for and prints how many "
+        "bytes each kind still takes after searching, in total and per line. "
+        "Slows down allocating.\n";
+}
+
+bool readAllLines(const std::string& path, std::vector<std::string>& lines) {
+    std::ifstream stream(path);
+    if (stream.is_open()) {
+        std::string line;
+        while (std::getline(stream, line)) {
+            lines.emplace_back(std::move(line));
+        };
+        return lines.size() > 0;
+    }
+    return false;
+}
+
+// Returns where the value of an option taking a positive count goes, or
+// nullptr if the option doesn't take one
+static size_t* findCountOption(Options& options, const std::string& name) {
+    if (name == "--checkpoint-interval") {
+        return &options.checkpointInterval;
+    }
+    if (name == "--threads") {
+        return &options.threads;
+    }
+    if (name == "--memory-budget") {
+        return &options.memoryBudgetMegabytes;
+    }
+    if (name == "--repetitions") {
+        return &options.repetitions;
+    }
+    if (name == "--max-slowdown") {
+        return &options.maxSlowdownPercent;
+    }
+    if (name == "--slow-query-ms") {
+        return &options.slowQueryMilliseconds;
+    }
+    if (name == "--shards") {
+        return &options.shards;
+    }
+    if (name == "--block-limit") {
+        return &options.blockLimit;
+    }
+    if (name == "--degrade-at") {
+        return &options.degradeQueueDepth;
+    }
+    if (name == "--degraded-ms") {
+        return &options.degradedMilliseconds;
+    }
+    return nullptr;
+}
+
+int parseOptions(int argc, char** argv, Options& options) {
+    int i = 1;
+    for (; i < argc && std::string(argv[i]).rfind("--", 0) == 0; ++i) {
+        const std::string name(argv[i]);
+        // Modes that look like options end the options
+        if (name == "--benchmark" || name == "--serve" ||
+            name == "--startup-probe" || name == "--build-index") {
+            break;
+        }
+        // Flags don't take a value
+        if (name == "--stats") {
+            options.stats = true;
+            continue;
+        }
+        if (name == "--resume") {
+            options.resume = true;
+            continue;
+        }
+        if (name == "--memory-report") {
+            options.memoryReport = true;
+            continue;
+        }
+        if (name == "--share-prefixes") {
+            options.sharePrefixes = true;
+            continue;
+        }
+        if (name == "--blocks") {
+            options.blocks = true;
+            continue;
+        }
+        if (name == "--signatures") {
+            options.signatures = true;
+            continue;
+        }
+        if (name == "--approximate") {
+            options.approximate = true;
+            continue;
+        }
+        // Every other option takes a value
+        if (i + 1 >= argc) {
+            std::cout << "Missing value for option " << name << std::endl;
+            return -1;
+        }
+        const std::string value(argv[++i]);
+        if (name == "--simd") {
+            options.simdLevel = value;
+        }
+        else if (name == "--tuning") {
+            options.tuningPath = value;
+        }
+        else if (name == "--output") {
+            options.outputPath = value;
+        }
+        else if (name == "--checkpoint") {
+            options.checkpointPath = value;
+        }
+        else if (name == "--pretokenize") {
+            options.pretokenizePath = value;
+        }
+        else if (name == "--save-index") {
+            options.saveIndexPath = value;
+        }
+        else if (name == "--json") {
+            options.jsonPath = value;
+        }
+        else if (name == "--baseline") {
+            options.baselinePath = value;
+        }
+        else if (name == "--slow-query-log") {
+            options.slowQueryLogPath = value;
+        }
+        else if (name == "--warm-cache") {
+            options.warmCachePath = value;
+        }
+        else if (name == "--result-cache") {
+            options.resultCachePath = value;
+        }
+        else if (size_t* target = findCountOption(options, name)) {
+            char* end = nullptr;
+            const unsigned long long count =
+                std::strtoull(value.c_str(), &end, 10);
+            if (value.empty() || *end != '\0' || count == 0) {
+                std::cout << "Expected a positive count for option " << name
+                    << std::endl;
+                return -1;
+            }
+            *target = static_cast<size_t>(count);
+        }
+        else {
+            std::cout << "Unknown option " << name << std::endl;
+            return -1;
+        }
+    }
+    // Checkpoints record how much output was written, so they need a file
+    if (!options.checkpointPath.empty() && options.outputPath.empty()) {
+        std::cout << "--checkpoint requires --output" << std::endl;
+        return -1;
+    }
+    if (options.resume && options.checkpointPath.empty()) {
+        std::cout << "--resume requires --checkpoint" << std::endl;
+        return -1;
+    }
+    // Everything before the first non-option is consumed
+    return i - 1;
+}
+
+// How far a batch job got, where everything before is already in the output
+struct BatchCheckpoint {
+    // Identifies the job so a checkpoint can't be resumed with other inputs
+    std::string job;
+    size_t queriesDone = 0;
+    size_t outputBytes = 0;
+};
+
+#define CHECKPOINT_HEADER "linefuzzyfinder-checkpoint 1"
+
+static bool loadCheckpoint(const std::string& path,
+    BatchCheckpoint& checkpoint) {
+    std::ifstream stream(path);
+    std::string header;
+    if (!std::getline(stream, header) || header != CHECKPOINT_HEADER) {
+        return false;
+    }
+    std::getline(stream, checkpoint.job);
+    return static_cast<bool>(
+        stream >> checkpoint.queriesDone >> checkpoint.outputBytes);
+}
+
+static bool saveCheckpoint(const std::string& path,
+    const BatchCheckpoint& checkpoint) {
+    // Write a new file and swap it in, so a crash can't leave half of one
+    const std::string temporaryPath = path + ".tmp";
+    {
+        std::ofstream stream(temporaryPath, std::ios::trunc);
+        stream << CHECKPOINT_HEADER << '\n' << checkpoint.job << '\n'
+            << checkpoint.queriesDone << ' ' << checkpoint.outputBytes << '\n';
+        stream.flush();
+        if (!stream) {
+            return false;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporaryPath, path, error);
+    return !error;
+}
+
+// Searches for the word sets from begin to end across the threads, storing the
+// found line of each in order
+template<typename MakeWordSet>
+static void fuzzyFindAll(const Document& document,
+    const MakeWordSet& makeWordSet, size_t begin, size_t end,
+    size_t threadCount, std::vector<size_t>& foundLines) {
+    foundLines.resize(end - begin);
+    std::atomic<size_t> next(begin);
+    auto work = [&] {
+        for (size_t i = next++; i < end; i = next++) {
+            foundLines[i - begin] = document.fuzzyFind(makeWordSet(i));
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threadCount && i < end - begin; ++i) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (auto&& thread : threads) {
+        thread.join();
+    }
+}
+
+// Builds whatever the options ask searches of the document to go through
+static void prepareSearches(Document& document, const Options& options) {
+    if (options.sharePrefixes) {
+        document.sharePrefixes();
+    }
+    if (options.blocks || options.blockLimit != SIZE_MAX) {
+        document.groupBlocks(options.blockLimit);
+    }
+    if (options.signatures) {
+        document.buildSignatures();
+    }
+    if (options.approximate) {
+        document.searchApproximately(options.threads);
+    }
+}
+
+// A ring of items passed from one thread to one other without locking
+template<typename T, size_t Capacity>
+class SpscQueue {
+public:
+    // Only called by the producing thread, returning false if full
+    bool push(const T& item) {
+        const size_t tail = mTail.load(std::memory_order_relaxed);
+        if (tail - mHead.load(std::memory_order_acquire) == Capacity) {
+            return false;
+        }
+        mItems[tail % Capacity] = item;
+        // Ordered against the consumer going to sleep, see ShardedSearcher
+        mTail.store(tail + 1, std::memory_order_seq_cst);
+        return true;
+    }
+
+    // Only called by the consuming thread, returning false if empty
+    bool pop(T& item) {
+        const size_t head = mHead.load(std::memory_order_relaxed);
+        if (head == mTail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = mItems[head % Capacity];
+        mHead.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return mHead.load(std::memory_order_relaxed) ==
+            mTail.load(std::memory_order_seq_cst);
+    }
+
+private:
+    std::array<T, Capacity> mItems;
+    // Kept on separate cache lines, since each is written by its own thread
+    alignas(64) std::atomic<size_t> mHead{0};
+    alignas(64) std::atomic<size_t> mTail{0};
+};
+
+#define SHARD_QUEUE_CAPACITY 256
+// How many times a shard checks for work again before going to sleep
+#define SHARD_SPINS 4096
+
+// Splits a document into one shard per thread, where each thread is pinned to
+// a core and builds and searches only its own shard, so nothing is shared
+// while searching but the searches themselves
+class ShardedSearcher {
+public:
+    // One search handed to every shard, done once each has answered
+    class Search {
+    public:
+        Search(const WordSet& wordSet, size_t shardCount)
+            : mWordSet(wordSet), mBests(shardCount), mRemaining(shardCount) {
+        }
+
+        bool done() const {
+            return mRemaining.load(std::memory_order_acquire) == 0;
+        }
+
+        // Picks the best line the way searching every line in order would:
+        // the highest score, then the lowest line
+        size_t result() const {
+            auto best = mBests.front();
+            for (auto&& shardBest : mBests) {
+                if (shardBest.first > best.first ||
+                    (shardBest.first == best.first &&
+                        shardBest.second < best.second)) {
+                    best = shardBest;
+                }
+            }
+            return best.second;
+        }
+
+    private:
+        friend class ShardedSearcher;
+
+        const WordSet& mWordSet;
+        // Each shard's best score and line
+        std::vector<std::pair<double, size_t>> mBests;
+        std::atomic<size_t> mRemaining;
+    };
+
+    // Returns once every shard is built
+    ShardedSearcher(const std::vector<std::string>& documentLines,
+        size_t shardCount, const Options& options) {
+        std::vector<int> cpus;
+        cpu_set_t allowed;
+        if (::sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &allowed)) {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+        std::atomic<size_t> built(0);
+        for (size_t i = 0; i < shardCount; ++i) {
+            mShards.push_back(std::make_unique<Shard>());
+        }
+        for (size_t i = 0; i < shardCount; ++i) {
+            const size_t begin = documentLines.size() * i / shardCount;
+            const size_t end = documentLines.size() * (i + 1) / shardCount;
+            const int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+            mShards[i]->thread = std::thread([this, i, cpu, begin, end,
+                &options, &documentLines, &built] {
+                // Pinned first, so the shard is allocated near its core
+                if (cpu >= 0) {
+                    cpu_set_t only;
+                    CPU_ZERO(&only);
+                    CPU_SET(cpu, &only);
+                    ::pthread_setaffinity_np(::pthread_self(), sizeof(only),
+                        &only);
+                }
+                Document shard(documentLines, begin, end);
+                prepareSearches(shard, options);
+                ++built;
+                serve(*mShards[i], i, shard);
+            });
+        }
+        while (built < shardCount) {
+            std::this_thread::yield();
+        }
+    }
+
+    ~ShardedSearcher() {
+        mStopping = true;
+        for (auto&& shard : mShards) {
+            {
+                std::lock_guard<std::mutex> lock(shard->mutex);
+            }
+            shard->wake.notify_one();
+            shard->thread.join();
+        }
+    }
+
+    ShardedSearcher(const ShardedSearcher&) = delete;
+    ShardedSearcher& operator=(const ShardedSearcher&) = delete;
+
+    size_t shardCount() const {
+        return mShards.size();
+    }
+
+    // Hands the search to every shard, where only one thread may submit, and
+    // the search must stay alive until it's done
+    void submit(Search& search) {
+        for (auto&& shard : mShards) {
+            while (!shard->queue.push(&search)) {
+                std::this_thread::yield();
+            }
+            if (shard->sleeping.load(std::memory_order_seq_cst)) {
+                std::lock_guard<std::mutex> lock(shard->mutex);
+                shard->wake.notify_one();
+            }
+        }
+    }
+
+    size_t wait(const Search& search) const {
+        while (!search.done()) {
+            std::this_thread::yield();
+        }
+        return search.result();
+    }
+
+private:
+    struct Shard {
+        SpscQueue<Search*, SHARD_QUEUE_CAPACITY> queue;
+        std::thread thread;
+        // Lets an idle shard sleep instead of taking its core
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::atomic<bool> sleeping{false};
+    };
+
+    void serve(Shard& shard, size_t index, const Document& document) {
+        Search* search = nullptr;
+        while (true) {
+            bool found = shard.queue.pop(search);
+            for (size_t spin = 0; !found && spin < SHARD_SPINS; ++spin) {
+                std::this_thread::yield();
+                found = shard.queue.pop(search);
+            }
+            if (found) {
+                double score;
+                const size_t line = document.fuzzyFind(search->mWordSet, score);
+                search->mBests[index] = { score, line };
+                // The search can be gone as soon as this is counted
+                search->mRemaining.fetch_sub(1, std::memory_order_acq_rel);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(shard.mutex);
+            shard.sleeping.store(true, std::memory_order_seq_cst);
+            shard.wake.wait(lock, [&] {
+                return !shard.queue.empty() || mStopping;
+            });
+            shard.sleeping.store(false, std::memory_order_relaxed);
+            if (mStopping && shard.queue.empty()) {
+                return;
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Shard>> mShards;
+    std::atomic<bool> mStopping{false};
+};
+
+// Same as fuzzyFindAll, but searching every shard for each word set at once,
+// keeping as many searches going as the shards' queues hold
+template<typename MakeWordSet>
+static void fuzzyFindAll(ShardedSearcher& searcher,
+    const MakeWordSet& makeWordSet, size_t begin, size_t end,
+    std::vector<size_t>& foundLines) {
+    foundLines.resize(end - begin);
+    // Neither moves once added, since the shards point at them
+    std::deque<WordSet> wordSets;
+    std::deque<ShardedSearcher::Search> searches;
+    for (size_t next = begin, done = begin; done < end; ++done) {
+        for (; next < end && next - done < SHARD_QUEUE_CAPACITY; ++next) {
+            wordSets.push_back(makeWordSet(next));
+            searches.emplace_back(wordSets.back(), searcher.shardCount());
+            searcher.submit(searches.back());
+        }
+        foundLines[done - begin] = searcher.wait(searches[done - begin]);
+    }
+}
+
+// Pretokenized word set files start with this, the format version, and the
+// fingerprint and vocabulary size of the document they were made for, followed
+// by the number of word sets, then each word set's original line followed by
+// the rest of it as written by WordSet::writePretokenized
+#define PRETOKENIZED_MAGIC 0x51464C4Cu
+#define PRETOKENIZED_VERSION 1u
+
+static bool writePretokenized(const std::string& path,
+    const Document& document, const std::vector<std::string>& wordSetLines) {
+    std::string out;
+    appendBytes(out, PRETOKENIZED_MAGIC);
+    appendBytes(out, PRETOKENIZED_VERSION);
+    appendBytes(out, document.fingerprint());
+    appendBytes(out, static_cast<uint64_t>(document.vocabulary().size()));
+    appendBytes(out, static_cast<uint64_t>(wordSetLines.size()));
+    for (auto&& wordSetLine : wordSetLines) {
+        appendString(out, wordSetLine);
+        WordSet(wordSetLine).writePretokenized(out, document.vocabulary());
+    }
+    std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+    stream.write(out.data(), static_cast<std::streamsize>(out.size()));
+    return static_cast<bool>(stream);
+}
+
+// Checks the file was made for the document, then collects the original line
+// of each word set and where the rest of each one starts
+static bool readPretokenizedHeader(const MappedFile& file,
+    const Document& document, std::vector<std::string>& wordSetLines,
+    std::vector<const char*>& wordSets) {
+    ByteReader reader(file.begin(), file.end());
+    if (reader.read<uint32_t>() != PRETOKENIZED_MAGIC ||
+        reader.read<uint32_t>() != PRETOKENIZED_VERSION ||
+        reader.read<uint64_t>() != document.fingerprint() ||
+        reader.read<uint64_t>() != document.vocabulary().size()) {
+        return false;
+    }
+    const uint64_t count = reader.read<uint64_t>();
+    for (uint64_t i = 0; i < count && !reader.failed(); ++i) {
+        wordSetLines.push_back(reader.readString());
+        wordSets.push_back(reader.position());
+        WordSet::skipPretokenized(reader);
+    }
+    return !reader.failed() && reader.atEnd();
+}
+
+// Document index files start with this, the format version and how many of
+// the document's logged edits the index has, followed by the number of lines
+// and every line, then the rest as written by Document::writeIndex
+#define DOCUMENT_INDEX_MAGIC 0x49464C4Cu
+#define DOCUMENT_INDEX_VERSION 2u
+
+static bool isDocumentIndex(const std::string& path) {
+    std::ifstream stream(path, std::ios::binary);
+    uint32_t magic = 0;
+    stream.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    return stream && magic == DOCUMENT_INDEX_MAGIC;
+}
+
+static bool saveDocumentIndex(const std::string& path,
+    const std::vector<std::string>& lines, const Document& document,
+    uint64_t editCount = 0) {
+    std::string out;
+    appendBytes(out, DOCUMENT_INDEX_MAGIC);
+    appendBytes(out, DOCUMENT_INDEX_VERSION);
+    appendVarint(out, editCount);
+    appendVarint(out, lines.size());
+    for (auto&& line : lines) {
+        appendString(out, line);
+    }
+    document.writeIndex(out);
+    // Write a new file and swap it in, so no one loads half of one
+    const std::string temporaryPath = path + ".tmp";
+    {
+        std::ofstream stream(temporaryPath, std::ios::binary | std::ios::trunc);
+        stream.write(out.data(), static_cast<std::streamsize>(out.size()));
+        if (!stream) {
+            return false;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporaryPath, path, error);
+    return !error;
+}
+
+static bool loadDocumentIndex(const std::string& path,
+    std::vector<std::string>& lines, std::unique_ptr<Document>& document,
+    uint64_t& editCount) {
+    MappedFile file(path);
+    if (!file.isOpen()) {
+        return false;
+    }
+    ByteReader reader(file.begin(), file.end());
+    if (reader.read<uint32_t>() != DOCUMENT_INDEX_MAGIC ||
+        reader.read<uint32_t>() != DOCUMENT_INDEX_VERSION) {
+        return false;
+    }
+    editCount = reader.readVarint();
+    const uint64_t lineCount = reader.readVarint();
+    {
+        MemoryCategoryScope scope(MemoryCategory::RawText);
+        for (uint64_t i = 0; i < lineCount && !reader.failed(); ++i) {
+            lines.push_back(reader.readString());
+        }
+    }
+    document = std::make_unique<Document>(reader, lines.size());
+    return !reader.failed() && reader.atEnd() && lines.size() > 0;
+}
+
+static bool loadDocumentIndex(const std::string& path,
+    std::vector<std::string>& lines, std::unique_ptr<Document>& document) {
+    uint64_t editCount;
+    return loadDocumentIndex(path, lines, document, editCount);
+}
+
+// Loads a document from its text, on that many threads, or from an index file
+// saved from it
+static bool loadDocument(const std::string& path,
+    std::vector<std::string>& lines, std::unique_ptr<Document>& document,
+    size_t threadCount = 1) {
+    if (isDocumentIndex(path)) {
+        return loadDocumentIndex(path, lines, document);
+    }
+    {
+        MemoryCategoryScope scope(MemoryCategory::RawText);
+        if (!readAllLines(path, lines)) {
+            return false;
+        }
+    }
+    document = std::make_unique<Document>(lines, 0, SIZE_MAX, threadCount);
+    return true;
+}
+
+// Result cache files start with this, the format version, the scoring
+// version, a hash of the search settings and the fingerprint of the document
+// the results are from, followed by the number of results, then each
+// normalized query and the index of its line
+#define RESULT_FILE_MAGIC 0x52464C4Cu
+#define RESULT_FILE_VERSION 2u
+// Changes whenever scoring could find different lines, so results found the
+// old way aren't used
+#define SCORING_VERSION 1u
+
+// Hashes the settings that make searches give up on finding the best line,
+// so results found with them aren't used without them or the other way round
+static uint64_t searchSettingsHash(const Options& options) {
+    std::string settings;
+    appendBytes(settings, static_cast<uint8_t>(options.approximate));
+    appendVarint(settings, options.blockLimit);
+    return Document::fingerprintLine(EMPTY_FINGERPRINT, settings);
+}
+
+// Lines found by earlier runs for each normalized query in one document,
+// saved to a file for the next run to skip searching for them again. Results
+// from any other document, or scored or searched another way, are dropped on
+// loading
+class ResultFile {
+public:
+    ResultFile(std::string path, uint64_t documentFingerprint,
+        uint64_t settingsHash)
+        : mPath(std::move(path)), mFingerprint(documentFingerprint),
+        mSettingsHash(settingsHash) {
+    }
+
+    // Returns false if the file is there but damaged. A missing file, or one
+    // from an older version or for another document, scoring or search
+    // settings, just leaves the cache empty
+    bool load() {
+        MappedFile file(mPath);
+        if (!file.isOpen()) {
+            return true;
+        }
+        ByteReader reader(file.begin(), file.end());
+        if (reader.read<uint32_t>() != RESULT_FILE_MAGIC) {
+            return false;
+        }
+        if (reader.read<uint32_t>() != RESULT_FILE_VERSION ||
+            reader.read<uint32_t>() != SCORING_VERSION ||
+            reader.read<uint64_t>() != mSettingsHash ||
+            reader.read<uint64_t>() != mFingerprint) {
+            mInvalidated = !reader.failed();
+            return !reader.failed();
+        }
+        MemoryCategoryScope scope(MemoryCategory::Caches);
+        const uint64_t count = reader.readVarint();
+        for (uint64_t i = 0; i < count && !reader.failed(); ++i) {
+            std::string normalizedLine = reader.readString();
+            const size_t lineIndex = static_cast<size_t>(reader.readVarint());
+            mLines.emplace(std::move(normalizedLine), lineIndex);
+        }
+        if (reader.failed() || !reader.atEnd()) {
+            mLines.clear();
+            return false;
+        }
+        return true;
+    }
+
+    // Saves the results if any were added since the last save
+    bool save() {
+        if (mAdded == mSaved) {
+            return true;
+        }
+        std::string out;
+        appendBytes(out, RESULT_FILE_MAGIC);
+        appendBytes(out, RESULT_FILE_VERSION);
+        appendBytes(out, SCORING_VERSION);
+        appendBytes(out, mSettingsHash);
+        appendBytes(out, mFingerprint);
+        appendVarint(out, mLines.size());
+        for (auto&& line : mLines) {
+            appendString(out, line.first);
+            appendVarint(out, line.second);
+        }
+        // Write a new file and swap it in, so no one loads half of one
+        const std::string temporaryPath = mPath + ".tmp";
+        {
+            std::ofstream stream(temporaryPath,
+                std::ios::binary | std::ios::trunc);
+            stream.write(out.data(), static_cast<std::streamsize>(out.size()));
+            if (!stream) {
+                return false;
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(temporaryPath, mPath, error);
+        if (error) {
+            return false;
+        }
+        mSaved = mAdded;
+        return true;
+    }
+
+    // Counts a hit and returns true if the line is known, or counts a miss
+    bool find(const std::string& normalizedLine, size_t& lineIndex) {
+        auto found = mLines.find(normalizedLine);
+        if (found == mLines.end()) {
+            ++mMisses;
+            return false;
+        }
+        ++mHits;
+        lineIndex = found->second;
+        return true;
+    }
+
+    void add(const std::string& normalizedLine, size_t lineIndex) {
+        MemoryCategoryScope scope(MemoryCategory::Caches);
+        if (mLines.emplace(normalizedLine, lineIndex).second) {
+            ++mAdded;
+        }
+    }
+
+    void printStats(std::ostream& stream) const {
+        stream << "Result file: " << mLines.size() << " results, " << mHits
+            << " hits, " << mMisses << " misses";
+        if (mInvalidated) {
+            stream << ", older results dropped since the document, scoring "
+                "or search settings changed";
+        }
+        stream << '\n';
+    }
+
+private:
+    const std::string mPath;
+    const uint64_t mFingerprint;
+    const uint64_t mSettingsHash;
+    std::unordered_map<std::string, size_t> mLines;
+    size_t mHits = 0;
+    size_t mMisses = 0;
+    size_t mAdded = 0;
+    size_t mSaved = 0;
+    bool mInvalidated = false;
+};
+
+// Size of the buffer each temporary file of an index build goes through
+#define BUILD_BUFFER_BYTES (64 << 10)
+
+// Reads values written by appendBytes, appendVarint and appendString back out
+// of a file a buffer at a time, noting instead of reading past the end of it
+class FileByteReader {
+public:
+    explicit FileByteReader(const std::string& path)
+        : mStream(path, std::ios::binary), mBuffer(BUILD_BUFFER_BYTES) {
+    }
+
+    bool isOpen() const {
+        return mStream.is_open();
+    }
+
+    uint8_t readByte() {
+        if (!fill()) {
+            mFailed = true;
+            return 0;
+        }
+        return static_cast<uint8_t>(mBuffer[mCursor++]);
+    }
+
+    uint64_t readVarint() {
+        uint64_t value = 0;
+        for (unsigned shift = 0; shift < 64 && !mFailed; shift += 7) {
+            const uint8_t byte = readByte();
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (byte < 0x80) {
+                return value;
+            }
+        }
+        mFailed = true;
+        return 0;
+    }
+
+    std::string readString() {
+        const uint64_t length = readVarint();
+        std::string text;
+        while (text.size() < length && fill()) {
+            const size_t size = static_cast<size_t>(std::min<uint64_t>(
+                length - text.size(), mSize - mCursor));
+            text.append(mBuffer.data() + mCursor, size);
+            mCursor += size;
+        }
+        if (text.size() < length) {
+            mFailed = true;
+        }
+        return text;
+    }
+
+    bool atEnd() {
+        return !fill();
+    }
+
+    bool failed() const {
+        return mFailed;
+    }
+
+private:
+    // Returns false once the file has nothing more
+    bool fill() {
+        if (mCursor == mSize) {
+            mStream.read(mBuffer.data(),
+                static_cast<std::streamsize>(mBuffer.size()));
+            mSize = static_cast<size_t>(mStream.gcount());
+            mCursor = 0;
+        }
+        return mCursor < mSize;
+    }
+
+    std::ifstream mStream;
+    std::vector<char> mBuffer;
+    size_t mSize = 0;
+    size_t mCursor = 0;
+    bool mFailed = false;
+};
+
+// Writes bytes to a file a buffer at a time
+class FileByteWriter {
+public:
+    explicit FileByteWriter(const std::string& path)
+        : mStream(path, std::ios::binary | std::ios::trunc) {
+    }
+
+    void write(const std::string& bytes) {
+        mBuffer += bytes;
+        if (mBuffer.size() >= BUILD_BUFFER_BYTES) {
+            flush();
+        }
+    }
+
+    // Returns false if anything failed to write
+    bool close() {
+        flush();
+        mStream.close();
+        return !mStream.fail();
+    }
+
+private:
+    void flush() {
+        mStream.write(mBuffer.data(),
+            static_cast<std::streamsize>(mBuffer.size()));
+        mBuffer.clear();
+    }
+
+    std::ofstream mStream;
+    std::string mBuffer;
+};
+
+// A word of a line's word set, with how many words of the set come before it
+struct WordPosting {
+    std::string word;
+    uint64_t line = 0;
+    uint64_t rank = 0;
+
+    bool operator<(const WordPosting& other) const {
+        return std::tie(word, line, rank) <
+            std::tie(other.word, other.line, other.rank);
+    }
+
+    size_t heapBytes() const {
+        return ::heapBytes(word);
+    }
+
+    void write(std::string& out) const {
+        appendString(out, word);
+        appendVarint(out, line);
+        appendVarint(out, rank);
+    }
+
+    void read(FileByteReader& reader) {
+        word = reader.readString();
+        line = reader.readVarint();
+        rank = reader.readVarint();
+    }
+};
+
+// A posting along with where its word first appears, with the word itself
+// only kept by the posting of that first appearance
+struct AppearancePosting {
+    uint64_t firstLine = 0;
+    uint64_t firstRank = 0;
+    uint64_t line = 0;
+    uint64_t rank = 0;
+    std::string word;
+
+    bool operator<(const AppearancePosting& other) const {
+        return std::tie(firstLine, firstRank, line, rank) <
+            std::tie(other.firstLine, other.firstRank, other.line, other.rank);
+    }
+
+    bool isFirst() const {
+        return line == firstLine && rank == firstRank;
+    }
+
+    size_t heapBytes() const {
+        return ::heapBytes(word);
+    }
+
+    void write(std::string& out) const {
+        appendVarint(out, firstLine);
+        appendVarint(out, firstRank);
+        appendVarint(out, line);
+        appendVarint(out, rank);
+        appendString(out, word);
+    }
+
+    void read(FileByteReader& reader) {
+        firstLine = reader.readVarint();
+        firstRank = reader.readVarint();
+        line = reader.readVarint();
+        rank = reader.readVarint();
+        word = reader.readString();
+    }
+};
+
+// A posting with the number its word has in the vocabulary
+struct IdPosting {
+    uint64_t line = 0;
+    uint64_t rank = 0;
+    uint64_t id = 0;
+
+    bool operator<(const IdPosting& other) const {
+        return std::tie(line, rank) < std::tie(other.line, other.rank);
+    }
+
+    size_t heapBytes() const {
+        return 0;
+    }
+
+    void write(std::string& out) const {
+        appendVarint(out, line);
+        appendVarint(out, rank);
+        appendVarint(out, id);
+    }
+
+    void read(FileByteReader& reader) {
+        line = reader.readVarint();
+        rank = reader.readVarint();
+        id = reader.readVarint();
+    }
+};
+
+// Sorts more records than fit in memory by writing sorted runs of them to
+// files whenever the ones held take up the budget, then merging the runs,
+// first into fewer runs if there are too many to read from at once within it
+template<typename Record>
+class ExternalSorter {
+public:
+    ExternalSorter(std::string pathPrefix, size_t budgetBytes)
+        : mPathPrefix(std::move(pathPrefix)), mBudgetBytes(budgetBytes),
+        mFanIn(std::max<size_t>(2, budgetBytes / BUILD_BUFFER_BYTES)) {
+    }
+
+    ~ExternalSorter() {
+        mMerger.reset();
+        for (auto&& run : mRuns) {
+            std::remove(run.c_str());
+        }
+    }
+
+    ExternalSorter(const ExternalSorter&) = delete;
+    ExternalSorter& operator=(const ExternalSorter&) = delete;
+
+    // Returns false if a run couldn't be written
+    bool add(Record record) {
+        // Growing the held records briefly needs the old ones and twice as
+        // many new ones at once
+        if (mHeld.size() == mHeld.capacity() &&
+            3 * std::max<size_t>(mHeld.size(), 1) * sizeof(Record) +
+            mHeldHeapBytes + record.heapBytes() > mBudgetBytes && !spill()) {
+            return false;
+        }
+        mHeldHeapBytes += record.heapBytes();
+        mHeld.push_back(std::move(record));
+        return mHeld.capacity() * sizeof(Record) + mHeldHeapBytes <
+            mBudgetBytes || spill();
+    }
+
+    // Gets the records ready to be taken out in order, returning false if
+    // the runs couldn't be merged
+    bool finish() {
+        if (!spill()) {
+            return false;
+        }
+        while (mRuns.size() > mFanIn) {
+            std::vector<std::string> runs(mRuns.begin(),
+                mRuns.begin() + static_cast<std::ptrdiff_t>(mFanIn));
+            mRuns.erase(mRuns.begin(),
+                mRuns.begin() + static_cast<std::ptrdiff_t>(mFanIn));
+            Merger merger(runs);
+            const std::string path = nextRunPath();
+            FileByteWriter writer(path);
+            mRuns.push_back(path);
+            Record record;
+            std::string out;
+            while (merger.next(record)) {
+                out.clear();
+                record.write(out);
+                writer.write(out);
+            }
+            if (merger.failed() || !writer.close()) {
+                return false;
+            }
+            for (auto&& run : runs) {
+                std::remove(run.c_str());
+            }
+        }
+        mMerger = std::make_unique<Merger>(mRuns);
+        return true;
+    }
+
+    // Takes out the next record, returning false after the last
+    bool next(Record& record) {
+        return mMerger->next(record);
+    }
+
+    bool failed() const {
+        return mMerger && mMerger->failed();
+    }
+
+private:
+    // Reads from every run at once, always taking the least record next
+    class Merger {
+    public:
+        explicit Merger(const std::vector<std::string>& runs) {
+            for (auto&& run : runs) {
+                mReaders.push_back(std::make_unique<FileByteReader>(run));
+                mFailed = mFailed || !mReaders.back()->isOpen();
+                readFrom(mReaders.size() - 1);
+            }
+        }
+
+        bool next(Record& record) {
+            if (mHeads.empty()) {
+                return false;
+            }
+            std::pop_heap(mHeads.begin(), mHeads.end(), Later());
+            record = std::move(mHeads.back().first);
+            const size_t run = mHeads.back().second;
+            mHeads.pop_back();
+            readFrom(run);
+            return true;
+        }
+
+        bool failed() const {
+            return mFailed;
+        }
+
+    private:
+        using Head = std::pair<Record, size_t>;
+
+        struct Later {
+            bool operator()(const Head& a, const Head& b) const {
+                return b.first < a.first;
+            }
+        };
+
+        void readFrom(size_t run) {
+            FileByteReader& reader = *mReaders[run];
+            if (reader.atEnd()) {
+                return;
+            }
+            Record record;
+            record.read(reader);
+            mFailed = mFailed || reader.failed();
+            mHeads.emplace_back(std::move(record), run);
+            std::push_heap(mHeads.begin(), mHeads.end(), Later());
+        }
+
+        std::vector<std::unique_ptr<FileByteReader>> mReaders;
+        std::vector<Head> mHeads;
+        bool mFailed = false;
+    };
+
+    std::string nextRunPath() {
+        return mPathPrefix + std::to_string(mRunNumber++);
+    }
+
+    bool spill() {
+        if (mHeld.empty()) {
+            return true;
+        }
+        std::sort(mHeld.begin(), mHeld.end());
+        const std::string path = nextRunPath();
+        FileByteWriter writer(path);
+        mRuns.push_back(path);
+        std::string out;
+        for (auto&& record : mHeld) {
+            record.write(out);
+            if (out.size() >= BUILD_BUFFER_BYTES) {
+                writer.write(out);
+                out.clear();
+            }
+        }
+        writer.write(out);
+        mHeld.clear();
+        mHeld.shrink_to_fit();
+        mHeldHeapBytes = 0;
+        return writer.close();
+    }
+
+    const std::string mPathPrefix;
+    const size_t mBudgetBytes;
+    const size_t mFanIn;
+    std::vector<Record> mHeld;
+    size_t mHeldHeapBytes = 0;
+    std::vector<std::string> mRuns;
+    size_t mRunNumber = 0;
+    std::unique_ptr<Merger> mMerger;
+};
+
+// Builds the same index file as saving a loaded document's would, streaming
+// the document once and sorting the words of its lines' word sets through
+// temporary files: by word to find where each first appears, by first
+// appearance to number them as a Vocabulary would, and by line to write
+// each line's word set with the numbers. Only about budgetBytes are held at
+// a time, however big the document
+static bool buildDocumentIndex(const std::string& documentPath,
+    const std::string& indexPath, size_t budgetBytes, size_t& lineCount,
+    size_t& nonEmptyLineCount) {
+    std::ifstream document(documentPath);
+    if (!document.is_open()) {
+        return false;
+    }
+    // Removes the temporary files however the build ends
+    struct Directory {
+        std::string path;
+        ~Directory() {
+            std::error_code error;
+            std::filesystem::remove_all(path, error);
+        }
+    } directory{ indexPath + ".build" };
+    std::error_code error;
+    std::filesystem::create_directories(directory.path, error);
+    if (error) {
+        return false;
+    }
+    const std::string linesPath = directory.path + "/lines";
+    const std::string wordSetsPath = directory.path + "/wordSets";
+    const std::string vocabularyPath = directory.path + "/vocabulary";
+    // At most two sorters are in use at once
+    const size_t sorterBytes = budgetBytes / 2;
+
+    // Keep the lines and their word sets, with the words spelled out, for
+    // the last pass, and note each word of each word set
+    lineCount = 0;
+    nonEmptyLineCount = 0;
+    uint64_t fingerprint = EMPTY_FINGERPRINT;
+    Document::Facts facts;
+    ExternalSorter<WordPosting> byWord(directory.path + "/word", sorterBytes);
+    {
+        FileByteWriter linesOut(linesPath);
+        FileByteWriter wordSetsOut(wordSetsPath);
+        const Vocabulary noWords;
+        std::string line;
+        std::string out;
+        while (std::getline(document, line)) {
+            fingerprint = Document::fingerprintLine(fingerprint, line);
+            out.clear();
+            appendString(out, line);
+            linesOut.write(out);
+            if (line.size() > 0) {
+                const WordSet wordSet(line);
+                facts.isAscii = facts.isAscii && wordSet.isAscii();
+                facts.maxLineLength =
+                    std::max(facts.maxLineLength, wordSet.length());
+                out.clear();
+                appendVarint(out, lineCount);
+                wordSet.writePretokenized(out, noWords);
+                wordSetsOut.write(out);
+                uint64_t rank = 0;
+                for (auto&& word : wordSet.words()) {
+                    if (!byWord.add({ word.first, lineCount, rank++ })) {
+                        return false;
+                    }
+                }
+                ++nonEmptyLineCount;
+            }
+            ++lineCount;
+        }
+        if (!linesOut.close() || !wordSetsOut.close() || lineCount == 0) {
+            return false;
+        }
+    }
+
+    // The first posting of each word is where it first appears
+    ExternalSorter<AppearancePosting> byAppearance(
+        directory.path + "/appearance", sorterBytes);
+    if (!byWord.finish()) {
+        return false;
+    }
+    {
+        WordPosting posting;
+        WordPosting first;
+        bool hasFirst = false;
+        while (byWord.next(posting)) {
+            const bool isFirst = !hasFirst || posting.word != first.word;
+            if (isFirst) {
+                first = posting;
+                hasFirst = true;
+            }
+            if (!byAppearance.add({ first.line, first.rank, posting.line,
+                posting.rank, isFirst ? posting.word : std::string() })) {
+                return false;
+            }
+        }
+    }
+    if (byWord.failed() || !byAppearance.finish()) {
+        return false;
+    }
+
+    // Words are numbered in order of first appearance, each word's postings
+    // coming right after its first
+    ExternalSorter<IdPosting> byLine(directory.path + "/line", sorterBytes);
+    uint64_t vocabularySize = 0;
+    {
+        FileByteWriter vocabularyOut(vocabularyPath);
+        AppearancePosting posting;
+        std::string out;
+        while (byAppearance.next(posting)) {
+            if (posting.isFirst()) {
+                out.clear();
+                appendString(out, posting.word);
+                vocabularyOut.write(out);
+                ++vocabularySize;
+            }
+            if (!byLine.add({ posting.line, posting.rank,
+                vocabularySize - 1 })) {
+                return false;
+            }
+        }
+        if (byAppearance.failed() || !vocabularyOut.close() ||
+            !byLine.finish()) {
+            return false;
+        }
+    }
+
+    // Write what saveDocumentIndex and Document::writeIndex would, with the
+    // words of each word set swapped for their numbers
+    const std::string temporaryPath = indexPath + ".tmp";
+    {
+        std::ofstream index(temporaryPath, std::ios::binary | std::ios::trunc);
+        auto copyFile = [&](const std::string& path) {
+            std::ifstream stream(path, std::ios::binary);
+            if (stream.peek() != std::ifstream::traits_type::eof()) {
+                index << stream.rdbuf();
+            }
+        };
+        std::string out;
+        appendBytes(out, DOCUMENT_INDEX_MAGIC);
+        appendBytes(out, DOCUMENT_INDEX_VERSION);
+        appendVarint(out, 0);
+        appendVarint(out, lineCount);
+        index << out;
+        copyFile(linesPath);
+        out.clear();
+        appendBytes(out, fingerprint);
+        appendBytes(out, static_cast<uint8_t>(facts.isAscii));
+        appendVarint(out, facts.maxLineLength);
+        appendVarint(out, vocabularySize);
+        index << out;
+        copyFile(vocabularyPath);
+        out.clear();
+        appendVarint(out, nonEmptyLineCount);
+        index << out;
+
+        FileByteReader wordSets(wordSetsPath);
+        IdPosting posting;
+        for (size_t i = 0; i < nonEmptyLineCount && !wordSets.failed(); ++i) {
+            out.clear();
+            appendVarint(out, wordSets.readVarint());
+            appendString(out, wordSets.readString());
+            appendBytes(out, wordSets.readByte());
+            const uint64_t wordCount = wordSets.readVarint();
+            appendVarint(out, wordCount);
+            for (uint64_t word = 0; word < wordCount; ++word) {
+                // Spelled out, since no word was known when it was written
+                wordSets.readVarint();
+                wordSets.readString();
+                if (!byLine.next(posting)) {
+                    return false;
+                }
+                appendVarint(out, posting.id + 1);
+                appendVarint(out, wordSets.readVarint());
+            }
+            const uint64_t runeCount = wordSets.readVarint();
+            appendVarint(out, runeCount);
+            for (uint64_t rune = 0; rune < runeCount; ++rune) {
+                appendBytes(out, wordSets.readByte());
+                appendVarint(out, wordSets.readVarint());
+            }
+            index << out;
+        }
+        index.flush();
+        if (wordSets.failed() || byLine.failed() || !index) {
+            return false;
+        }
+    }
+    std::filesystem::rename(temporaryPath, indexPath, error);
+    return !error;
+}
+
+#define BUILD_DOCUMENT_ARGUMENT_INDEX 2
+#define BUILD_INDEX_ARGUMENT_INDEX 3
+
+int buildIndexMain(int argc, char** argv, const Options& options) {
+    if (argc != BUILD_INDEX_ARGUMENT_INDEX + 1) {
+        std::cout << "Expected a document file and an index file after "
+            "--build-index" << std::endl;
+        printUsage();
+        return 1;
+    }
+    size_t lineCount = 0;
+    size_t nonEmptyLineCount = 0;
+    if (!buildDocumentIndex(argv[BUILD_DOCUMENT_ARGUMENT_INDEX],
+        argv[BUILD_INDEX_ARGUMENT_INDEX], options.memoryBudgetMegabytes << 20,
+        lineCount, nonEmptyLineCount)) {
+        std::cout << "Could not build document index file" << std::endl;
+        return 1;
+    }
+    if (options.memoryReport) {
+        printMemoryReport(std::cerr, lineCount, nonEmptyLineCount);
+    }
+    return 0;
+}
+
+#define DOCUMENT_FLAG_INDEX 1
+#define DOCUMENT_ARGUMENT_INDEX 2
+#define WORD_SET_FLAG_INDEX 3
+#define WORD_SET_ARGUMENT_INDEX 4
+#define MINIMUM_ARGUMENT_COUNT 5
+
+int driverMain(int argc, char** argv, const Options& options) {
+    // Format validation (program name, -d, document, -i/-c/-b, word set...)
+    if (argc < MINIMUM_ARGUMENT_COUNT) {
+        std::cout << "Expected at least " << MINIMUM_ARGUMENT_COUNT
+            << " arguments, but received " << argc << std::endl;
+        printUsage();
+        return 1;
+    }
+    if (argv[DOCUMENT_FLAG_INDEX] != std::string("-d")) {
+        std::cout << "Missing \"-d\" flag." << std::endl;
+        printUsage();
+        return 1;
+    }
+    const std::string wordSetFlag(argv[WORD_SET_FLAG_INDEX]);
+    if (wordSetFlag != "-i" && wordSetFlag != "-c" && wordSetFlag != "-b") {
+        std::cout << "Missing \"-i\", \"-c\" or \"-b\" flag." << std::endl;
+        printUsage();
+        return 1;
+    }
+
+    // Parameter validation (files present and input is readable)
+    // Preprocess the data set once so we don't have to do it on each search
+    std::vector<std::string> documentLines;
+    std::unique_ptr<Document> loadedDocument;
+    // Shards build their own documents from the lines, so unless the whole
+    // document is being saved it's only outlined, numbering its words for
+    // pretokenized word sets
+    const bool outlined = options.shards > 0 &&
+        options.saveIndexPath.empty() &&
+        !isDocumentIndex(argv[DOCUMENT_ARGUMENT_INDEX]);
+    bool loaded;
+    if (outlined) {
+        {
+            MemoryCategoryScope scope(MemoryCategory::RawText);
+            loaded = readAllLines(argv[DOCUMENT_ARGUMENT_INDEX], documentLines);
+        }
+        if (loaded) {
+            loadedDocument = std::make_unique<Document>(documentLines,
+                Document::Outline(),
+                wordSetFlag == "-b" || !options.pretokenizePath.empty());
+        }
+    }
+    else {
+        loaded = loadDocument(argv[DOCUMENT_ARGUMENT_INDEX], documentLines,
+            loadedDocument, options.threads);
+    }
+    if (!loaded) {
+        std::cout << "Could not open source file" << std::endl;
+        printUsage();
+        return 1;
+    }
+    std::vector<std::string> wordSetLines;
+    if (wordSetFlag == std::string("-i")) {
+        // Get input word sets from a file
+        if (!readAllLines(argv[WORD_SET_ARGUMENT_INDEX], wordSetLines)) {
+            std::cout << "Could not open input word set file" << std::endl;
+            printUsage();
+            return 1;
+        }
+    }
+    else if (wordSetFlag == std::string("-c")) {
+        // Get input word sets from the command line
+        for (int i = WORD_SET_ARGUMENT_INDEX; i < argc; ++i) {
+            wordSetLines.push_back(argv[i]);
+        }
+    }
+
+    prepareRunKernels(options);
+    // Each shard prepares its own searches
+    if (options.shards == 0) {
+        prepareSearches(*loadedDocument, options);
+    }
+    const Document& document = *loadedDocument;
+
+    // Pretokenized word sets are read straight from the mapped file, keeping
+    // where each one starts so they can be built on whichever thread needs them
+    MappedFile pretokenizedFile(wordSetFlag == "-b" ?
+        argv[WORD_SET_ARGUMENT_INDEX] : "");
+    std::vector<const char*> pretokenized;
+    if (wordSetFlag == std::string("-b")) {
+        if (!pretokenizedFile.isOpen() || !readPretokenizedHeader(
+            pretokenizedFile, document, wordSetLines, pretokenized)) {
+            std::cout << "Could not read pretokenized word set file made for "
+                "this document" << std::endl;
+            printUsage();
+            return 1;
+        }
+    }
+    auto makeWordSet = [&](size_t i) {
+        if (pretokenized.empty()) {
+            return WordSet(wordSetLines[i]);
+        }
+        ByteReader reader(pretokenized[i], pretokenizedFile.end());
+        return WordSet(reader, document.vocabulary());
+    };
+
+    if (!options.pretokenizePath.empty() &&
+        !writePretokenized(options.pretokenizePath, document, wordSetLines)) {
+        std::cout << "Could not write pretokenized word set file"
+            << std::endl;
+        return 1;
+    }
+    if (!options.saveIndexPath.empty() &&
+        !saveDocumentIndex(options.saveIndexPath, documentLines, document)) {
+        std::cout << "Could not write document index file" << std::endl;
+        return 1;
+    }
+    if (!options.pretokenizePath.empty() || !options.saveIndexPath.empty()) {
+        return 0;
+    }
+
+    // A checkpoint names the inputs it was made for, and fingerprints them
+    // so they can't be edited in place between runs either
+    uint64_t wordSetsFingerprint = EMPTY_FINGERPRINT;
+    for (auto&& wordSetLine : wordSetLines) {
+        wordSetsFingerprint =
+            Document::fingerprintLine(wordSetsFingerprint, wordSetLine);
+    }
+    BatchCheckpoint checkpoint;
+    checkpoint.job = std::string(argv[DOCUMENT_ARGUMENT_INDEX]) + ' ' +
+        wordSetFlag + ' ' + (wordSetFlag == "-i" ?
+            std::string(argv[WORD_SET_ARGUMENT_INDEX]) :
+            std::to_string(wordSetLines.size())) +
+        " queries " + std::to_string(wordSetLines.size()) +
+        " fingerprints " + std::to_string(document.fingerprint()) + ' ' +
+        std::to_string(wordSetsFingerprint);
+    const bool checkpointing = !options.checkpointPath.empty();
+    bool resuming = false;
+    if (options.resume) {
+        // Without a checkpoint yet there's nothing to resume, so start over
+        BatchCheckpoint saved;
+        if (loadCheckpoint(options.checkpointPath, saved)) {
+            if (saved.job != checkpoint.job) {
+                std::cout << "Checkpoint was made for a different job: "
+                    << saved.job << std::endl;
+                return 1;
+            }
+            checkpoint = saved;
+            resuming = true;
+        }
+    }
+
+    // Anything written after the checkpoint is dropped so it can be redone
+    std::ofstream outputFile;
+    if (!options.outputPath.empty()) {
+        std::error_code error;
+        if (resuming) {
+            std::filesystem::resize_file(
+                options.outputPath, checkpoint.outputBytes, error);
+        }
+        outputFile.open(options.outputPath, resuming ?
+            std::ios::in | std::ios::out | std::ios::ate : std::ios::out);
+        if (error || !outputFile.is_open()) {
+            std::cout << "Could not open output file" << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& output = outputFile.is_open() ? outputFile : std::cout;
+
+    // Word sets found by earlier runs against the same document are only
+    // looked up, leaving the rest to search for
+    std::unique_ptr<ResultFile> resultFile;
+    if (!options.resultCachePath.empty()) {
+        resultFile = std::make_unique<ResultFile>(options.resultCachePath,
+            document.fingerprint(), searchSettingsHash(options));
+        if (!resultFile->load()) {
+            std::cout << "Could not read result cache file" << std::endl;
+            return 1;
+        }
+    }
+    std::vector<size_t> unknown;
+    std::vector<std::string> unknownLines;
+    auto makeUnknownWordSet = [&](size_t i) {
+        return makeWordSet(unknown[i]);
+    };
+
+    // Process the data and input, a chunk at a time so results can be written
+    // in order however the threads finish, checkpointing between chunks
+    std::unique_ptr<ShardedSearcher> searcher;
+    if (options.shards > 0) {
+        searcher = std::make_unique<ShardedSearcher>(documentLines,
+            options.shards, options);
+    }
+    const size_t chunkSize =
+        (options.shards > 0 ? options.shards : options.threads) * 64;
+    size_t lastCheckpoint = checkpoint.queriesDone;
+    std::vector<size_t> foundLines;
+    for (size_t begin = checkpoint.queriesDone; begin < wordSetLines.size();) {
+        const size_t end = std::min(begin + chunkSize, wordSetLines.size());
+        if (resultFile) {
+            // Searches only what isn't known, then puts the results in place
+            std::vector<size_t> knownLines(end - begin);
+            unknown.clear();
+            unknownLines.clear();
+            for (size_t i = begin; i < end; ++i) {
+                std::string normalizedLine = makeWordSet(i).normalizedLine();
+                if (!resultFile->find(normalizedLine, knownLines[i - begin])) {
+                    unknown.push_back(i);
+                    unknownLines.push_back(std::move(normalizedLine));
+                }
+            }
+            if (searcher) {
+                fuzzyFindAll(*searcher, makeUnknownWordSet, 0, unknown.size(),
+                    foundLines);
+            }
+            else {
+                fuzzyFindAll(document, makeUnknownWordSet, 0, unknown.size(),
+                    options.threads, foundLines);
+            }
+            for (size_t i = 0; i < unknown.size(); ++i) {
+                knownLines[unknown[i] - begin] = foundLines[i];
+                resultFile->add(unknownLines[i], foundLines[i]);
+            }
+            foundLines = std::move(knownLines);
+        }
+        else if (searcher) {
+            fuzzyFindAll(*searcher, makeWordSet, begin, end, foundLines);
+        }
+        else {
+            fuzzyFindAll(document, makeWordSet, begin, end, options.threads,
+                foundLines);
+        }
+        for (size_t i = begin; i < end; ++i) {
+            const size_t documentLineIndex = foundLines[i - begin];
+            output << "Searching for word set: \"" << wordSetLines[i] << "\"\n";
+            output << "Found line " << documentLineIndex << ": \""
+                << documentLines[documentLineIndex] << "\"\n";
+        }
+        output.flush();
+        begin = end;
+
+        const bool checkpointDue =
+            begin - lastCheckpoint >= options.checkpointInterval ||
+            begin == wordSetLines.size();
+        // Saved with each checkpoint, so a resumed job keeps what it found
+        if (resultFile && (checkpointing ? checkpointDue :
+            begin == wordSetLines.size()) && !resultFile->save()) {
+            std::cout << "Could not save result cache file" << std::endl;
+            return 1;
+        }
+        if (checkpointing && checkpointDue) {
+            checkpoint.queriesDone = begin;
+            checkpoint.outputBytes = static_cast<size_t>(outputFile.tellp());
+            if (!saveCheckpoint(options.checkpointPath, checkpoint)) {
+                std::cout << "Could not save checkpoint" << std::endl;
+                return 1;
+            }
+            lastCheckpoint = begin;
+        }
+    }
+    if (options.stats) {
+        // An outline has none of the lines to describe
+        if (!outlined) {
+            document.printStats(std::cerr);
+        }
+        if (resultFile) {
+            resultFile->printStats(std::cerr);
+        }
+        printRunKernelStats(std::cerr);
+        printPruningStats(std::cerr);
+    }
+    if (options.memoryReport) {
+        printMemoryReport(std::cerr, documentLines.size(), outlined ?
+            static_cast<size_t>(std::count_if(documentLines.begin(),
+                documentLines.end(),
+                [](const std::string& line) { return !line.empty(); })) :
+            document.nonEmptyLineCount());
+    }
+    return 0;
+}
+
+// Most lines edited since the last seal before they get a segment of their own
+#define MUTABLE_SEGMENT_LINES 64
+// Most segments before the compactor merges them
+#define MAX_SEGMENTS 8
+// The segment number of deleted lines, which no segment has
+#define DELETED_LINE 0
+
+// A document taking line edits, kept as segments that never change once made
+// plus a small one the edits go to until it fills up and is sealed. Each line
+// records which segment has its current text, so searches skip the texts it
+// replaced and deleted lines, which read as empty so later lines keep their
+// numbers. A thread of its own merges segments once there are too many.
+// Every segment searches the way the options ask, the first having been
+// prepared by the caller
+class SegmentedDocument {
+public:
+    SegmentedDocument(std::vector<std::string> lines,
+        std::unique_ptr<Document> document, const Options& options)
+        : mOptions(options) {
+        auto segment = std::make_shared<Segment>();
+        segment->id = mNextId++;
+        {
+            MemoryCategoryScope scope(MemoryCategory::LineTable);
+            segment->lines.reserve(lines.size());
+            mOwners.assign(lines.size(), segment->id);
+        }
+        for (size_t i = 0; i < lines.size(); ++i) {
+            segment->lines.emplace_back(i, std::move(lines[i]));
+        }
+        segment->document = std::move(document);
+        segment->bytes = segmentBytes(*segment);
+        mNonEmptyLines = segment->document->nonEmptyLineCount();
+        mLiveLines[segment->id] = segment->lines.size();
+        mBytes = sizeof(SegmentedDocument) + segment->bytes +
+            mOwners.capacity() * sizeof(mOwners[0]);
+        mSegments.push_back(std::move(segment));
+        mMutableId = mNextId++;
+    }
+
+    // Waits for a merge under way to finish
+    ~SegmentedDocument() {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopping = true;
+        }
+        mWake.notify_one();
+        if (mCompactor.joinable()) {
+            mCompactor.join();
+        }
+    }
+
+    SegmentedDocument(const SegmentedDocument&) = delete;
+    SegmentedDocument& operator=(const SegmentedDocument&) = delete;
+
+    size_t lineCount() const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mOwners.size();
+    }
+
+    size_t nonEmptyLineCount() const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mNonEmptyLines;
+    }
+
+    // Roughly how many bytes the document takes, including replaced texts
+    // not merged away yet
+    size_t memoryBytes() const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mBytes;
+    }
+
+    // Copies of every line's current text, with deleted lines empty
+    std::vector<std::string> lines() const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        std::vector<std::string> lines(mOwners.size());
+        for (auto&& segment : mSegments) {
+            for (auto&& line : segment->lines) {
+                if (mOwners[line.first] == segment->id) {
+                    lines[line.first] = line.second;
+                }
+            }
+        }
+        for (auto&& edit : mMutable) {
+            lines[edit.first] = edit.second.first;
+        }
+        return lines;
+    }
+
+    // Copied, since a merge may free the segment it's in
+    std::string line(size_t lineIndex) const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        const std::string* text = findLine(lineIndex);
+        return text ? *text : std::string();
+    }
+
+    // Returns the line searching one document of the current lines would,
+    // the best score winning and then the first line
+    size_t fuzzyFind(const WordSet& wordSet) const {
+        return fuzzyFind(wordSet, nullptr, nullptr);
+    }
+
+    // Same as above, but giving the best line found by the deadline if there
+    // is one, and recording what the search did in the profile if there is
+    // one, which makes it slower
+    size_t fuzzyFind(const WordSet& wordSet, Document::Deadline* deadline,
+        Document::SearchProfile* profile) const {
+        size_t bestLine = 0;
+        double bestScore = -1.0;
+        auto consider = [&](size_t lineIndex, double score) {
+            if (score > bestScore ||
+                (score == bestScore && lineIndex < bestLine)) {
+                bestLine = lineIndex;
+                bestScore = score;
+            }
+        };
+        // Only the few edited lines are scored with the mutex held. The
+        // segments are searched as they were then without it, since they
+        // never change and holding them keeps them alive, so a long search
+        // doesn't hold up edits or other searches
+        std::vector<std::shared_ptr<const Segment>> segments;
+        std::vector<uint32_t> owners;
+        const char* strategy = "";
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            segments = mSegments;
+            owners = mOwners;
+            // Few enough to score one by one, in order like any segment
+            for (auto&& edit : mMutable) {
+                const double score = profile ?
+                    edit.second.second.measureContainment(wordSet,
+                        profile->times) :
+                    edit.second.second.measureContainment(wordSet);
+                consider(edit.first, score);
+                if (profile) {
+                    ++profile->linesScored;
+                }
+                if (score == 1.0) {
+                    break;
+                }
+            }
+        }
+        for (auto&& segment : segments) {
+            const uint32_t id = segment->id;
+            auto isLive = [&owners, id](size_t lineIndex) {
+                return owners[lineIndex] == id;
+            };
+            double score;
+            const size_t lineIndex = segment->document->fuzzyFind(
+                wordSet, score, isLive, deadline, profile);
+            consider(lineIndex, score);
+            // The first segment has most of the lines, so its strategy is
+            // the one reported
+            if (profile && segment == segments.front()) {
+                strategy = profile->strategy;
+            }
+        }
+        if (profile) {
+            profile->strategy = strategy;
+            profile->bestScore = bestScore;
+        }
+        return bestLine;
+    }
+
+    // Replaces the line at lineIndex, or adds one if it's just past the last,
+    // returning false if it's further than that
+    bool setLine(size_t lineIndex, const std::string& text) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (lineIndex > mOwners.size()) {
+            return false;
+        }
+        if (lineIndex == mOwners.size()) {
+            mOwners.push_back(DELETED_LINE);
+            mBytes += sizeof(mOwners[0]);
+        }
+        else {
+            removeLine(lineIndex);
+        }
+        ++mEdits;
+        // An empty line is never searched, so it's as good as deleted
+        if (text.empty()) {
+            return true;
+        }
+        auto&& edit = mMutable.emplace(lineIndex,
+            std::make_pair(text, WordSet(text))).first->second;
+        mBytes += editBytes(edit);
+        mOwners[lineIndex] = mMutableId;
+        ++mLiveLines[mMutableId];
+        ++mNonEmptyLines;
+        if (mMutable.size() >= MUTABLE_SEGMENT_LINES) {
+            seal();
+        }
+        return true;
+    }
+
+    // Returns false if there's no line at lineIndex
+    bool deleteLine(size_t lineIndex) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (lineIndex >= mOwners.size()) {
+            return false;
+        }
+        removeLine(lineIndex);
+        ++mEdits;
+        return true;
+    }
+
+    void printStats(std::ostream& stream) const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        stream << mSegments.size() << " segments, " << mMutable.size()
+            << " lines edited since the last seal, " << mEdits << " edits, "
+            << mCompactions << " compactions";
+    }
+
+private:
+    struct Segment {
+        uint32_t id = DELETED_LINE;
+        // The text of every line the segment has, in order
+        std::vector<std::pair<size_t, std::string>> lines;
+        std::unique_ptr<Document> document;
+        size_t bytes = 0;
+    };
+
+    // The segment being edited keeps each text with its word set
+    using Edit = std::pair<std::string, WordSet>;
+
+    static size_t segmentBytes(const Segment& segment) {
+        size_t bytes = sizeof(Segment) + segment.document->memoryBytes() +
+            segment.lines.capacity() * sizeof(segment.lines[0]);
+        for (auto&& line : segment.lines) {
+            bytes += heapBytes(line.second);
+        }
+        return bytes;
+    }
+
+    static size_t editBytes(const Edit& edit) {
+        // Roughly what a map node takes on top of what it holds
+        return sizeof(Edit) + 4 * sizeof(void*) + heapBytes(edit.first) +
+            edit.second.memoryBytes();
+    }
+
+    // The rest need the mutex held
+
+    const std::string* findLine(size_t lineIndex) const {
+        if (lineIndex >= mOwners.size() || mOwners[lineIndex] == DELETED_LINE) {
+            return nullptr;
+        }
+        const uint32_t owner = mOwners[lineIndex];
+        if (owner == mMutableId) {
+            return &mMutable.at(lineIndex).first;
+        }
+        for (auto&& segment : mSegments) {
+            if (segment->id == owner) {
+                auto found = std::lower_bound(segment->lines.begin(),
+                    segment->lines.end(), lineIndex,
+                    [](const std::pair<size_t, std::string>& line,
+                        size_t index) { return line.first < index; });
+                return &found->second;
+            }
+        }
+        return nullptr;
+    }
+
+    // Leaves the line deleted, its old text staying in its segment until a
+    // merge drops it
+    void removeLine(size_t lineIndex) {
+        const uint32_t owner = mOwners[lineIndex];
+        if (owner == DELETED_LINE) {
+            return;
+        }
+        if (!findLine(lineIndex)->empty()) {
+            --mNonEmptyLines;
+        }
+        if (owner == mMutableId) {
+            auto found = mMutable.find(lineIndex);
+            mBytes -= editBytes(found->second);
+            mMutable.erase(found);
+        }
+        --mLiveLines[owner];
+        mOwners[lineIndex] = DELETED_LINE;
+    }
+
+    // Makes the edited lines a segment, which is quick enough with so few of
+    // them to do right away, and starts a new one for the next edits
+    void seal() {
+        auto segment = std::make_shared<Segment>();
+        segment->id = mMutableId;
+        for (auto&& edit : mMutable) {
+            mBytes -= editBytes(edit.second);
+            segment->lines.emplace_back(edit.first, std::move(edit.second.first));
+        }
+        mMutable.clear();
+        segment->document = std::make_unique<Document>(segment->lines);
+        prepareSearches(*segment->document, mOptions);
+        segment->bytes = segmentBytes(*segment);
+        mBytes += segment->bytes;
+        mSegments.push_back(std::move(segment));
+        mMutableId = mNextId++;
+        if (mSegments.size() > MAX_SEGMENTS) {
+            if (!mCompactor.joinable()) {
+                mCompactor = std::thread([this] { compact(); });
+            }
+            mWake.notify_one();
+        }
+    }
+
+    // Runs on the compactor thread, merging every segment but the biggest,
+    // unless most of its lines were replaced or deleted too. The merge is
+    // built without the mutex, so edits made meanwhile to the lines being
+    // merged win over the merged texts
+    void compact() {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (true) {
+            mWake.wait(lock, [this] {
+                return mStopping || mSegments.size() > MAX_SEGMENTS;
+            });
+            if (mStopping) {
+                return;
+            }
+            auto biggest = std::max_element(mSegments.begin(), mSegments.end(),
+                [](const std::shared_ptr<const Segment>& a,
+                    const std::shared_ptr<const Segment>& b) {
+                    return a->lines.size() < b->lines.size();
+                });
+            const bool keepBiggest =
+                mLiveLines[(*biggest)->id] * 2 >= (*biggest)->lines.size();
+            std::vector<std::shared_ptr<const Segment>> sources;
+            std::vector<const std::pair<size_t, std::string>*> liveLines;
+            for (auto&& segment : mSegments) {
+                if (keepBiggest && segment == *biggest) {
+                    continue;
+                }
+                sources.push_back(segment);
+                for (auto&& line : segment->lines) {
+                    if (mOwners[line.first] == segment->id) {
+                        liveLines.push_back(&line);
+                    }
+                }
+            }
+            lock.unlock();
+
+            // The sources can't change, and holding them keeps them alive
+            std::sort(liveLines.begin(), liveLines.end(),
+                [](const std::pair<size_t, std::string>* a,
+                    const std::pair<size_t, std::string>* b) {
+                    return a->first < b->first;
+                });
+            auto merged = std::make_shared<Segment>();
+            merged->lines.reserve(liveLines.size());
+            for (auto&& line : liveLines) {
+                merged->lines.push_back(*line);
+            }
+            merged->document = std::make_unique<Document>(merged->lines);
+            prepareSearches(*merged->document, mOptions);
+            merged->bytes = segmentBytes(*merged);
+
+            lock.lock();
+            merged->id = mNextId++;
+            auto isSource = [&](uint32_t id) {
+                return std::any_of(sources.begin(), sources.end(),
+                    [id](const std::shared_ptr<const Segment>& source) {
+                        return source->id == id;
+                    });
+            };
+            size_t mergedLive = 0;
+            for (auto&& line : merged->lines) {
+                if (isSource(mOwners[line.first])) {
+                    mOwners[line.first] = merged->id;
+                    ++mergedLive;
+                }
+            }
+            for (auto&& source : sources) {
+                mBytes -= source->bytes;
+                mLiveLines.erase(source->id);
+            }
+            mSegments.erase(std::remove_if(mSegments.begin(), mSegments.end(),
+                [&](const std::shared_ptr<const Segment>& segment) {
+                    return isSource(segment->id);
+                }), mSegments.end());
+            mBytes += merged->bytes;
+            mLiveLines[merged->id] = mergedLive;
+            mSegments.push_back(std::move(merged));
+            ++mCompactions;
+        }
+    }
+
+    const Options& mOptions;
+    mutable std::mutex mMutex;
+    std::vector<std::shared_ptr<const Segment>> mSegments;
+    // Edits since the last seal, in line order
+    std::map<size_t, Edit> mMutable;
+    // The segment with the current text of each line
+    std::vector<uint32_t> mOwners;
+    // How many lines each segment has the current text of
+    std::unordered_map<uint32_t, size_t> mLiveLines;
+    uint32_t mNextId = DELETED_LINE + 1;
+    uint32_t mMutableId = DELETED_LINE;
+    size_t mNonEmptyLines = 0;
+    size_t mBytes = 0;
+    size_t mEdits = 0;
+    size_t mCompactions = 0;
+    std::condition_variable mWake;
+    bool mStopping = false;
+    std::thread mCompactor;
+};
+
+// Where the registry saves the index of each document it loads from text
+#define DOCUMENT_INDEX_EXTENSION ".index"
+// Where the registry logs the edits made to each document since its index
+#define DOCUMENT_LOG_EXTENSION ".log"
+
+// Edit log files start with this, the format version and how many edits were
+// made to the document before the first one in the file, followed by each
+// edit as one of the kinds below, the line index and, for a set, the new text
+#define EDIT_LOG_MAGIC 0x57464C4Cu
+#define EDIT_LOG_VERSION 1u
+#define EDIT_LOG_SET 1
+#define EDIT_LOG_DELETE 2
+// Edits logged since the last index before saving a new one and starting the
+// log over, which bounds how many edits reloading a document redoes
+#define EDIT_LOG_SNAPSHOT_EDITS 4096
+
+// A document's edits, appended to a file as they're made, so that loading the
+// document again only needs its last index and the edits made since. Each
+// edit is written out before it's applied, which survives the process dying
+// but not the machine
+class EditLog {
+public:
+    // Where the log stood at some point, for starting it over from there
+    struct Mark {
+        uint64_t editCount = 0;
+        uint64_t offset = 0;
+    };
+
+    explicit EditLog(std::string path)
+        : mPath(std::move(path)) {
+    }
+
+    EditLog(const EditLog&) = delete;
+    EditLog& operator=(const EditLog&) = delete;
+
+    // Held while loading the index and replaying the log, and while saving a
+    // new index and starting the log over, so the two always match
+    std::mutex& filesMutex() {
+        return mFilesMutex;
+    }
+
+    // Redoes the edits logged after the first indexEditCount ones, which the
+    // index the document was loaded from already has, dropping an edit cut
+    // off by a crash. Returns false if the log is damaged or missing edits
+    bool replay(uint64_t indexEditCount, SegmentedDocument& document) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStream.close();
+        uint64_t editCount = 0;
+        uint64_t validBytes = 0;
+        {
+            MappedFile file(mPath);
+            if (!file.isOpen()) {
+                return startOver(indexEditCount, std::string());
+            }
+            ByteReader reader(file.begin(), file.end());
+            if (reader.read<uint32_t>() != EDIT_LOG_MAGIC ||
+                reader.read<uint32_t>() != EDIT_LOG_VERSION) {
+                return false;
+            }
+            editCount = reader.readVarint();
+            if (reader.failed() || editCount > indexEditCount) {
+                return false;
+            }
+            validBytes = static_cast<uint64_t>(reader.position() - file.begin());
+            while (!reader.atEnd()) {
+                const uint8_t kind = reader.read<uint8_t>();
+                const size_t lineIndex =
+                    static_cast<size_t>(reader.readVarint());
+                const std::string text =
+                    kind == EDIT_LOG_SET ? reader.readString() : std::string();
+                if (reader.failed()) {
+                    break;
+                }
+                if (editCount >= indexEditCount) {
+                    const bool applied = kind == EDIT_LOG_SET ?
+                        document.setLine(lineIndex, text) :
+                        kind == EDIT_LOG_DELETE && document.deleteLine(lineIndex);
+                    if (!applied) {
+                        return false;
+                    }
+                }
+                ++editCount;
+                validBytes =
+                    static_cast<uint64_t>(reader.position() - file.begin());
+            }
+        }
+        if (editCount < indexEditCount) {
+            return false;
+        }
+        std::error_code error;
+        std::filesystem::resize_file(mPath, validBytes, error);
+        mIndexEditCount = indexEditCount;
+        mEditCount = editCount;
+        mBytes = validBytes;
+        mStream.open(mPath, std::ios::binary | std::ios::app);
+        return !error && mStream.is_open();
+    }
+
+    // Starts an empty log for a document with no edits yet
+    bool reset() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStream.close();
+        return startOver(0, std::string());
+    }
+
+    // Returns false if the edit couldn't be written, in which case it
+    // shouldn't be applied either
+    bool append(bool isSet, size_t lineIndex, const std::string& text) {
+        std::string out;
+        appendBytes(out, static_cast<uint8_t>(isSet ? EDIT_LOG_SET :
+            EDIT_LOG_DELETE));
+        appendVarint(out, lineIndex);
+        if (isSet) {
+            appendString(out, text);
+        }
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStream.write(out.data(), static_cast<std::streamsize>(out.size()));
+        mStream.flush();
+        if (!mStream) {
+            return false;
+        }
+        ++mEditCount;
+        mBytes += out.size();
+        return true;
+    }
+
+    Mark mark() const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return { mEditCount, mBytes };
+    }
+
+    // How many edits reloading the document would redo
+    uint64_t pendingEdits() const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mEditCount - mIndexEditCount;
+    }
+
+    // Drops the edits before the mark, once an index with them is saved
+    bool startOverAt(const Mark& mark) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStream.close();
+        std::string tail;
+        {
+            std::ifstream stream(mPath, std::ios::binary);
+            stream.seekg(static_cast<std::streamoff>(mark.offset));
+            tail.assign(std::istreambuf_iterator<char>(stream),
+                std::istreambuf_iterator<char>());
+        }
+        const uint64_t editCount = mEditCount;
+        if (!startOver(mark.editCount, tail)) {
+            return false;
+        }
+        mEditCount = editCount;
+        return true;
+    }
+
+    // Set while a new index is being saved, so only one is at a time
+    std::atomic<bool> snapshotting{false};
+
+private:
+    // Needs the mutex held and the stream closed
+    bool startOver(uint64_t firstEdit, const std::string& edits) {
+        std::string out;
+        appendBytes(out, EDIT_LOG_MAGIC);
+        appendBytes(out, EDIT_LOG_VERSION);
+        appendVarint(out, firstEdit);
+        const size_t headerBytes = out.size();
+        out += edits;
+        // Write a new file and swap it in, so a crash can't leave half of one
+        const std::string temporaryPath = mPath + ".tmp";
+        {
+            std::ofstream stream(temporaryPath,
+                std::ios::binary | std::ios::trunc);
+            stream.write(out.data(), static_cast<std::streamsize>(out.size()));
+            if (!stream) {
+                return false;
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(temporaryPath, mPath, error);
+        if (error) {
+            return false;
+        }
+        mIndexEditCount = firstEdit;
+        mEditCount = firstEdit;
+        mBytes = headerBytes + edits.size();
+        mStream.open(mPath, std::ios::binary | std::ios::app);
+        return mStream.is_open();
+    }
+
+    const std::string mPath;
+    mutable std::mutex mMutex;
+    std::mutex mFilesMutex;
+    std::ofstream mStream;
+    // How many edits the document's index has
+    uint64_t mIndexEditCount = 0;
+    uint64_t mEditCount = 0;
+    uint64_t mBytes = 0;
+};
+
+// Saves new indexes of edited documents on a thread of its own and starts
+// their logs over from there, so serving doesn't wait on rebuilding them
+class IndexSnapshotter {
+public:
+    struct Job {
+        std::shared_ptr<EditLog> log;
+        std::string indexPath;
+        std::vector<std::string> lines;
+        EditLog::Mark mark;
+    };
+
+    explicit IndexSnapshotter(const Options& options) : mOptions(options) {
+        mThread = std::thread([this] { run(); });
+    }
+
+    // Saves whatever is still waiting first
+    ~IndexSnapshotter() {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopping = true;
+        }
+        mWake.notify_one();
+        mThread.join();
+    }
+
+    IndexSnapshotter(const IndexSnapshotter&) = delete;
+    IndexSnapshotter& operator=(const IndexSnapshotter&) = delete;
+
+    void add(Job job) {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mPending.push_back(std::move(job));
+        }
+        mWake.notify_one();
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (true) {
+            mWake.wait(lock, [this] { return mStopping || !mPending.empty(); });
+            if (mPending.empty()) {
+                return;
+            }
+            Job job = std::move(mPending.front());
+            mPending.pop_front();
+            lock.unlock();
+            Document document(job.lines);
+            // The nearest neighbor graph is the only part saved with it
+            if (mOptions.approximate) {
+                document.searchApproximately(mOptions.threads);
+            }
+            {
+                // A failed save leaves the old index and log, which still work
+                std::lock_guard<std::mutex> files(job.log->filesMutex());
+                if (saveDocumentIndex(job.indexPath, job.lines, document,
+                    job.mark.editCount)) {
+                    job.log->startOverAt(job.mark);
+                }
+            }
+            job.log->snapshotting = false;
+            lock.lock();
+        }
+    }
+
+    const Options& mOptions;
+    std::mutex mMutex;
+    std::condition_variable mWake;
+    std::deque<Job> mPending;
+    bool mStopping = false;
+    std::thread mThread;
+};
+
+// Named documents loaded when first searched, keeping the most recently
+// searched ones in memory within a budget and dropping the rest, which are
+// reloaded from the index files saved the first time they were loaded and the
+// logs of the edits made since. Searches go the way the options ask
+class DocumentRegistry {
+public:
+    DocumentRegistry(size_t budgetBytes, const Options& options)
+        : mBudgetBytes(budgetBytes), mOptions(options), mSnapshotter(options) {
+    }
+
+    // Reads a name and a path separated by whitespace from each line,
+    // skipping empty lines and lines starting with '#'
+    bool addDocuments(const std::string& registryPath) {
+        std::vector<std::string> lines;
+        if (!readAllLines(registryPath, lines)) {
+            return false;
+        }
+        for (auto&& line : lines) {
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            const size_t nameEnd = line.find_first_of(" \t");
+            const size_t pathBegin = nameEnd == std::string::npos ?
+                nameEnd : line.find_first_not_of(" \t", nameEnd);
+            // Edit requests start with '!', so names can't
+            if (pathBegin == std::string::npos || line[0] == '!') {
+                return false;
+            }
+            mSlots[line.substr(0, nameEnd)].path = line.substr(pathBegin);
+        }
+        return true;
+    }
+
+    // Returns the named document, loading it and dropping others to make room
+    // if needed, or nullptr if it isn't registered or can't be loaded
+    std::shared_ptr<SegmentedDocument> acquire(const std::string& name) {
+        auto found = mSlots.find(name);
+        if (found == mSlots.end()) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> lock(mMutex);
+        Slot& slot = found->second;
+        if (slot.document) {
+            ++slot.hits;
+            mRecent.splice(mRecent.begin(), mRecent, slot.recent);
+            return slot.document;
+        }
+        slot.document = load(slot);
+        if (!slot.document) {
+            return nullptr;
+        }
+        mRecent.push_front(name);
+        slot.recent = mRecent.begin();
+        // A document over the budget on its own still gets loaded, alone
+        size_t used = usedBytes();
+        while (used > mBudgetBytes && mRecent.size() > 1) {
+            Slot& evicted = mSlots.at(mRecent.back());
+            used -= evicted.document->memoryBytes();
+            evict(evicted);
+        }
+        return slot.document;
+    }
+
+    // Returns the named document if it's loaded, or nullptr, without loading
+    // it or counting a hit. Unlike the rest, can be called from any thread
+    std::shared_ptr<SegmentedDocument> peek(const std::string& name) const {
+        auto found = mSlots.find(name);
+        if (found == mSlots.end()) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> lock(mMutex);
+        return found->second.document;
+    }
+
+    // Logs the edit to the named document and applies it, or returns false
+    // with why not
+    bool edit(const std::string& name, bool isSet, size_t lineIndex,
+        const std::string& text, std::string& error) {
+        auto document = acquire(name);
+        if (!document) {
+            error = "Could not load document";
+            return false;
+        }
+        const size_t lineCount = document->lineCount();
+        if (isSet ? lineIndex > lineCount : lineIndex >= lineCount) {
+            error = "No line " + std::to_string(lineIndex);
+            return false;
+        }
+        Slot& slot = mSlots.at(name);
+        if (!slot.log->append(isSet, lineIndex, text)) {
+            error = "Could not log edit";
+            return false;
+        }
+        if (isSet) {
+            document->setLine(lineIndex, text);
+        }
+        else {
+            document->deleteLine(lineIndex);
+        }
+        // The lines are copied now, so they match the mark exactly
+        if (slot.log->pendingEdits() >= EDIT_LOG_SNAPSHOT_EDITS &&
+            !slot.log->snapshotting.exchange(true)) {
+            mSnapshotter.add({ slot.log, slot.path + DOCUMENT_INDEX_EXTENSION,
+                document->lines(), slot.log->mark() });
+        }
+        return true;
+    }
+
+    // Prints the memory report averaged over the loaded documents' lines
+    void printMemoryReport(std::ostream& stream) const {
+        size_t lineCount = 0;
+        size_t nonEmptyLineCount = 0;
+        for (auto&& slot : mSlots) {
+            if (slot.second.document) {
+                lineCount += slot.second.document->lineCount();
+                nonEmptyLineCount += slot.second.document->nonEmptyLineCount();
+            }
+        }
+        ::printMemoryReport(stream, lineCount, nonEmptyLineCount);
+    }
+
+    void printStats(std::ostream& stream) const {
+        stream << "Registry: " << mRecent.size() << " of " << mSlots.size()
+            << " documents loaded, " << usedBytes() << " of " << mBudgetBytes
+            << " bytes\n";
+        std::vector<const std::string*> names;
+        for (auto&& slot : mSlots) {
+            names.push_back(&slot.first);
+        }
+        std::sort(names.begin(), names.end(),
+            [](const std::string* a, const std::string* b) { return *a < *b; });
+        for (auto&& name : names) {
+            const Slot& slot = mSlots.at(*name);
+            stream << "  " << *name << ": ";
+            if (slot.document) {
+                stream << slot.document->memoryBytes() << " bytes";
+            }
+            else {
+                stream << "not loaded";
+            }
+            stream << ", " << slot.loads << " loads";
+            if (slot.loads > 0) {
+                stream << " (last from " << (slot.loadedFromIndex ?
+                    "index" : "text") << " in " << slot.loadMilliseconds
+                    << " ms)";
+            }
+            stream << ", " << slot.hits << " hits, " << slot.evictions
+                << " evictions";
+            if (slot.document) {
+                stream << ", ";
+                slot.document->printStats(stream);
+            }
+            stream << '\n';
+        }
+    }
+
+private:
+    struct Slot {
+        std::string path;
+        // Empty while the document isn't loaded
+        std::shared_ptr<SegmentedDocument> document;
+        // Kept while the document isn't loaded, in case a new index is saving
+        std::shared_ptr<EditLog> log;
+        std::list<std::string>::iterator recent;
+        size_t loads = 0;
+        size_t hits = 0;
+        size_t evictions = 0;
+        bool loadedFromIndex = false;
+        double loadMilliseconds = 0;
+    };
+
+    std::shared_ptr<SegmentedDocument> load(Slot& slot) {
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<std::string> lines;
+        std::unique_ptr<Document> document;
+        if (!slot.log) {
+            slot.log = std::make_shared<EditLog>(
+                slot.path + DOCUMENT_LOG_EXTENSION);
+        }
+        std::lock_guard<std::mutex> files(slot.log->filesMutex());
+        // Use the saved index unless the document changed since it was saved
+        const std::string indexPath = slot.path + DOCUMENT_INDEX_EXTENSION;
+        std::error_code indexError;
+        std::error_code documentError;
+        const bool indexIsCurrent =
+            std::filesystem::last_write_time(indexPath, indexError) >=
+            std::filesystem::last_write_time(slot.path, documentError) &&
+            !indexError && !documentError;
+        uint64_t indexEditCount = 0;
+        slot.loadedFromIndex = indexIsCurrent &&
+            loadDocumentIndex(indexPath, lines, document, indexEditCount);
+        if (!slot.loadedFromIndex) {
+            lines.clear();
+            indexEditCount = 0;
+            slot.loadedFromIndex = isDocumentIndex(slot.path);
+            const bool loaded = slot.loadedFromIndex ?
+                loadDocumentIndex(slot.path, lines, document, indexEditCount) :
+                loadDocument(slot.path, lines, document);
+            if (!loaded) {
+                return nullptr;
+            }
+        }
+        // Edits logged since the saved index don't apply to a document changed
+        // after it was saved, so that log starts over with a new index
+        const bool documentChanged =
+            !indexError && !documentError && !indexIsCurrent;
+        const bool saveIndex =
+            documentChanged || (indexError && !slot.loadedFromIndex);
+        // Prepared first, so a nearest neighbor graph built is saved too
+        prepareSearches(*document, mOptions);
+        // The log is kept for a later load when there's no index to match it
+        if (saveIndex && !saveDocumentIndex(indexPath, lines, *document)) {
+            return nullptr;
+        }
+        auto segmented = std::make_shared<SegmentedDocument>(
+            std::move(lines), std::move(document), mOptions);
+        const bool logged = documentChanged ?
+            slot.log->reset() : slot.log->replay(indexEditCount, *segmented);
+        if (!logged) {
+            return nullptr;
+        }
+        ++slot.loads;
+        slot.loadMilliseconds = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+        return segmented;
+    }
+
+    void evict(Slot& slot) {
+        // Searches still holding the document keep it until they finish
+        slot.document.reset();
+        ++slot.evictions;
+        mRecent.erase(slot.recent);
+    }
+
+    // Documents change size as they're edited, so this is counted when needed
+    size_t usedBytes() const {
+        size_t bytes = 0;
+        for (auto&& name : mRecent) {
+            bytes += mSlots.at(name).document->memoryBytes();
+        }
+        return bytes;
+    }
+
+    std::unordered_map<std::string, Slot> mSlots;
+    // Names of the loaded documents, most recently searched first
+    std::list<std::string> mRecent;
+    size_t mBudgetBytes;
+    const Options& mOptions;
+    // Held while the loaded documents change, so peek sees them whole
+    mutable std::mutex mMutex;
+    // Last, so the indexes still saving are saved before anything goes
+    IndexSnapshotter mSnapshotter;
+};
+
+// Most slow queries waiting to be logged, past which more are only counted
+#define SLOW_QUERY_BACKLOG 1024
+
+// Logs slow queries with the profiles of the searches that answered them,
+// written on a thread of its own so serving doesn't wait
+class SlowQueryLog {
+public:
+    struct Query {
+        std::string documentName;
+        // Keeps the document loaded until the query is logged
+        std::shared_ptr<const SegmentedDocument> document;
+        std::string wordSetLine;
+        std::string normalizedLine;
+        double milliseconds = 0;
+        double loadMilliseconds = 0;
+        // Of the search that answered, or "cached" with nothing else if none
+        // did
+        Document::SearchProfile profile;
+        size_t lineIndex = 0;
+        std::string text;
+    };
+
+    SlowQueryLog(const std::string& path, double thresholdMilliseconds)
+        : mStream(path, std::ios::app),
+        mThresholdMilliseconds(thresholdMilliseconds) {
+        mThread = std::thread([this] { run(); });
+    }
+
+    // Logs whatever is still waiting first
+    ~SlowQueryLog() {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopping = true;
+        }
+        mWake.notify_one();
+        mThread.join();
+    }
+
+    SlowQueryLog(const SlowQueryLog&) = delete;
+    SlowQueryLog& operator=(const SlowQueryLog&) = delete;
+
+    bool isOpen() const {
+        return mStream.is_open();
+    }
+
+    bool isSlow(double milliseconds) const {
+        return milliseconds >= mThresholdMilliseconds;
+    }
+
+    void record(Query query) {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mPending.size() >= SLOW_QUERY_BACKLOG) {
+                ++mDropped;
+                return;
+            }
+            mPending.push_back(std::move(query));
+        }
+        mWake.notify_one();
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (true) {
+            mWake.wait(lock, [this] { return mStopping || !mPending.empty(); });
+            if (mPending.empty()) {
+                return;
+            }
+            Query query = std::move(mPending.front());
+            mPending.pop_front();
+            const size_t dropped = mDropped;
+            mDropped = 0;
+            lock.unlock();
+            write(query, dropped);
+            lock.lock();
+        }
+    }
+
+    void write(const Query& query, size_t dropped) {
+        const Document::SearchProfile& profile = query.profile;
+        auto milliseconds = [](std::chrono::steady_clock::duration time) {
+            return std::chrono::duration<double, std::milli>(time).count();
+        };
+
+        std::string out = "{\"document\": ";
+        appendJsonString(out, query.documentName);
+        out += ", \"query\": ";
+        appendJsonString(out, query.wordSetLine);
+        out += ", \"normalized\": ";
+        appendJsonString(out, query.normalizedLine);
+        out += ", \"milliseconds\": ";
+        appendJsonNumber(out, query.milliseconds);
+        out += ", \"loadMilliseconds\": ";
+        appendJsonNumber(out, query.loadMilliseconds);
+        out += ", \"strategy\": ";
+        appendJsonString(out, profile.strategy);
+        out += ", \"linesScored\": " + std::to_string(profile.linesScored) +
+            ", \"linesPruned\": " + std::to_string(profile.linesPruned) +
+            ", \"linesSkipped\": " + std::to_string(profile.linesSkipped) +
+            ", \"emptyLines\": " + std::to_string(query.document->lineCount() -
+                query.document->nonEmptyLineCount());
+        out += ", \"termMilliseconds\": {\"words\": ";
+        appendJsonNumber(out, milliseconds(profile.times.words));
+        out += ", \"runes\": ";
+        appendJsonNumber(out, milliseconds(profile.times.runes));
+        out += ", \"bounds\": ";
+        appendJsonNumber(out, milliseconds(profile.times.bounds));
+        out += ", \"fullShared\": ";
+        appendJsonNumber(out, milliseconds(profile.times.fullShared));
+        out += ", \"wordShared\": ";
+        appendJsonNumber(out, milliseconds(profile.times.wordShared));
+        out += "}, \"line\": " + std::to_string(query.lineIndex) +
+            ", \"score\": ";
+        appendJsonNumber(out, profile.bestScore);
+        out += ", \"text\": ";
+        appendJsonString(out, query.text);
+        out += ", \"droppedBefore\": " + std::to_string(dropped) + "}\n";
+        mStream << out;
+        mStream.flush();
+    }
+
+    std::ofstream mStream;
+    const double mThresholdMilliseconds;
+    std::mutex mMutex;
+    std::condition_variable mWake;
+    std::deque<Query> mPending;
+    size_t mDropped = 0;
+    bool mStopping = false;
+    std::thread mThread;
+};
+
+// Most search results kept for --serve, past which the least recently used
+// are dropped
+#define RESULT_CACHE_ENTRIES 65536
+// Most frequent queries saved for warming the cache up after a restart
+#define WARM_CACHE_QUERIES 1024
+// Niceness of the thread warming the cache up, the lowest priority there is
+#define WARM_UP_NICENESS 19
+
+// Found lines by document and normalized query, since searching for the same
+// words in an unchanged document always finds the same line. A document's
+// results are dropped when it's edited
+class ResultCache {
+public:
+    // A query saved by save, as it was asked, with how often it was
+    // searched for
+    struct Query {
+        std::string documentName;
+        std::string text;
+        uint64_t uses = 0;
+    };
+
+    // Counts a hit and returns true if the line is known, or counts a miss
+    bool find(const std::string& documentName,
+        const std::string& normalizedLine, size_t& lineIndex) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto document = mDocuments.find(documentName);
+        if (document != mDocuments.end()) {
+            auto found = document->second.results.find(normalizedLine);
+            if (found != document->second.results.end()) {
+                Result& result = found->second;
+                ++result.uses;
+                ++mHits;
+                mWarmedHits += result.warmed ? 1 : 0;
+                mRecent.splice(mRecent.begin(), mRecent, result.recent);
+                lineIndex = result.lineIndex;
+                return true;
+            }
+        }
+        ++mMisses;
+        return false;
+    }
+
+    // Changes whenever the document's results are dropped, so a search can
+    // tell if an edit came in while it ran
+    uint64_t generation(const std::string& documentName) const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto document = mDocuments.find(documentName);
+        return document != mDocuments.end() ? document->second.generation : 0;
+    }
+
+    // Keeps the line found by a search started at the generation given,
+    // unless the document was edited since. The text is the query as asked,
+    // which is saved instead of the normalized line, since normalizing that
+    // again doesn't always give the same words
+    void store(const std::string& documentName,
+        const std::string& normalizedLine, const std::string& text,
+        size_t lineIndex, uint64_t generation, uint64_t uses = 1,
+        bool warmed = false) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        MemoryCategoryScope scope(MemoryCategory::Caches);
+        Results& document = mDocuments[documentName];
+        if (document.generation != generation) {
+            return;
+        }
+        auto inserted = document.results.emplace(normalizedLine, Result());
+        Result& result = inserted.first->second;
+        if (!inserted.second) {
+            return;
+        }
+        result.lineIndex = lineIndex;
+        result.text = text;
+        result.uses = uses;
+        result.warmed = warmed;
+        mRecent.emplace_front(&document, &inserted.first->first);
+        result.recent = mRecent.begin();
+        mWarmed += warmed ? 1 : 0;
+        if (mRecent.size() > RESULT_CACHE_ENTRIES) {
+            auto oldest = mRecent.back();
+            mRecent.pop_back();
+            oldest.first->results.erase(*oldest.second);
+        }
+    }
+
+    void invalidate(const std::string& documentName) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        Results& document = mDocuments[documentName];
+        ++document.generation;
+        for (auto&& result : document.results) {
+            mRecent.erase(result.second.recent);
+        }
+        document.results.clear();
+    }
+
+    // Saves the most frequent queries, most frequent first
+    bool save(const std::string& path) const {
+        std::vector<Query> queries;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            for (auto&& document : mDocuments) {
+                for (auto&& result : document.second.results) {
+                    queries.push_back({ document.first, result.second.text,
+                        result.second.uses });
+                }
+            }
+        }
+        std::sort(queries.begin(), queries.end(),
+            [](const Query& a, const Query& b) { return a.uses > b.uses; });
+        queries.resize(std::min<size_t>(queries.size(), WARM_CACHE_QUERIES));
+        // Write a new file and swap it in, so a crash can't leave half of one
+        const std::string temporaryPath = path + ".tmp";
+        {
+            std::ofstream stream(temporaryPath, std::ios::trunc);
+            for (auto&& query : queries) {
+                stream << query.uses << '\t' << query.documentName << '\t'
+                    << query.text << '\n';
+            }
+            if (!stream) {
+                return false;
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(temporaryPath, path, error);
+        return !error;
+    }
+
+    // Reads the queries saved by save, skipping lines that aren't one
+    static std::vector<Query> loadQueries(const std::string& path) {
+        std::vector<Query> queries;
+        std::ifstream stream(path);
+        std::string line;
+        while (std::getline(stream, line)) {
+            // Names can't have tabs, so the query is all after the second
+            const size_t usesEnd = line.find('\t');
+            const size_t nameEnd = usesEnd == std::string::npos ?
+                usesEnd : line.find('\t', usesEnd + 1);
+            if (nameEnd == std::string::npos) {
+                continue;
+            }
+            char* end = nullptr;
+            const unsigned long long uses =
+                std::strtoull(line.c_str(), &end, 10);
+            if (end != line.c_str() + usesEnd) {
+                continue;
+            }
+            queries.push_back({ line.substr(usesEnd + 1, nameEnd - usesEnd - 1),
+                line.substr(nameEnd + 1), uses });
+        }
+        return queries;
+    }
+
+    void printStats(std::ostream& stream) const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        const uint64_t lookups = mHits + mMisses;
+        stream << "Result cache: " << mRecent.size() << " of "
+            << RESULT_CACHE_ENTRIES << " entries, " << mHits << " hits, "
+            << mMisses << " misses";
+        if (lookups > 0) {
+            stream << " (" << 100.0 * static_cast<double>(mHits) /
+                static_cast<double>(lookups) << "% hit rate)";
+        }
+        stream << ", " << mWarmed << " warmed up, " << mWarmedHits
+            << " hits on warmed entries\n";
+    }
+
+private:
+    struct Results;
+
+    struct Result {
+        size_t lineIndex = 0;
+        std::string text;
+        uint64_t uses = 0;
+        bool warmed = false;
+        std::list<std::pair<Results*, const std::string*>>::iterator recent;
+    };
+
+    struct Results {
+        uint64_t generation = 0;
+        std::unordered_map<std::string, Result> results;
+    };
+
+    mutable std::mutex mMutex;
+    std::unordered_map<std::string, Results> mDocuments;
+    // Every result's document and query, most recently used first
+    std::list<std::pair<Results*, const std::string*>> mRecent;
+    uint64_t mHits = 0;
+    uint64_t mMisses = 0;
+    uint64_t mWarmed = 0;
+    uint64_t mWarmedHits = 0;
+};
+
+// Searches for queries saved by ResultCache::save on a thread of its own at
+// the lowest priority, filling the cache while requests are being answered
+class CacheWarmer {
+public:
+    // Only warms the documents that are loaded, so load those wanted first
+    CacheWarmer(const DocumentRegistry& registry, ResultCache& cache,
+        std::vector<ResultCache::Query> queries)
+        : mRegistry(registry), mCache(cache), mQueries(std::move(queries)) {
+        mThread = std::thread([this] { run(); });
+    }
+
+    // Stops after the query being searched for
+    ~CacheWarmer() {
+        mStopping = true;
+        mThread.join();
+    }
+
+    CacheWarmer(const CacheWarmer&) = delete;
+    CacheWarmer& operator=(const CacheWarmer&) = delete;
+
+    void printStats(std::ostream& stream) const {
+        stream << "Warm-up: " << mSearched << " of " << mQueries.size()
+            << " saved queries searched, " << mSkipped << " skipped";
+        if (mFinished) {
+            stream << ", finished in " << mMilliseconds << " ms";
+        }
+        stream << '\n';
+    }
+
+private:
+    void run() {
+        const auto start = std::chrono::steady_clock::now();
+        // A thread's niceness is its own on Linux, so serving isn't slowed
+        ::setpriority(PRIO_PROCESS, static_cast<id_t>(::syscall(SYS_gettid)),
+            WARM_UP_NICENESS);
+        for (auto&& query : mQueries) {
+            if (mStopping) {
+                return;
+            }
+            // The generation comes first, so an edit to the document found
+            // after it can't be missed
+            const uint64_t generation =
+                mCache.generation(query.documentName);
+            auto document = mRegistry.peek(query.documentName);
+            if (!document) {
+                ++mSkipped;
+                continue;
+            }
+            const WordSet wordSet(query.text);
+            const size_t lineIndex = document->fuzzyFind(wordSet);
+            mCache.store(query.documentName, wordSet.normalizedLine(),
+                query.text, lineIndex, generation, query.uses, true);
+            ++mSearched;
+        }
+        mMilliseconds = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+        mFinished = true;
+    }
+
+    const DocumentRegistry& mRegistry;
+    ResultCache& mCache;
+    const std::vector<ResultCache::Query> mQueries;
+    std::atomic<size_t> mSearched{ 0 };
+    std::atomic<size_t> mSkipped{ 0 };
+    std::atomic<double> mMilliseconds{ 0 };
+    std::atomic<bool> mFinished{ false };
+    std::atomic<bool> mStopping{ false };
+    std::thread mThread;
+};
+
+// Reads requests on a thread of its own, so how many are waiting to be
+// answered is known while one is being answered
+class RequestQueue {
+public:
+    RequestQueue() {
+        // Reading would flush the answers being written otherwise, which
+        // flush themselves anyway
+        std::cin.tie(nullptr);
+        mThread = std::thread([this] { run(); });
+    }
+
+    // The reader stops after quit or at the end of the input, which pop
+    // returned false or the quit for before this
+    ~RequestQueue() {
+        mThread.join();
+    }
+
+    RequestQueue(const RequestQueue&) = delete;
+    RequestQueue& operator=(const RequestQueue&) = delete;
+
+    // Waits for the next request, returning false at the end of the input
+    bool pop(std::string& request) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mWake.wait(lock, [this] { return mEnded || !mPending.empty(); });
+        if (mPending.empty()) {
+            return false;
+        }
+        request = std::move(mPending.front());
+        mPending.pop_front();
+        return true;
+    }
+
+    // How many requests were read but not popped yet
+    size_t depth() const {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mPending.size();
+    }
+
+private:
+    void run() {
+        std::string request;
+        bool quitting = false;
+        while (!quitting && std::getline(std::cin, request)) {
+            quitting = request == "quit";
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mPending.push_back(std::move(request));
+            }
+            mWake.notify_one();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mEnded = true;
+        }
+        mWake.notify_one();
+    }
+
+    mutable std::mutex mMutex;
+    std::condition_variable mWake;
+    std::deque<std::string> mPending;
+    bool mEnded = false;
+    std::thread mThread;
+};
+
+// Searches are exact again once the queue is down to this fraction of the
+// depth they started being cut short at
+#define DEGRADE_RECOVERY_DIVISOR 4
+
+// Decides from how many requests are waiting whether searches are given a
+// deadline, so a burst can't make every request after it wait for exact
+// searches. Searches only go back to exact once the queue is much shorter,
+// so they don't switch back and forth around one depth
+class LoadShedder {
+public:
+    // Never gives searches a deadline if degradeDepth is 0
+    LoadShedder(size_t degradeDepth, size_t budgetMilliseconds)
+        : mDegradeDepth(degradeDepth),
+        mBudget(std::chrono::milliseconds(budgetMilliseconds)) {
+    }
+
+    // Returns true if the next search should be given a deadline
+    bool update(size_t depth) {
+        mDeepest = std::max(mDeepest, depth);
+        if (mDegradeDepth == 0) {
+            return false;
+        }
+        if (!mDegraded && depth >= mDegradeDepth) {
+            mDegraded = true;
+            ++mBursts;
+        }
+        else if (mDegraded &&
+            depth <= mDegradeDepth / DEGRADE_RECOVERY_DIVISOR) {
+            mDegraded = false;
+        }
+        return mDegraded;
+    }
+
+    Document::Deadline deadline(
+        std::chrono::steady_clock::time_point start) const {
+        Document::Deadline deadline;
+        deadline.time = start + mBudget;
+        return deadline;
+    }
+
+    // Counts a search given a deadline, and whether it was cut short
+    void count(bool approximate) {
+        ++mBudgeted;
+        mApproximate += approximate ? 1 : 0;
+    }
+
+    void printStats(std::ostream& stream) const {
+        stream << "Load: at most " << mDeepest << " requests waiting, "
+            << mBursts << " bursts, " << mBudgeted
+            << " searches given a deadline, " << mApproximate
+            << " answered approximately, searching "
+            << (mDegraded ? "with a deadline" : "exactly") << " now\n";
+    }
+
+private:
+    const size_t mDegradeDepth;
+    const std::chrono::steady_clock::duration mBudget;
+    bool mDegraded = false;
+    size_t mDeepest = 0;
+    uint64_t mBursts = 0;
+    uint64_t mBudgeted = 0;
+    uint64_t mApproximate = 0;
+};
+
+// Edits are "!set", a document name, a line index and the line's new text, or
+// "!delete", a name and a line index, separated by tabs. Either is answered
+// by the name, what was done and the line index
+static void handleEdit(DocumentRegistry& registry, ResultCache& cache,
+    const std::string& request) {
+    std::vector<std::string> fields;
+    for (size_t begin = 0; begin <= request.size();) {
+        // The text is the last field, so it may have tabs of its own
+        const size_t end = fields.size() == 3 ? std::string::npos :
+            request.find('\t', begin);
+        fields.push_back(request.substr(begin, end - begin));
+        begin = end == std::string::npos ? request.size() + 1 : end + 1;
+    }
+    const bool isSet = fields[0] == "!set" && fields.size() == 4;
+    const bool isDelete = fields[0] == "!delete" && fields.size() == 3;
+    if (!isSet && !isDelete) {
+        std::cout << "error\tUnknown command: " << request << std::endl;
+        return;
+    }
+    const std::string& name = fields[1];
+    char* end = nullptr;
+    const unsigned long long lineIndex =
+        std::strtoull(fields[2].c_str(), &end, 10);
+    if (fields[2].empty() || *end != '\0') {
+        std::cout << name << "\terror\tExpected a line index" << std::endl;
+        return;
+    }
+    std::string error;
+    if (!registry.edit(name, isSet, static_cast<size_t>(lineIndex),
+        isSet ? fields[3] : std::string(), error)) {
+        std::cout << name << "\terror\t" << error << std::endl;
+        return;
+    }
+    cache.invalidate(name);
+    std::cout << name << '\t' << (isSet ? "set" : "deleted") << '\t'
+        << lineIndex << std::endl;
+}
+
+#define REGISTRY_ARGUMENT_INDEX 2
+
+int serverMain(int argc, char** argv, const Options& options) {
+    if (argc != REGISTRY_ARGUMENT_INDEX + 1) {
+        std::cout << "Expected a registry file after --serve" << std::endl;
+        printUsage();
+        return 1;
+    }
+    DocumentRegistry registry(options.memoryBudgetMegabytes << 20, options);
+    if (!registry.addDocuments(argv[REGISTRY_ARGUMENT_INDEX])) {
+        std::cout << "Could not read registry file" << std::endl;
+        printUsage();
+        return 1;
+    }
+    std::unique_ptr<SlowQueryLog> slowQueryLog;
+    if (!options.slowQueryLogPath.empty()) {
+        slowQueryLog = std::make_unique<SlowQueryLog>(options.slowQueryLogPath,
+            static_cast<double>(options.slowQueryMilliseconds));
+        if (!slowQueryLog->isOpen()) {
+            std::cout << "Could not open slow query log" << std::endl;
+            return 1;
+        }
+    }
+    prepareRunKernels(options);
+
+    // Identical queries to unchanged documents are answered from the cache,
+    // warmed up with the ones asked most often before the last restart
+    ResultCache cache;
+    std::unique_ptr<CacheWarmer> warmer;
+    if (!options.warmCachePath.empty()) {
+        auto queries = ResultCache::loadQueries(options.warmCachePath);
+        for (auto&& query : queries) {
+            if (!registry.peek(query.documentName)) {
+                registry.acquire(query.documentName);
+            }
+        }
+        warmer = std::make_unique<CacheWarmer>(registry, cache,
+            std::move(queries));
+    }
+
+    // Each request is a document name and a word set separated by a tab,
+    // answered by the name, the found line's index and the line the same way.
+    // While too many are waiting, a search cut short by its deadline has
+    // "approximate" before the index
+    RequestQueue requests;
+    LoadShedder shedder(options.degradeQueueDepth,
+        options.degradedMilliseconds);
+    std::string request;
+    while (requests.pop(request)) {
+        const bool degraded = shedder.update(requests.depth());
+        if (request[0] == '!') {
+            handleEdit(registry, cache, request);
+            continue;
+        }
+        const size_t tab = request.find('\t');
+        if (tab == std::string::npos) {
+            // Anything else is a command
+            if (request == "quit") {
+                break;
+            }
+            if (request == "stats") {
+                // Ends with an empty line, since it takes more than one
+                registry.printStats(std::cout);
+                cache.printStats(std::cout);
+                if (warmer) {
+                    warmer->printStats(std::cout);
+                }
+                shedder.printStats(std::cout);
+                if (options.memoryReport) {
+                    registry.printMemoryReport(std::cout);
+                }
+                std::cout << std::endl;
+            }
+            else if (!request.empty()) {
+                std::cout << "error\tUnknown command: " << request
+                    << std::endl;
+            }
+            continue;
+        }
+        const auto received = std::chrono::steady_clock::now();
+        const std::string name(request, 0, tab);
+        auto document = registry.acquire(name);
+        if (!document) {
+            std::cout << name << "\terror\tCould not load document"
+                << std::endl;
+            continue;
+        }
+        const auto acquired = std::chrono::steady_clock::now();
+        const WordSet wordSet(request.substr(tab + 1));
+        size_t documentLineIndex;
+        bool approximate = false;
+        // Only profiled for the slow query log, since that makes it slower
+        Document::SearchProfile profile;
+        Document::SearchProfile* searchProfile =
+            slowQueryLog ? &profile : nullptr;
+        if (!cache.find(name, wordSet.normalizedLine(), documentLineIndex)) {
+            const uint64_t generation = cache.generation(name);
+            if (degraded) {
+                Document::Deadline deadline = shedder.deadline(acquired);
+                documentLineIndex =
+                    document->fuzzyFind(wordSet, &deadline, searchProfile);
+                approximate = deadline.reached;
+                shedder.count(approximate);
+            }
+            else {
+                documentLineIndex =
+                    document->fuzzyFind(wordSet, nullptr, searchProfile);
+            }
+            // Only exact results are kept, so they're never served later as
+            // if they were
+            if (!approximate) {
+                cache.store(name, wordSet.normalizedLine(),
+                    request.substr(tab + 1), documentLineIndex, generation);
+            }
+        }
+        else {
+            profile.strategy = "cached";
+        }
+        const auto found = std::chrono::steady_clock::now();
+        std::string text = document->line(documentLineIndex);
+        std::cout << name << '\t' << (approximate ? "approximate\t" : "")
+            << documentLineIndex << '\t' << text << std::endl;
+
+        // Only handed over after answering, so logging can't delay it
+        const double milliseconds = std::chrono::duration<double, std::milli>(
+            found - received).count();
+        if (slowQueryLog && slowQueryLog->isSlow(milliseconds)) {
+            slowQueryLog->record({ name, std::move(document),
+                request.substr(tab + 1), wordSet.normalizedLine(),
+                milliseconds, std::chrono::duration<double, std::milli>(
+                    acquired - received).count(), profile,
+                documentLineIndex, std::move(text) });
+        }
+    }
+    if (!options.warmCachePath.empty() && !cache.save(options.warmCachePath)) {
+        std::cout << "Could not save queries to warm the cache" << std::endl;
+    }
+    if (options.stats) {
+        registry.printStats(std::cerr);
+        cache.printStats(std::cerr);
+        if (warmer) {
+            warmer->printStats(std::cerr);
+        }
+        shedder.printStats(std::cerr);
+        printRunKernelStats(std::cerr);
+        printPruningStats(std::cerr);
+    }
+    if (options.memoryReport) {
+        registry.printMemoryReport(std::cerr);
+    }
+    return 0;
+}
+
+// Memory tracking keeps the size and category of each allocation made since
+// it started in a table allocated straight from malloc, so the table's own
+// allocations aren't tracked
+template<typename T>
+struct UntrackedAllocator {
+    using value_type = T;
+
+    UntrackedAllocator() = default;
+
+    template<typename U>
+    UntrackedAllocator(const UntrackedAllocator<U>&) {
+    }
+
+    T* allocate(size_t count) {
+        void* memory = std::malloc(count * sizeof(T));
+        if (memory == nullptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(memory);
+    }
+
+    void deallocate(T* memory, size_t) {
+        std::free(memory);
+    }
+
+    template<typename U>
+    bool operator==(const UntrackedAllocator<U>&) const {
+        return true;
+    }
+
+    template<typename U>
+    bool operator!=(const UntrackedAllocator<U>&) const {
+        return false;
+    }
+};
+
+#define MEMORY_CATEGORY_COUNT static_cast<size_t>(MemoryCategory::Count)
+
+struct MemoryTracker {
+    struct Allocation {
+        size_t size;
+        MemoryCategory category;
+    };
+
+    std::mutex mutex;
+    std::unordered_map<void*, Allocation, std::hash<void*>,
+        std::equal_to<void*>,
+        UntrackedAllocator<std::pair<void* const, Allocation>>> allocations;
+    std::array<size_t, MEMORY_CATEGORY_COUNT> liveBytes = {};
+    std::array<size_t, MEMORY_CATEGORY_COUNT> liveCounts = {};
+    size_t totalBytes = 0;
+    size_t peakBytes = 0;
+};
+
+static std::atomic<bool> memoryTracking(false);
+
+// Never destroyed, since memory can be freed while the program exits
+static MemoryTracker& memoryTracker() {
+    static MemoryTracker* tracker =
+        new (std::malloc(sizeof(MemoryTracker))) MemoryTracker();
+    return *tracker;
+}
+
+static void trackAllocation(void* memory, size_t size) {
+    MemoryTracker& tracker = memoryTracker();
+    const MemoryCategory category = currentMemoryCategory();
+    std::lock_guard<std::mutex> lock(tracker.mutex);
+    tracker.allocations[memory] = MemoryTracker::Allocation{size, category};
+    tracker.liveBytes[static_cast<size_t>(category)] += size;
+    ++tracker.liveCounts[static_cast<size_t>(category)];
+    tracker.totalBytes += size;
+    tracker.peakBytes = std::max(tracker.peakBytes, tracker.totalBytes);
+}
+
+static void untrackAllocation(void* memory) {
+    MemoryTracker& tracker = memoryTracker();
+    std::lock_guard<std::mutex> lock(tracker.mutex);
+    // Allocations made before tracking started aren't in the table
+    auto iter = tracker.allocations.find(memory);
+    if (iter != tracker.allocations.end()) {
+        const size_t category = static_cast<size_t>(iter->second.category);
+        tracker.liveBytes[category] -= iter->second.size;
+        --tracker.liveCounts[category];
+        tracker.totalBytes -= iter->second.size;
+        tracker.allocations.erase(iter);
+    }
+}
+
+void* operator new(size_t size) {
+    void* memory = std::malloc(size > 0 ? size : 1);
+    if (memory == nullptr) {
+        throw std::bad_alloc();
+    }
+    if (memoryTracking.load(std::memory_order_relaxed)) {
+        trackAllocation(memory, size);
+    }
+    return memory;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    void* memory = std::malloc(size > 0 ? size : 1);
+    if (memory != nullptr && memoryTracking.load(std::memory_order_relaxed)) {
+        trackAllocation(memory, size);
+    }
+    return memory;
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept {
+    return operator new(size, tag);
+}
+
+// Kept out of line, since callers that see the free inlined after a new warn
+// about mismatched allocation functions
+void __attribute__((noinline)) operator delete(void* memory) noexcept {
+    if (memory != nullptr && memoryTracking.load(std::memory_order_relaxed)) {
+        untrackAllocation(memory);
+    }
+    std::free(memory);
+}
+
+void operator delete[](void* memory) noexcept {
+    operator delete(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    operator delete(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept {
+    operator delete(memory);
+}
+
+void operator delete(void* memory, const std::nothrow_t&) noexcept {
+    operator delete(memory);
+}
+
+void operator delete[](void* memory, const std::nothrow_t&) noexcept {
+    operator delete(memory);
+}
+
+void startMemoryTracking() {
+    // Make the tracker before anything is tracked
+    memoryTracker();
+    memoryTracking = true;
+}
+
+void printMemoryReport(std::ostream& stream, size_t lineCount,
+    size_t nonEmptyLineCount) {
+    static const char* const names[MEMORY_CATEGORY_COUNT] = {
+        "other", "raw text", "normalized text", "word maps", "rune maps",
+        "vocabulary", "line table", "caches"
+    };
+    // Copy the counts first, since printing can allocate
+    MemoryTracker& tracker = memoryTracker();
+    std::unique_lock<std::mutex> lock(tracker.mutex);
+    const auto liveBytes = tracker.liveBytes;
+    const auto liveCounts = tracker.liveCounts;
+    const size_t totalBytes = tracker.totalBytes;
+    const size_t peakBytes = tracker.peakBytes;
+    lock.unlock();
+
+    const double lines = static_cast<double>(std::max<size_t>(lineCount, 1));
+    const double nonEmptyLines =
+        static_cast<double>(std::max<size_t>(nonEmptyLineCount, 1));
+    stream << "Memory: " << totalBytes << " bytes allocated, at most "
+        << peakBytes << " at once, for " << lineCount << " lines ("
+        << nonEmptyLineCount << " non-empty)\n";
+    for (size_t category = 0; category < MEMORY_CATEGORY_COUNT; ++category) {
+        const double bytes = static_cast<double>(liveBytes[category]);
+        stream << "  " << names[category] << ": " << liveBytes[category]
+            << " bytes in " << liveCounts[category] << " allocations, "
+            << bytes / lines << " per line, " << bytes / nonEmptyLines
+            << " per non-empty line\n";
+    }
+    const double bytes = static_cast<double>(totalBytes);
+    stream << "  total: " << bytes / lines << " per line, "
+        << bytes / nonEmptyLines << " per non-empty line\n";
+}
+
+// Compares every starting pair of positions and walks forward while they match
+size_t countSharedNaive(const std::string& a, const std::string& b) {
+    size_t longest = 0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        for (size_t j = 0; j < b.size(); ++j) {
+            size_t length = 0;
+            while (
+                ((i + length) < a.size()) &&
+                ((j + length) < b.size()) &&
+                (a[i + length] == b[j + length])) {
+                ++length;
+            }
+            longest = length > longest ? length : longest;
+        }
+    }
+    return longest;
+}
+
+// Returns the longest run of set bits in the mask
+template<typename Mask>
+static size_t longestRunOfOnes(Mask mask) {
+    size_t length = 0;
+    // Each step erodes every run by one bit, so count steps until none remain
+    while (mask != 0) {
+        mask &= static_cast<Mask>(mask >> 1);
+        ++length;
+    }
+    return length;
+}
+
+// Folds one chunk's match mask (bit n set when character n matched) into the
+// run carried across chunks and the longest run found so far
+template<size_t Width, typename Mask>
+static inline __attribute__((always_inline)) void trackRuns(
+    Mask mask, size_t& run, size_t& longest) {
+    constexpr Mask full = static_cast<Mask>(~Mask(0));
+    if (mask == full) {
+        // The whole chunk extends the current run
+        run += Width;
+        return;
+    }
+    const uint64_t misses = static_cast<uint64_t>(static_cast<Mask>(~mask));
+    // The run carried in from the previous chunk ends at the first miss
+    run += static_cast<size_t>(__builtin_ctzll(misses));
+    longest = run > longest ? run : longest;
+    // Runs entirely inside the chunk only matter if they could be longer
+    if (static_cast<size_t>(__builtin_popcountll(mask)) > longest) {
+        const size_t inner = longestRunOfOnes(mask);
+        longest = inner > longest ? inner : longest;
+    }
+    // The run that reaches the top of the chunk carries into the next one
+    run = static_cast<size_t>(
+        __builtin_clzll(~(static_cast<uint64_t>(mask) << (64 - Width))));
+}
+
+// Finishes whatever doesn't fill a whole chunk one character at a time
+static inline __attribute__((always_inline)) size_t finishDiagonal(
+    const char* a, const char* b, size_t i, size_t length, size_t run,
+    size_t longest) {
+    for (; i < length; ++i) {
+        if (a[i] == b[i]) {
+            ++run;
+        }
+        else {
+            longest = run > longest ? run : longest;
+            run = 0;
+        }
+    }
+    return run > longest ? run : longest;
+}
+
+// Each of the diagonal scans below walks one diagonal of the comparison matrix
+// (a[i] against b[i]) and returns the longest run of equal characters on it,
+// differing only in how many characters one instruction compares
+static size_t scanDiagonalScalar(const char* a, const char* b, size_t length,
+    size_t longest) {
+    return finishDiagonal(a, b, 0, length, 0, longest);
+}
+
+#if SIMD_DISPATCH
+static size_t scanDiagonalSse2(const char* a, const char* b, size_t length,
+    size_t longest) {
+    size_t run = 0;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        const __m128i aChunk =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i bChunk =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        trackRuns<16>(static_cast<uint16_t>(
+            _mm_movemask_epi8(_mm_cmpeq_epi8(aChunk, bChunk))), run, longest);
+    }
+    return finishDiagonal(a, b, i, length, run, longest);
+}
+
+// Same as SSE2, but the bit counting compiles down to popcnt. Processors
+// from then may lack lzcnt, which runs as bsr without it, so it's left out
+__attribute__((target("sse4.2,popcnt")))
+static size_t scanDiagonalSse42(const char* a, const char* b, size_t length,
+    size_t longest) {
+    size_t run = 0;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        const __m128i aChunk =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i bChunk =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        trackRuns<16>(static_cast<uint16_t>(
+            _mm_movemask_epi8(_mm_cmpeq_epi8(aChunk, bChunk))), run, longest);
+    }
+    return finishDiagonal(a, b, i, length, run, longest);
+}
+
+__attribute__((target("avx2,popcnt,lzcnt,bmi")))
+static size_t scanDiagonalAvx2(const char* a, const char* b, size_t length,
+    size_t longest) {
+    size_t run = 0;
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        const __m256i aChunk =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        const __m256i bChunk =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        trackRuns<32>(static_cast<uint32_t>(
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(aChunk, bChunk))),
+            run, longest);
+    }
+    return finishDiagonal(a, b, i, length, run, longest);
+}
+
+__attribute__((target("avx512f,avx512bw,popcnt,lzcnt,bmi")))
+static size_t scanDiagonalAvx512(const char* a, const char* b, size_t length,
+    size_t longest) {
+    size_t run = 0;
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64) {
+        const __m512i aChunk = _mm512_loadu_si512(a + i);
+        const __m512i bChunk = _mm512_loadu_si512(b + i);
+        trackRuns<64>(static_cast<uint64_t>(
+            _mm512_cmpeq_epi8_mask(aChunk, bChunk)), run, longest);
+    }
+    return finishDiagonal(a, b, i, length, run, longest);
+}
+#endif
+
+// Each of the ASCII lowering kernels lowers every ASCII capital letter and
+// leaves all other bytes alone, including the bytes of multibyte characters
+static void lowerAsciiScalar(char* text, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        const char c = text[i];
+        text[i] = c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+    }
+}
+
+// Each of the non-ASCII searches returns the position of the first byte from
+// the beginning with its high bit set, or the length if there isn't one
+static size_t findNonAsciiScalar(const char* text, size_t begin,
+    size_t length) {
+    while (begin < length && static_cast<unsigned char>(text[begin]) < 0x80) {
+        ++begin;
+    }
+    return begin;
+}
+
+#if SIMD_DISPATCH
+static void lowerAsciiSse2(char* text, size_t length) {
+    // Bytes with the high bit set compare as negative, so they never count as
+    // capital letters
+    const __m128i beforeA = _mm_set1_epi8('A' - 1);
+    const __m128i afterZ = _mm_set1_epi8('Z' + 1);
+    const __m128i toLower = _mm_set1_epi8('a' - 'A');
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i* chunk = reinterpret_cast<__m128i*>(text + i);
+        const __m128i bytes = _mm_loadu_si128(chunk);
+        const __m128i capitals = _mm_and_si128(
+            _mm_cmpgt_epi8(bytes, beforeA), _mm_cmplt_epi8(bytes, afterZ));
+        _mm_storeu_si128(chunk,
+            _mm_add_epi8(bytes, _mm_and_si128(capitals, toLower)));
+    }
+    lowerAsciiScalar(text + i, length - i);
+}
+
+static size_t findNonAsciiSse2(const char* text, size_t begin,
+    size_t length) {
+    for (; begin + 16 <= length; begin += 16) {
+        const uint32_t high = static_cast<uint32_t>(_mm_movemask_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + begin))));
+        if (high != 0) {
+            return begin + static_cast<size_t>(__builtin_ctz(high));
+        }
+    }
+    return findNonAsciiScalar(text, begin, length);
+}
+
+__attribute__((target("avx2,bmi")))
+static void lowerAsciiAvx2(char* text, size_t length) {
+    const __m256i beforeA = _mm256_set1_epi8('A' - 1);
+    const __m256i afterZ = _mm256_set1_epi8('Z' + 1);
+    const __m256i toLower = _mm256_set1_epi8('a' - 'A');
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i* chunk = reinterpret_cast<__m256i*>(text + i);
+        const __m256i bytes = _mm256_loadu_si256(chunk);
+        const __m256i capitals = _mm256_and_si256(
+            _mm256_cmpgt_epi8(bytes, beforeA),
+            _mm256_cmpgt_epi8(afterZ, bytes));
+        _mm256_storeu_si256(chunk,
+            _mm256_add_epi8(bytes, _mm256_and_si256(capitals, toLower)));
+    }
+    lowerAsciiScalar(text + i, length - i);
+}
+
+__attribute__((target("avx2,bmi")))
+static size_t findNonAsciiAvx2(const char* text, size_t begin,
+    size_t length) {
+    for (; begin + 32 <= length; begin += 32) {
+        const uint32_t high = static_cast<uint32_t>(_mm256_movemask_epi8(
+            _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(text + begin))));
+        if (high != 0) {
+            return begin + static_cast<size_t>(__builtin_ctz(high));
+        }
+    }
+    return findNonAsciiScalar(text, begin, length);
+}
+
+// Masked loads and stores let AVX-512 finish the tail without a scalar loop
+__attribute__((target("avx512f,avx512bw,bmi")))
+static void lowerAsciiAvx512(char* text, size_t length) {
+    const __m512i toLower = _mm512_set1_epi8('a' - 'A');
+    for (size_t i = 0; i < length; i += 64) {
+        const __mmask64 inside = length - i >= 64 ? ~__mmask64(0) :
+            (__mmask64(1) << (length - i)) - 1;
+        const __m512i bytes = _mm512_maskz_loadu_epi8(inside, text + i);
+        const __mmask64 capitals =
+            _mm512_cmpge_epi8_mask(bytes, _mm512_set1_epi8('A')) &
+            _mm512_cmple_epi8_mask(bytes, _mm512_set1_epi8('Z'));
+        _mm512_mask_storeu_epi8(text + i, inside & capitals,
+            _mm512_add_epi8(bytes, toLower));
+    }
+}
+
+__attribute__((target("avx512f,avx512bw,bmi")))
+static size_t findNonAsciiAvx512(const char* text, size_t begin,
+    size_t length) {
+    for (; begin < length; begin += 64) {
+        const __mmask64 inside = length - begin >= 64 ? ~__mmask64(0) :
+            (__mmask64(1) << (length - begin)) - 1;
+        const uint64_t high = _mm512_movepi8_mask(
+            _mm512_maskz_loadu_epi8(inside, text + begin));
+        if (high != 0) {
+            return begin + static_cast<size_t>(__builtin_ctzll(high));
+        }
+    }
+    return length;
+}
+#endif
+
+// The kernels for one instruction set level
+struct SimdKernels {
+    SimdLevel level;
+    size_t (*scanDiagonal)(const char*, const char*, size_t, size_t);
+    void (*lowerAscii)(char*, size_t);
+    size_t (*findNonAscii)(const char*, size_t, size_t);
+};
+
+static const SimdKernels& simdKernelsFor(SimdLevel level) {
+    static const SimdKernels scalar = { SimdLevel::Scalar, scanDiagonalScalar,
+        lowerAsciiScalar, findNonAsciiScalar };
+#if SIMD_DISPATCH
+    // SSE4.2 adds nothing for the text kernels, so it shares SSE2's
+    static const SimdKernels sse2 = { SimdLevel::Sse2, scanDiagonalSse2,
+        lowerAsciiSse2, findNonAsciiSse2 };
+    static const SimdKernels sse42 = { SimdLevel::Sse42, scanDiagonalSse42,
+        lowerAsciiSse2, findNonAsciiSse2 };
+    static const SimdKernels avx2 = { SimdLevel::Avx2, scanDiagonalAvx2,
+        lowerAsciiAvx2, findNonAsciiAvx2 };
+    static const SimdKernels avx512 = { SimdLevel::Avx512, scanDiagonalAvx512,
+        lowerAsciiAvx512, findNonAsciiAvx512 };
+    switch (level) {
+    case SimdLevel::Avx512: return avx512;
+    case SimdLevel::Avx2: return avx2;
+    case SimdLevel::Sse42: return sse42;
+    case SimdLevel::Sse2: return sse2;
+    case SimdLevel::Scalar: break;
+    }
+#else
+    (void)level;
+#endif
+    return scalar;
+}
+
+// The kernels everything calls through, which default to the host's best
+static const SimdKernels* selectedSimdKernels =
+    &simdKernelsFor(detectSimdLevel());
+
+SimdLevel detectSimdLevel() {
+#if SIMD_DISPATCH
+    __builtin_cpu_init();
+    // The AVX2 and AVX-512 kernels also count bits with lzcnt and tzcnt
+    const bool bitCounting = __builtin_cpu_supports("lzcnt") &&
+        __builtin_cpu_supports("bmi");
+    if (bitCounting && __builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512bw")) {
+        return SimdLevel::Avx512;
+    }
+    if (bitCounting && __builtin_cpu_supports("avx2")) {
+        return SimdLevel::Avx2;
+    }
+    if (__builtin_cpu_supports("sse4.2") &&
+        __builtin_cpu_supports("popcnt")) {
+        return SimdLevel::Sse42;
+    }
+    return SimdLevel::Sse2;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+bool selectSimdLevel(SimdLevel level) {
+    // Anything above what the host supports would crash on the first call
+    if (level > detectSimdLevel()) {
+        return false;
+    }
+    selectedSimdKernels = &simdKernelsFor(level);
+    return true;
+}
+
+SimdLevel selectedSimdLevel() {
+    return selectedSimdKernels->level;
+}
+
+const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+    case SimdLevel::Avx512: return "avx512";
+    case SimdLevel::Avx2: return "avx2";
+    case SimdLevel::Sse42: return "sse4.2";
+    case SimdLevel::Sse2: return "sse2";
+    case SimdLevel::Scalar: break;
+    }
+    return "scalar";
+}
+
+bool parseSimdLevel(const std::string& name, SimdLevel& level) {
+    for (auto candidate : { SimdLevel::Scalar, SimdLevel::Sse2,
+        SimdLevel::Sse42, SimdLevel::Avx2, SimdLevel::Avx512 }) {
+        if (name == simdLevelName(candidate)) {
+            level = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+void lowerAscii(char* text, size_t length) {
+    selectedSimdKernels->lowerAscii(text, length);
+}
+
+size_t findNonAscii(const char* text, size_t begin, size_t length) {
+    return selectedSimdKernels->findNonAscii(text, begin, length);
+}
+
+// A run of code points that fold by adding the same offset, where a step of 2
+// means only every other code point starting with the first one folds
+struct CaseFoldRange {
+    char32_t first;
+    char32_t last;
+    int32_t offset;
+    uint8_t step;
+};
+
+// The simple case folding of every cased script in common use outside ASCII,
+// sorted by first code point
+static const CaseFoldRange caseFoldRanges[] = {
+    { 0x00B5, 0x00B5, 775, 1 }, { 0x00C0, 0x00D6, 32, 1 },
+    { 0x00D8, 0x00DE, 32, 1 }, { 0x0100, 0x012F, 1, 2 },
+    { 0x0132, 0x0137, 1, 2 }, { 0x0139, 0x0148, 1, 2 },
+    { 0x014A, 0x0177, 1, 2 }, { 0x0178, 0x0178, -121, 1 },
+    { 0x0179, 0x017E, 1, 2 }, { 0x017F, 0x017F, -268, 1 },
+    { 0x0181, 0x0181, 210, 1 }, { 0x0182, 0x0185, 1, 2 },
+    { 0x0186, 0x0186, 206, 1 }, { 0x0187, 0x0187, 1, 1 },
+    { 0x0189, 0x018A, 205, 1 }, { 0x018B, 0x018B, 1, 1 },
+    { 0x018E, 0x018E, 79, 1 }, { 0x018F, 0x018F, 202, 1 },
+    { 0x0190, 0x0190, 203, 1 }, { 0x0191, 0x0191, 1, 1 },
+    { 0x0193, 0x0193, 205, 1 }, { 0x0194, 0x0194, 207, 1 },
+    { 0x0196, 0x0196, 211, 1 }, { 0x0197, 0x0197, 209, 1 },
+    { 0x0198, 0x0198, 1, 1 }, { 0x019C, 0x019C, 211, 1 },
+    { 0x019D, 0x019D, 213, 1 }, { 0x019F, 0x019F, 214, 1 },
+    { 0x01A0, 0x01A5, 1, 2 }, { 0x01A6, 0x01A6, 218, 1 },
+    { 0x01A7, 0x01A7, 1, 1 }, { 0x01A9, 0x01A9, 218, 1 },
+    { 0x01AC, 0x01AC, 1, 1 }, { 0x01AE, 0x01AE, 218, 1 },
+    { 0x01AF, 0x01AF, 1, 1 }, { 0x01B1, 0x01B2, 217, 1 },
+    { 0x01B3, 0x01B5, 1, 2 }, { 0x01B7, 0x01B7, 219, 1 },
+    { 0x01B8, 0x01B8, 1, 1 }, { 0x01BC, 0x01BC, 1, 1 },
+    { 0x01C4, 0x01C4, 2, 1 }, { 0x01C5, 0x01C5, 1, 1 },
+    { 0x01C7, 0x01C7, 2, 1 }, { 0x01C8, 0x01C8, 1, 1 },
+    { 0x01CA, 0x01CA, 2, 1 }, { 0x01CB, 0x01DB, 1, 2 },
+    { 0x01DE, 0x01EF, 1, 2 }, { 0x01F1, 0x01F1, 2, 1 },
+    { 0x01F2, 0x01F4, 1, 2 }, { 0x01F6, 0x01F6, -97, 1 },
+    { 0x01F7, 0x01F7, -56, 1 }, { 0x01F8, 0x021F, 1, 2 },
+    { 0x0220, 0x0220, -130, 1 }, { 0x0222, 0x0233, 1, 2 },
+    { 0x0386, 0x0386, 38, 1 }, { 0x0388, 0x038A, 37, 1 },
+    { 0x038C, 0x038C, 64, 1 }, { 0x038E, 0x038F, 63, 1 },
+    { 0x0391, 0x03A1, 32, 1 }, { 0x03A3, 0x03AB, 32, 1 },
+    { 0x03C2, 0x03C2, 1, 1 }, { 0x03D8, 0x03EF, 1, 2 },
+    { 0x0400, 0x040F, 80, 1 }, { 0x0410, 0x042F, 32, 1 },
+    { 0x0460, 0x0481, 1, 2 }, { 0x048A, 0x04BF, 1, 2 },
+    { 0x04C0, 0x04C0, 15, 1 }, { 0x04C1, 0x04CD, 1, 2 },
+    { 0x04D0, 0x052F, 1, 2 }, { 0x0531, 0x0556, 48, 1 },
+    { 0x10A0, 0x10C5, 7264, 1 }, { 0x1E00, 0x1E95, 1, 2 },
+    { 0x1E9E, 0x1E9E, -7615, 1 }, { 0x1EA0, 0x1EFF, 1, 2 },
+    { 0x1F08, 0x1F0F, -8, 1 }, { 0x1F18, 0x1F1D, -8, 1 },
+    { 0x1F28, 0x1F2F, -8, 1 }, { 0x1F38, 0x1F3F, -8, 1 },
+    { 0x1F48, 0x1F4D, -8, 1 }, { 0x1F59, 0x1F5F, -8, 2 },
+    { 0x1F68, 0x1F6F, -8, 1 }, { 0x2126, 0x2126, -7517, 1 },
+    { 0x212A, 0x212A, -8383, 1 }, { 0x212B, 0x212B, -8262, 1 },
+    { 0x2160, 0x216F, 16, 1 }, { 0x24B6, 0x24CF, 26, 1 },
+    { 0x2C00, 0x2C2F, 48, 1 }, { 0xFF21, 0xFF3A, 32, 1 },
+    { 0x10400, 0x10427, 40, 1 },
+};
+
+// Code points below this, which are all of the two byte UTF-8 characters,
+// fold through a flat table instead of searching the ranges
+#define CASE_FOLD_TABLE_SIZE 0x800
+
+static char32_t foldCodePointSlow(char32_t codePoint) {
+    const CaseFoldRange* end = std::end(caseFoldRanges);
+    const CaseFoldRange* range = std::upper_bound(std::begin(caseFoldRanges),
+        end, codePoint, [](char32_t value, const CaseFoldRange& candidate) {
+            return value < candidate.first;
+        });
+    if (range == std::begin(caseFoldRanges)) {
+        return codePoint;
+    }
+    --range;
+    if (codePoint > range->last || (codePoint - range->first) % range->step) {
+        return codePoint;
+    }
+    return static_cast<char32_t>(
+        static_cast<int32_t>(codePoint) + range->offset);
+}
+
+static const std::vector<char16_t>& caseFoldTable() {
+    static const std::vector<char16_t> table = [] {
+        std::vector<char16_t> folds(CASE_FOLD_TABLE_SIZE);
+        for (char32_t i = 0; i < CASE_FOLD_TABLE_SIZE; ++i) {
+            folds[i] = static_cast<char16_t>(foldCodePointSlow(i));
+        }
+        return folds;
+    }();
+    return table;
+}
+
+// Returns the length of the UTF-8 character starting at i and stores its code
+// point, or returns 0 if the bytes there don't form a valid character
+static size_t decodeUtf8(const std::string& text, size_t i,
+    char32_t& codePoint) {
+    const unsigned char lead = static_cast<unsigned char>(text[i]);
+    size_t length = 0;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        length = 2;
+        codePoint = lead & 0x1F;
+    }
+    else if (lead >= 0xE0 && lead <= 0xEF) {
+        length = 3;
+        codePoint = lead & 0x0F;
+    }
+    else if (lead >= 0xF0 && lead <= 0xF4) {
+        length = 4;
+        codePoint = lead & 0x07;
+    }
+    if (length == 0 || i + length > text.size()) {
+        return 0;
+    }
+    for (size_t j = 1; j < length; ++j) {
+        const unsigned char next = static_cast<unsigned char>(text[i + j]);
+        if ((next & 0xC0) != 0x80) {
+            return 0;
+        }
+        codePoint = (codePoint << 6) | (next & 0x3F);
+    }
+    return length;
+}
+
+static size_t encodeUtf8(char32_t codePoint, char* bytes) {
+    if (codePoint < 0x80) {
+        bytes[0] = static_cast<char>(codePoint);
+        return 1;
+    }
+    if (codePoint < 0x800) {
+        bytes[0] = static_cast<char>(0xC0 | (codePoint >> 6));
+        bytes[1] = static_cast<char>(0x80 | (codePoint & 0x3F));
+        return 2;
+    }
+    if (codePoint < 0x10000) {
+        bytes[0] = static_cast<char>(0xE0 | (codePoint >> 12));
+        bytes[1] = static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+        bytes[2] = static_cast<char>(0x80 | (codePoint & 0x3F));
+        return 3;
+    }
+    bytes[0] = static_cast<char>(0xF0 | (codePoint >> 18));
+    bytes[1] = static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F));
+    bytes[2] = static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+    bytes[3] = static_cast<char>(0x80 | (codePoint & 0x3F));
+    return 4;
+}
+
+void foldCase(std::string& line, bool isAscii) {
+    // ASCII letters are folded in bulk first, wherever they are in the line
+    lowerAscii(&line[0], line.size());
+    if (isAscii) {
+        return;
+    }
+    // Work through plain pointers, since writes through a string's characters
+    // would otherwise make the compiler reload its size and data every time
+    char* text = &line[0];
+    const size_t size = line.size();
+    const char16_t* smallFolds = caseFoldTable().data();
+    // Most folds keep the same encoded length and are done in place, but once
+    // one doesn't, the rest of the line is copied over with the folds applied
+    std::string rebuilt;
+    bool rebuilding = false;
+    size_t copied = 0;
+    size_t i = findNonAscii(text, 0, size);
+    while (i < size) {
+        const unsigned char lead = static_cast<unsigned char>(text[i]);
+        // Skip ahead to the next multibyte character in bulk
+        if (lead < 0x80) {
+            i = findNonAscii(text, i, size);
+            continue;
+        }
+        // Two byte characters that fold to two byte characters are the most
+        // common by far, so they get a path of their own
+        const unsigned char next =
+            i + 1 < size ? static_cast<unsigned char>(text[i + 1]) : 0;
+        if (!rebuilding && lead >= 0xC2 && lead <= 0xDF &&
+            (next & 0xC0) == 0x80) {
+            const char16_t folded =
+                smallFolds[((lead & 0x1F) << 6) | (next & 0x3F)];
+            if (folded >= 0x80) {
+                text[i] = static_cast<char>(0xC0 | (folded >> 6));
+                text[i + 1] = static_cast<char>(0x80 | (folded & 0x3F));
+                i += 2;
+                continue;
+            }
+        }
+        char32_t codePoint = 0;
+        const size_t length = decodeUtf8(line, i, codePoint);
+        // Bytes that aren't valid UTF-8 are left as they are
+        if (length == 0) {
+            ++i;
+            continue;
+        }
+        const char32_t folded = codePoint < CASE_FOLD_TABLE_SIZE ?
+            smallFolds[codePoint] : foldCodePointSlow(codePoint);
+        if (folded != codePoint) {
+            char bytes[4];
+            const size_t foldedLength = encodeUtf8(folded, bytes);
+            if (!rebuilding && foldedLength == length) {
+                std::copy(bytes, bytes + length, text + i);
+            }
+            else {
+                if (!rebuilding) {
+                    rebuilding = true;
+                    rebuilt.reserve(size);
+                }
+                rebuilt.append(text + copied, i - copied);
+                rebuilt.append(bytes, foldedLength);
+                copied = i + length;
+            }
+        }
+        i += length;
+    }
+    if (rebuilding) {
+        rebuilt.append(text + copied, size - copied);
+        line.swap(rebuilt);
+    }
+}
+
+// Every common run lies on exactly one diagonal of the comparison matrix, so
+// scanning each diagonal once finds the same result as the naive triple loop
+// without re-walking the runs from every starting point
+static size_t countSharedDiagonal(const std::string& a, const std::string& b,
+    size_t (*scanDiagonal)(const char*, const char*, size_t, size_t)) {
+    size_t longest = 0;
+    // Diagonals starting down the first column of a
+    for (size_t i = 0; i < a.size(); ++i) {
+        const size_t length = std::min(a.size() - i, b.size());
+        // Skip diagonals too short to beat what we already found
+        if (length <= longest) {
+            break;
+        }
+        longest = scanDiagonal(a.data() + i, b.data(), length, longest);
+    }
+    // Diagonals starting along the first row of b
+    for (size_t j = 1; j < b.size(); ++j) {
+        const size_t length = std::min(a.size(), b.size() - j);
+        if (length <= longest) {
+            break;
+        }
+        longest = scanDiagonal(a.data(), b.data() + j, length, longest);
+    }
+    return longest;
+}
+
+size_t countSharedDiagonal(const std::string& a, const std::string& b) {
+    return countSharedDiagonal(a, b, selectedSimdKernels->scanDiagonal);
+}
+
+// Makes a string of text-like characters with a small alphabet so that common
+// runs of realistic lengths show up
+static std::string makeBenchmarkString(std::mt19937& random, size_t length) {
+    static const std::string alphabet("etaoin shrdlucmfwyp etaoin ");
+    std::uniform_int_distribution<size_t> pick(0, alphabet.size() - 1);
+    std::string text(length, ' ');
+    for (auto&& c : text) {
+        c = alphabet[pick(random)];
+    }
+    return text;
+}
+
+#define RUN_LENGTH_BUCKETS 8
+// The naive loop plus the diagonal scan at each SIMD level
+#define RUN_KERNEL_COUNT 6
+
+// Calls the naive loop for kernel 0, otherwise the diagonal scan at the level
+// one below the kernel number
+static size_t countSharedWith(size_t kernel, const std::string& a,
+    const std::string& b) {
+    if (kernel == 0) {
+        return countSharedNaive(a, b);
+    }
+    return countSharedDiagonal(a, b,
+        simdKernelsFor(static_cast<SimdLevel>(kernel - 1)).scanDiagonal);
+}
+
+static std::string runKernelName(size_t kernel) {
+    if (kernel == 0) {
+        return "naive";
+    }
+    return std::string("diagonal-") +
+        simdLevelName(static_cast<SimdLevel>(kernel - 1));
+}
+
+// Lengths up to 4 are bucket 0, up to 8 are bucket 1, and so on with anything
+// past the last power of two sharing the last bucket
+static size_t runLengthBucket(size_t length) {
+    const uint64_t highest = length > 4 ? length - 1 : 3;
+    const size_t bits = static_cast<size_t>(64 - __builtin_clzll(highest));
+    return std::min<size_t>(bits - 2, RUN_LENGTH_BUCKETS - 1);
+}
+
+static std::string runLengthBucketName(size_t bucket) {
+    if (bucket + 1 < RUN_LENGTH_BUCKETS) {
+        return "<=" + std::to_string(size_t(4) << bucket);
+    }
+    return ">" + std::to_string(size_t(4) << (bucket - 1));
+}
+
+// Which kernel to use, indexed by the shorter then the longer length's bucket
+// Until calibrated, words use the naive loop and lines use the diagonal scan
+static uint8_t runKernelTable[RUN_LENGTH_BUCKETS][RUN_LENGTH_BUCKETS] = {
+    { 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0 },
+};
+static bool runKernelsCalibrated = false;
+static double runKernelCalibrationMilliseconds = 0;
+static bool runKernelTableLoaded = false;
+// Only counted when asked for since every thread would share the counters
+static bool countRunKernelCalls = false;
+static std::atomic<uint64_t> runKernelCalls[RUN_KERNEL_COUNT][
+    RUN_LENGTH_BUCKETS][RUN_LENGTH_BUCKETS];
+
+size_t countSharedAdaptive(const std::string& a, const std::string& b) {
+    const size_t shorter = runLengthBucket(std::min(a.size(), b.size()));
+    const size_t longer = runLengthBucket(std::max(a.size(), b.size()));
+    size_t kernel = runKernelTable[shorter][longer];
+    if (!runKernelsCalibrated) {
+        // Words are too short for whole chunks, where the simple loop wins
+        kernel = a.size() < 16 || b.size() < 16 ? 0 :
+            1 + static_cast<size_t>(selectedSimdLevel());
+    }
+    if (countRunKernelCalls) {
+        runKernelCalls[kernel][shorter][longer].fetch_add(
+            1, std::memory_order_relaxed);
+    }
+    return countSharedWith(kernel, a, b);
+}
+
+void prepareRunKernels(const Options& options) {
+    countRunKernelCalls = options.stats;
+    const bool tuningFile = !options.tuningPath.empty();
+    if (tuningFile && loadRunKernelTuning(options.tuningPath)) {
+        return;
+    }
+    calibrateRunKernels();
+    if (tuningFile && !saveRunKernelTuning(options.tuningPath)) {
+        std::cout << "Could not save tuning file: " << options.tuningPath
+            << std::endl;
+    }
+}
+
+void calibrateRunKernels() {
+    const auto calibrationStart = std::chrono::steady_clock::now();
+    // Only the kernels the selected SIMD level allows are candidates
+    const size_t kernelCount = 2 + static_cast<size_t>(selectedSimdLevel());
+    // Always time the same strings so runs are comparable
+    std::mt19937 random(54321);
+    for (size_t shorter = 0; shorter < RUN_LENGTH_BUCKETS; ++shorter) {
+        // Kernels far behind in one bucket only fall further behind in longer
+        // ones, so stop timing them to keep startup short
+        std::vector<bool> retired(kernelCount, false);
+        for (size_t longer = shorter; longer < RUN_LENGTH_BUCKETS; ++longer) {
+            // Time the middle of each bucket's range of lengths
+            const size_t shorterLength = size_t(3) << shorter;
+            const size_t longerLength = size_t(3) << longer;
+            // Fewer pairs for long lengths keeps each bucket's cost similar
+            const size_t pairCount =
+                std::max<size_t>(2, 1024 / (shorterLength + longerLength));
+            std::vector<std::pair<std::string, std::string>> pairs;
+            for (size_t i = 0; i < pairCount; ++i) {
+                pairs.emplace_back(makeBenchmarkString(random, shorterLength),
+                    makeBenchmarkString(random, longerLength));
+            }
+
+            double bestTime = 0;
+            size_t bestKernel = 1 + static_cast<size_t>(selectedSimdLevel());
+            std::vector<double> times(kernelCount, 0);
+            for (size_t kernel = 0; kernel < kernelCount; ++kernel) {
+                if (retired[kernel]) {
+                    continue;
+                }
+                // Warm up on one pair, then keep the faster of two timings
+                size_t sink = countSharedWith(kernel, pairs[0].first,
+                    pairs[0].second);
+                double time = 0;
+                for (size_t repeat = 0; repeat < 2; ++repeat) {
+                    const auto start = std::chrono::steady_clock::now();
+                    for (auto&& pair : pairs) {
+                        sink += countSharedWith(kernel, pair.first,
+                            pair.second);
+                    }
+                    const double elapsed = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start).count();
+                    time = repeat == 0 || elapsed < time ? elapsed : time;
+                }
+                // Keep the compiler from dropping the timed calls
+                if (sink == SIZE_MAX) {
+                    std::cout << sink;
+                }
+                times[kernel] = time;
+                if (bestTime == 0 || time < bestTime) {
+                    bestTime = time;
+                    bestKernel = kernel;
+                }
+            }
+            for (size_t kernel = 0; kernel < kernelCount; ++kernel) {
+                retired[kernel] =
+                    retired[kernel] || times[kernel] > bestTime * 4;
+            }
+            runKernelTable[shorter][longer] = static_cast<uint8_t>(bestKernel);
+            runKernelTable[longer][shorter] = static_cast<uint8_t>(bestKernel);
+        }
+    }
+    runKernelsCalibrated = true;
+    runKernelTableLoaded = false;
+    runKernelCalibrationMilliseconds = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - calibrationStart).count();
+}
+
+// The file is one line per pair of length buckets with the kernel's name
+bool loadRunKernelTuning(const std::string& path) {
+    std::ifstream stream(path);
+    if (!stream.is_open()) {
+        return false;
+    }
+    uint8_t table[RUN_LENGTH_BUCKETS][RUN_LENGTH_BUCKETS] = {};
+    size_t cellsRead = 0;
+    size_t shorter = 0, longer = 0;
+    std::string name;
+    while (stream >> shorter >> longer >> name) {
+        if (shorter >= RUN_LENGTH_BUCKETS || longer >= RUN_LENGTH_BUCKETS) {
+            return false;
+        }
+        // Files from hosts with more SIMD support than this one don't apply
+        size_t kernel = 0;
+        while (kernel < RUN_KERNEL_COUNT && runKernelName(kernel) != name) {
+            ++kernel;
+        }
+        if (kernel >= 2 + static_cast<size_t>(selectedSimdLevel())) {
+            return false;
+        }
+        table[shorter][longer] = static_cast<uint8_t>(kernel);
+        ++cellsRead;
+    }
+    if (cellsRead != RUN_LENGTH_BUCKETS * RUN_LENGTH_BUCKETS) {
+        return false;
+    }
+    std::copy(&table[0][0], &table[0][0] + cellsRead, &runKernelTable[0][0]);
+    runKernelsCalibrated = true;
+    runKernelTableLoaded = true;
+    return true;
+}
+
+bool saveRunKernelTuning(const std::string& path) {
+    std::ofstream stream(path);
+    for (size_t shorter = 0; shorter < RUN_LENGTH_BUCKETS; ++shorter) {
+        for (size_t longer = 0; longer < RUN_LENGTH_BUCKETS; ++longer) {
+            stream << shorter << ' ' << longer << ' '
+                << runKernelName(runKernelTable[shorter][longer]) << '\n';
+        }
+    }
+    return static_cast<bool>(stream);
+}
+
+void printRunKernelStats(std::ostream& stream) {
+    stream << "Longest common run kernels ";
+    if (runKernelTableLoaded) {
+        stream << "(loaded from tuning file)\n";
+    }
+    else if (runKernelsCalibrated) {
+        stream << "(calibrated in " << runKernelCalibrationMilliseconds
+            << " ms)\n";
+    }
+    else {
+        stream << "(uncalibrated)\n";
+    }
+    for (size_t shorter = 0; shorter < RUN_LENGTH_BUCKETS; ++shorter) {
+        for (size_t longer = shorter; longer < RUN_LENGTH_BUCKETS; ++longer) {
+            uint64_t calls[RUN_KERNEL_COUNT] = {};
+            for (size_t kernel = 0; kernel < RUN_KERNEL_COUNT; ++kernel) {
+                calls[kernel] = runKernelCalls[kernel][shorter][longer];
+            }
+            stream << "  lengths " << runLengthBucketName(shorter) << " and "
+                << runLengthBucketName(longer) << ": "
+                << runKernelName(runKernelTable[shorter][longer]);
+            for (size_t kernel = 0; kernel < RUN_KERNEL_COUNT; ++kernel) {
+                if (calls[kernel] > 0) {
+                    stream << ", " << runKernelName(kernel) << " ran "
+                        << calls[kernel] << " times";
+                }
+            }
+            stream << '\n';
+        }
+    }
+}
+
+void printPruningStats(std::ostream& stream) {
+    const uint64_t scored = linesScoredInFull;
+    const uint64_t pruned = linesPrunedByBound;
+    stream << "Searches scored " << scored << " lines in full and pruned "
+        << pruned << " by their bounds";
+    if (scored + pruned > 0) {
+        stream << " (" << 100.0 * static_cast<double>(pruned) /
+            static_cast<double>(scored + pruned) << "% pruned)";
+    }
+    stream << '\n';
+    const uint64_t filtered = linesFilteredBySignature;
+    if (filtered > 0) {
+        stream << "Signatures ruled out " << filtered
+            << " lines before their words were looked at\n";
+    }
+    const uint64_t searched = blocksSearched;
+    const uint64_t skipped = blocksSkipped;
+    if (searched + skipped > 0) {
+        stream << "Searches went through " << searched << " blocks and "
+            << "skipped " << skipped << " by their bounds\n";
+    }
+}
+
+// Every repetition of one benchmark, each in its unit per item, summarized by
+// the median and its 95% confidence interval
+struct BenchmarkResult {
+    std::string name;
+    std::string unit;
+    std::vector<double> samples;
+    double median = 0;
+    double low = 0;
+    double high = 0;
+};
+
+static BenchmarkResult summarizeBenchmark(const std::string& name,
+    const std::string& unit, const std::vector<double>& samples);
+// Saves the results to the JSON file and compares them with the baseline as
+// the options ask, returning 1 if either fails or anything got slower
+static int finishBenchmarks(const std::vector<BenchmarkResult>& results,
+    const Options& options);
+static int benchmarkStartup(int argc, char** argv, const Options& options);
+static int benchmarkApproximate(int argc, char** argv,
+    const Options& options);
+
+int benchmarkMain(int argc, char** argv, const Options& options) {
+    if (argc > 2 && argv[2] == std::string("startup")) {
+        return benchmarkStartup(argc, argv, options);
+    }
+    if (argc > 2 && argv[2] == std::string("approximate")) {
+        return benchmarkApproximate(argc, argv, options);
+    }
+    struct Distribution {
+        const char* name;
+        size_t minLength;
+        size_t maxLength;
+    };
+    const Distribution distributions[] = {
+        { "words 3-12", 3, 12 },
+        { "short lines 12-30", 12, 30 },
+        { "lines 30-80", 30, 80 },
+        { "long lines 80-300", 80, 300 },
+        { "mixed 30-300", 30, 300 },
+    };
+    struct Kernel {
+        std::string name;
+        size_t (*count)(const std::string&, const std::string&);
+        SimdLevel level;
+    };
+    // The diagonal scan is timed at every level the host supports
+    std::vector<Kernel> kernels = {
+        { "naive", countSharedNaive, SimdLevel::Scalar },
+    };
+    const SimdLevel selectedLevel = selectedSimdLevel();
+    calibrateRunKernels();
+    for (auto level : { SimdLevel::Scalar, SimdLevel::Sse2,
+        SimdLevel::Sse42, SimdLevel::Avx2, SimdLevel::Avx512 }) {
+        if (level <= detectSimdLevel()) {
+            kernels.push_back({ std::string("diagonal-") + simdLevelName(level),
+                countSharedDiagonal, level });
+        }
+    }
+    kernels.push_back({ "adaptive", countSharedAdaptive, selectedLevel });
+
+    std::vector<BenchmarkResult> results;
+    std::cout << "Longest common run kernels (nanoseconds per pair, median of "
+        << options.repetitions << " runs)\n";
+    for (auto&& distribution : distributions) {
+        // Every kernel gets the same pairs so their results can be compared
+        std::mt19937 random(12345);
+        std::uniform_int_distribution<size_t> pickLength(
+            distribution.minLength, distribution.maxLength);
+        std::vector<std::pair<std::string, std::string>> pairs;
+        for (size_t i = 0; i < 2000; ++i) {
+            std::string a(makeBenchmarkString(random, pickLength(random)));
+            std::string b(makeBenchmarkString(random, pickLength(random)));
+            pairs.emplace_back(std::move(a), std::move(b));
+        }
+
+        // Repetitions go around all of the kernels, so anything slowing the
+        // host down for a moment doesn't land on one kernel
+        std::vector<std::vector<double>> samples(kernels.size());
+        std::vector<size_t> expected;
+        for (size_t repetition = 0; repetition < options.repetitions;
+            ++repetition) {
+            for (size_t k = 0; k < kernels.size(); ++k) {
+                selectSimdLevel(kernels[k].level);
+                std::vector<size_t> counts;
+                counts.reserve(pairs.size());
+                const auto start = std::chrono::steady_clock::now();
+                for (auto&& pair : pairs) {
+                    counts.push_back(kernels[k].count(pair.first, pair.second));
+                }
+                const auto stop = std::chrono::steady_clock::now();
+                const double nanoseconds = static_cast<double>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        stop - start).count());
+                samples[k].push_back(
+                    nanoseconds / static_cast<double>(pairs.size()));
+                // The first kernel is the reference the others must agree with
+                if (expected.empty()) {
+                    expected = counts;
+                }
+                else if (counts != expected) {
+                    std::cout << kernels[k].name << " disagrees with "
+                        << kernels[0].name << std::endl;
+                    return 1;
+                }
+            }
+        }
+
+        std::cout << distribution.name << ':';
+        for (size_t k = 0; k < kernels.size(); ++k) {
+            results.push_back(summarizeBenchmark(std::string("lcr/") +
+                distribution.name + '/' + kernels[k].name, "ns/pair",
+                samples[k]));
+            std::cout << ' ' << kernels[k].name << '=' << results.back().median;
+        }
+        std::cout << std::endl;
+    }
+
+    // Case folding should cost about the same whatever the language
+    const std::vector<std::string> samples[] = {
+        { "The", "Cold", "QUEEN", "of", "England", "is", "Looking", "glass" },
+        { "Grüße", "aus", "ÖSTERREICH", "über", "Straße", "Bäume", "Äpfel" },
+        { "Καλημέρα", "ΚΟΣΜΕ", "Ελλάδα", "ΑΘΗΝΑ", "θάλασσα", "Ήλιος" },
+        { "Привет", "МИР", "Москва", "ДРУГ", "Война", "и", "мир" },
+    };
+    const char* sampleNames[] = { "english", "german", "greek", "russian" };
+    std::cout << "Case folding (nanoseconds per line, median of "
+        << options.repetitions << " runs)\n";
+    for (size_t sample = 0; sample < std::size(samples); ++sample) {
+        std::mt19937 random(12345);
+        std::uniform_int_distribution<size_t> pickWord(
+            0, samples[sample].size() - 1);
+        std::vector<std::string> lines(2000);
+        for (auto&& line : lines) {
+            while (line.size() < 60) {
+                line += samples[sample][pickWord(random)] + ' ';
+            }
+        }
+        bool isAscii = true;
+        for (auto&& line : lines) {
+            isAscii = isAscii &&
+                findNonAscii(line.data(), 0, line.size()) == line.size();
+        }
+
+        std::vector<SimdLevel> levels;
+        for (auto level : { SimdLevel::Scalar, SimdLevel::Sse2,
+            SimdLevel::Avx2, SimdLevel::Avx512 }) {
+            if (level <= detectSimdLevel()) {
+                levels.push_back(level);
+            }
+        }
+        std::vector<std::vector<double>> samples(levels.size());
+        std::vector<std::string> expected;
+        for (size_t repetition = 0; repetition < options.repetitions;
+            ++repetition) {
+            for (size_t l = 0; l < levels.size(); ++l) {
+                selectSimdLevel(levels[l]);
+                std::vector<std::string> folded(lines);
+                const auto start = std::chrono::steady_clock::now();
+                for (auto&& line : folded) {
+                    foldCase(line, isAscii);
+                }
+                const double nanoseconds = std::chrono::duration<double,
+                    std::nano>(std::chrono::steady_clock::now() - start).count();
+                samples[l].push_back(
+                    nanoseconds / static_cast<double>(lines.size()));
+                if (expected.empty()) {
+                    expected = folded;
+                }
+                else if (folded != expected) {
+                    std::cout << simdLevelName(levels[l])
+                        << " folds differently than scalar" << std::endl;
+                    return 1;
                 }
             }
         }
-        return itemsFound / itemsPossible;
+
+        std::cout << sampleNames[sample] << ':';
+        for (size_t l = 0; l < levels.size(); ++l) {
+            results.push_back(summarizeBenchmark(std::string("fold/") +
+                sampleNames[sample] + '/' + simdLevelName(levels[l]),
+                "ns/line", samples[l]));
+            std::cout << ' ' << simdLevelName(levels[l]) << '='
+                << results.back().median;
+        }
+        std::cout << std::endl;
     }
+    selectSimdLevel(selectedLevel);
+    return finishBenchmarks(results, options);
+}
 
-    // Returns true if the character acts as a separator for words
-    static bool doesBreakWord(char c) {
-        return std::string(" (),.!:;\"“‘’”—").find(c) != std::string::npos;
+static BenchmarkResult summarizeBenchmark(const std::string& name,
+    const std::string& unit, const std::vector<double>& samples) {
+    BenchmarkResult result;
+    result.name = name;
+    result.unit = unit;
+    result.samples = samples;
+    std::vector<double> sorted(samples);
+    std::sort(sorted.begin(), sorted.end());
+    const size_t count = sorted.size();
+    result.median = count % 2 == 1 ? sorted[count / 2] :
+        (sorted[count / 2 - 1] + sorted[count / 2]) / 2;
+    // The interval for the median comes from the order statistics, so it
+    // holds however the times are distributed, and takes in every sample when
+    // there are too few to narrow it down
+    const double rank = std::floor(static_cast<double>(count) / 2 -
+        0.98 * std::sqrt(static_cast<double>(count)));
+    const size_t outer = rank > 1 ? static_cast<size_t>(rank) - 1 : 0;
+    result.low = sorted[outer];
+    result.high = sorted[count - 1 - outer];
+    return result;
+}
+
+static bool writeBenchmarkJson(const std::string& path,
+    const std::vector<BenchmarkResult>& results) {
+    std::string out = "{\n  \"version\": 1,\n  \"simd\": ";
+    appendJsonString(out, simdLevelName(selectedSimdLevel()));
+    out += ",\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchmarkResult& result = results[i];
+        out += i == 0 ? "\n    {\"name\": " : ",\n    {\"name\": ";
+        appendJsonString(out, result.name);
+        out += ", \"unit\": ";
+        appendJsonString(out, result.unit);
+        out += ", \"median\": ";
+        appendJsonNumber(out, result.median);
+        out += ", \"low\": ";
+        appendJsonNumber(out, result.low);
+        out += ", \"high\": ";
+        appendJsonNumber(out, result.high);
+        out += ", \"samples\": [";
+        for (size_t j = 0; j < result.samples.size(); ++j) {
+            out += j == 0 ? "" : ", ";
+            appendJsonNumber(out, result.samples[j]);
+        }
+        out += "]}";
     }
+    out += "\n  ]\n}\n";
+    std::ofstream stream(path, std::ios::trunc);
+    stream << out;
+    return static_cast<bool>(stream);
+}
 
-    // Returns the longest string of consecutive matching characters
-    static size_t countShared(const std::string& a, const std::string& b) {
-        size_t longest = 0;
-        for (size_t i = 0; i < a.size(); ++i) {
-            for (size_t j = 0; j < b.size(); ++j) {
-                size_t length = 0;
-                while (
-                    ((i + length) < a.size()) &&
-                    ((j + length) < b.size()) &&
-                    (a[i + length] == b[j + length])) {
-                    ++length;
-                }
-                longest = length > longest ? length : longest;
-            }
+// Just enough of a JSON reader for reading benchmark results back, skipping
+// anything it isn't asked for
+class JsonReader {
+public:
+    explicit JsonReader(const std::string& text) : mText(text) {
+    }
+
+    bool failed() const {
+        return mFailed;
+    }
+
+    // Consumes the character if it's next, after any whitespace
+    bool consume(char c) {
+        skipWhitespace();
+        if (mPosition < mText.size() && mText[mPosition] == c) {
+            ++mPosition;
+            return true;
         }
-        return longest;
+        return false;
     }
 
-    // Returns the longest string of consecutive matching characters divided by
-    // the average length of the strings (using the average length penalizes
-    // having different lengths, while using the shorter string's length, the
-    // longest possible sequence given the lengths, would treat one being a
-    // substring of the other as a perfect match)
-    static double measureShared(const std::string& a, const std::string& b) {
-        const double sizeSum = static_cast<double>(a.size() + b.size());
-        return static_cast<double>(countShared(a, b) * 2) / sizeSum;
+    void expect(char c) {
+        if (!consume(c)) {
+            mFailed = true;
+        }
     }
 
-    // Searches each of the items of a for the longest shared sequence with b
-    // Returns the longest string of consecutive matching characters of items in
-    // a with b and divided by the average length of the strings (using the
-    // average length penalizes having different lengths, while using the
-    // shorter string's length, the longest possible sequence given the lengths,
-    // would treat one being a substring of the other as a perfect match)
-    static double measureShared(
-        const std::unordered_map<std::string, size_t>& a,
-        const std::string& b) {
-        // We only care about the best match
-        double bestShared = 0;
-        for (auto&& pair : a) {
-            const double shared = measureShared(pair.first, b);
-            bestShared = shared > bestShared ? shared : bestShared;
+    std::string readString() {
+        std::string text;
+        expect('"');
+        while (!mFailed && mPosition < mText.size() &&
+            mText[mPosition] != '"') {
+            char c = mText[mPosition++];
+            if (c == '\\' && mPosition < mText.size()) {
+                c = mText[mPosition++];
+                if (c == 'n') {
+                    c = '\n';
+                }
+                else if (c == 't') {
+                    c = '\t';
+                }
+                else if (c == 'u') {
+                    // Only ever written for control characters
+                    c = static_cast<char>(std::strtol(
+                        mText.substr(mPosition, 4).c_str(), nullptr, 16));
+                    mPosition += 4;
+                }
+            }
+            text += c;
         }
-        return bestShared;
+        expect('"');
+        return text;
     }
 
-    // For each item of b, searches each of the items of a for the longest
-    // shared sequence with the item of b
-    // Returns the average of the lengths of the shared sequences from each
-    // found best match for each item in b
-    static double measureShared(
-        const std::unordered_map<std::string, size_t>& a,
-        const std::unordered_map<std::string, size_t>& b) {
-        // We need to average the results
-        double measurementSum = 0;
-        for (auto&& pair : b) {
-            measurementSum += measureShared(a, pair.first);
+    double readNumber() {
+        skipWhitespace();
+        const char* begin = mText.c_str() + mPosition;
+        char* end = nullptr;
+        const double value = std::strtod(begin, &end);
+        if (end == begin) {
+            mFailed = true;
         }
-        return measurementSum / static_cast<double>(b.size());
+        mPosition += static_cast<size_t>(end - begin);
+        return value;
     }
 
-    std::string mLine;
-    std::unordered_map<std::string, size_t> mWords;
-    std::unordered_map<char, size_t> mRunes;
-};
+    // Calls readMember with each member's name, which must read its value
+    template<typename ReadMember>
+    void readObject(const ReadMember& readMember) {
+        expect('{');
+        if (consume('}')) {
+            return;
+        }
+        do {
+            const std::string name = readString();
+            expect(':');
+            readMember(name);
+        } while (!mFailed && consume(','));
+        expect('}');
+    }
 
-class Document {
-public:
-    Document(const std::vector<std::string>& documentLines) {
-        for (size_t i = 0; i < documentLines.size(); ++i) {
-            auto&& line = documentLines[i];
-            if (line.size() > 0) {
-                mNonEmtpyLines.emplace_back(i, line);
-            }
+    // Calls readElement for each element, which must read it
+    template<typename ReadElement>
+    void readArray(const ReadElement& readElement) {
+        expect('[');
+        if (consume(']')) {
+            return;
         }
+        do {
+            readElement();
+        } while (!mFailed && consume(','));
+        expect(']');
     }
 
-    // Returns the index of the line that best matches the words given
-    size_t fuzzyFind(const WordSet& wordSet) const {
-        size_t bestLine = 0;
-        double bestScore = -1.0;
-        for (auto&& line : mNonEmtpyLines) {
-            const double score = line.second.measureContainment(wordSet);
-            // If we get a perfect match, stop the search immediately
-            if (score == 1.0) {
-                return line.first;
-            }
-            if (score > bestScore) {
-                bestLine = line.first;
-                bestScore = score;
+    void skipValue() {
+        skipWhitespace();
+        const char c = mPosition < mText.size() ? mText[mPosition] : '\0';
+        if (c == '"') {
+            readString();
+        }
+        else if (c == '{') {
+            readObject([this](const std::string&) { skipValue(); });
+        }
+        else if (c == '[') {
+            readArray([this] { skipValue(); });
+        }
+        else if (c == 't' || c == 'f' || c == 'n') {
+            while (mPosition < mText.size() &&
+                std::isalpha(static_cast<unsigned char>(mText[mPosition]))) {
+                ++mPosition;
             }
         }
-        return bestLine;
+        else {
+            readNumber();
+        }
     }
 
 private:
-    // Only need to search the lines that aren't empty
-    // Keep the original line numbers though, so we can return the correct line
-    std::vector<std::pair<size_t, WordSet>> mNonEmtpyLines;
+    void skipWhitespace() {
+        while (mPosition < mText.size() &&
+            std::isspace(static_cast<unsigned char>(mText[mPosition]))) {
+            ++mPosition;
+        }
+    }
+
+    const std::string& mText;
+    size_t mPosition = 0;
+    bool mFailed = false;
 };
 
-int main(int argc, char** argv) {
-    // If no arguments, use a defalt text file location and wait for input
-    if (argc <= 1) {
-        // Prompt now so the display is not delayed by the document loading
-        std::cout << '>';
-        std::cout.flush();
-        // The document should be loaded quite quickly while waiting for input
-        std::vector<std::string> defaultDocumentLines;
-        if (!readAllLines(DEFAULT_PATH, defaultDocumentLines)) {
-            std::cout << "Could not open default source file: " << DEFAULT_PATH
+static bool readBenchmarkJson(const std::string& path,
+    std::vector<BenchmarkResult>& results) {
+    std::ifstream stream(path);
+    if (!stream.is_open()) {
+        return false;
+    }
+    const std::string text((std::istreambuf_iterator<char>(stream)),
+        std::istreambuf_iterator<char>());
+    JsonReader reader(text);
+    reader.readObject([&](const std::string& name) {
+        if (name != "benchmarks") {
+            reader.skipValue();
+            return;
+        }
+        reader.readArray([&] {
+            BenchmarkResult result;
+            reader.readObject([&](const std::string& field) {
+                if (field == "name") {
+                    result.name = reader.readString();
+                }
+                else if (field == "unit") {
+                    result.unit = reader.readString();
+                }
+                else if (field == "median") {
+                    result.median = reader.readNumber();
+                }
+                else if (field == "low") {
+                    result.low = reader.readNumber();
+                }
+                else if (field == "high") {
+                    result.high = reader.readNumber();
+                }
+                else if (field == "samples") {
+                    reader.readArray([&] {
+                        result.samples.push_back(reader.readNumber());
+                    });
+                }
+                else {
+                    reader.skipValue();
+                }
+            });
+            results.push_back(std::move(result));
+        });
+    });
+    return !reader.failed();
+}
+
+// Prints how each result compares with the baseline, returning false if any
+// got significantly slower
+static bool compareBenchmarks(const std::vector<BenchmarkResult>& results,
+    const std::vector<BenchmarkResult>& baseline, double maxSlowdownPercent,
+    std::ostream& stream) {
+    std::unordered_map<std::string, const BenchmarkResult*> baselineByName;
+    for (auto&& result : baseline) {
+        baselineByName[result.name] = &result;
+    }
+    size_t slower = 0;
+    stream << "Compared with baseline\n";
+    for (auto&& result : results) {
+        stream << "  " << result.name << ": ";
+        auto found = baselineByName.find(result.name);
+        if (found == baselineByName.end() || found->second->median <= 0) {
+            stream << result.median << ' ' << result.unit
+                << " (not in baseline)\n";
+            continue;
+        }
+        const BenchmarkResult& before = *found->second;
+        const double change = (result.median / before.median - 1) * 100;
+        // Benchmarks that were noisy before need to slow down more to count
+        const double allowed = std::max(maxSlowdownPercent,
+            (before.high - before.low) / before.median * 100);
+        const char* verdict = "same";
+        if (result.low > before.high && change > allowed) {
+            verdict = "SLOWER";
+            ++slower;
+        }
+        else if (result.high < before.low && -change > allowed) {
+            verdict = "faster";
+        }
+        stream << before.median << " -> " << result.median << ' '
+            << result.unit << " (" << (change >= 0 ? "+" : "") << change
+            << "%, allowed +" << allowed << "%) " << verdict << '\n';
+    }
+    stream << slower << " of " << results.size()
+        << " benchmarks significantly slower" << std::endl;
+    return slower == 0;
+}
+
+static int finishBenchmarks(const std::vector<BenchmarkResult>& results,
+    const Options& options) {
+    if (!options.jsonPath.empty() &&
+        !writeBenchmarkJson(options.jsonPath, results)) {
+        std::cout << "Could not write benchmark results file" << std::endl;
+        return 1;
+    }
+    if (!options.baselinePath.empty()) {
+        std::vector<BenchmarkResult> baseline;
+        if (!readBenchmarkJson(options.baselinePath, baseline)) {
+            std::cout << "Could not read baseline benchmark results file"
                 << std::endl;
-            printUsage();
             return 1;
         }
-        Document document(defaultDocumentLines);
-        // Fetch a line of input for the word set
-        std::string wordSetLine;
-        std::getline(std::cin, wordSetLine);
-        // Search the loaded document for the word set and output the match
-        size_t documentLineIndex = document.fuzzyFind(WordSet(wordSetLine));
-        std::cout << defaultDocumentLines[documentLineIndex] << std::endl;
-        return 0;
+        if (!compareBenchmarks(results, baseline,
+            static_cast<double>(options.maxSlowdownPercent), std::cout)) {
+            return 1;
+        }
     }
-    // Otherwise, expect the format matching the CLI driver usage
-    driverMain(argc, argv);
+    return 0;
 }
 
-void printUsage() {
-    std::cout <<
-        "linefuzzyfinder\n"
-        "\n"
-        "NAME\n"
-        "\tlinefuzzyfinder - finds a line similar to input words\n"
-        "\n"
-        "SYNOPSIS\n"
-        "\tUsage: linefuzzyfinder [-d documentFilepath] [-i wordSetFilepath]\n"
-        "\tUsage: linefuzzyfinder [-d documentFilepath] [-c ...]\n"
-        "\n"
-        "DESCRIPTION\n"
-        "\tlinefuzzyfinder is a pattern matcher that finds the most similar "
-        "line of text from a document to a set of words. The set of words can "
-        "be provided as a file with each set on its own line, or as quoted sets"
-        " of words on the command line.\n"
-        "\n"
-        "EXAMPLES\n"
-        "\tlinefuzzyfinder -d ./lepanto.txt -i ./testInputs.txt\n"
-        "\t\tFinds the closest matching lines in \"./lepanto.txt\" to each set "
-        "of words on each line of \"./testInputs.txt\".\n"
-        "\n"
-        "\tlinefuzzyfinder -d ./lepanto.txt -c \"his head a flag\" \"test word "
-        "set two\" \"set three\"\n"
-        "\t\tFinds the closest matching lines in \"./lepanto.txt\" to each set "
-        "of words given in quotes.\n";
+// The probe reports times from the monotonic clock, which every process on
+// the host shares, so they line up with when the benchmark started it
+static int64_t monotonicNanoseconds(
+    std::chrono::steady_clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        time.time_since_epoch()).count();
 }
 
-bool readAllLines(const std::string& path, std::vector<std::string>& lines) {
-    std::ifstream stream(path);
-    if (stream.is_open()) {
-        std::string line;
-        while (std::getline(stream, line)) {
-            lines.emplace_back(std::move(line));
-        };
-        return lines.size() > 0;
+#define PROBE_DOCUMENT_ARGUMENT_INDEX 2
+#define PROBE_WORD_SET_ARGUMENT_INDEX 3
+
+int startupProbeMain(int argc, char** argv, const Options& options) {
+    const auto entered = std::chrono::steady_clock::now();
+    if (argc != PROBE_WORD_SET_ARGUMENT_INDEX + 1) {
+        return 1;
     }
-    return false;
+    // Same order as the interactive mode
+    prepareRunKernels(options);
+    const auto kernelsReady = std::chrono::steady_clock::now();
+    std::vector<std::string> lines;
+    std::unique_ptr<Document> document;
+    if (!loadDocument(argv[PROBE_DOCUMENT_ARGUMENT_INDEX], lines, document)) {
+        return 1;
+    }
+    const auto documentReady = std::chrono::steady_clock::now();
+    const size_t documentLineIndex =
+        document->fuzzyFind(WordSet(argv[PROBE_WORD_SET_ARGUMENT_INDEX]));
+    const auto found = std::chrono::steady_clock::now();
+    std::cout << monotonicNanoseconds(entered) << ' '
+        << monotonicNanoseconds(kernelsReady) << ' '
+        << monotonicNanoseconds(documentReady) << ' '
+        << monotonicNanoseconds(found) << ' ' << documentLineIndex
+        << std::endl;
+    return 0;
 }
 
-#define DOCUMENT_FLAG_INDEX 1
-#define DOCUMENT_ARGUMENT_INDEX 2
-#define WORD_SET_FLAG_INDEX 3
-#define WORD_SET_ARGUMENT_INDEX 4
-#define MINIMUM_ARGUMENT_COUNT 5
+// Asks the kernel to drop the file's cached pages, so the next read of it
+// comes from the disk
+static void dropFromPageCache(const std::string& path) {
+    const int descriptor = ::open(path.c_str(), O_RDONLY);
+    if (descriptor >= 0) {
+        // Pages not written back yet can't be dropped
+        ::fdatasync(descriptor);
+        ::posix_fadvise(descriptor, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(descriptor);
+    }
+}
 
-int driverMain(int argc, char** argv) {
-    // Format validation (program name, -d, document, -i/-c, word set...)
-    if (argc < MINIMUM_ARGUMENT_COUNT) {
-        std::cout << "Expected at least " << MINIMUM_ARGUMENT_COUNT
-            << " arguments, but received " << argc << std::endl;
-        printUsage();
+// Milliseconds each startup phase of one probe run took
+struct StartupPhases {
+    double start = 0;
+    double kernels = 0;
+    double load = 0;
+    double search = 0;
+    double total = 0;
+};
+
+// Runs the probe as a new process, returning false if it failed
+static bool runStartupProbe(const std::vector<std::string>& arguments,
+    StartupPhases& phases, size_t& documentLineIndex) {
+    int output[2];
+    if (::pipe(output) != 0) {
+        return false;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, output[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, output[0]);
+    std::vector<char*> argv;
+    for (auto&& argument : arguments) {
+        argv.push_back(const_cast<char*>(argument.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    const auto spawned = std::chrono::steady_clock::now();
+    pid_t child = 0;
+    const int error = posix_spawn(&child, argv[0], &actions, nullptr,
+        argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    ::close(output[1]);
+    std::string report;
+    char buffer[256];
+    for (ssize_t count; (count = ::read(output[0], buffer, sizeof(buffer))) > 0;) {
+        report.append(buffer, static_cast<size_t>(count));
+    }
+    ::close(output[0]);
+    int status = 0;
+    if (error != 0 || ::waitpid(child, &status, 0) != child ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return false;
+    }
+
+    int64_t entered = 0, kernelsReady = 0, documentReady = 0, found = 0;
+    std::istringstream stream(report);
+    if (!(stream >> entered >> kernelsReady >> documentReady >> found
+        >> documentLineIndex)) {
+        return false;
+    }
+    auto milliseconds = [](int64_t from, int64_t to) {
+        return static_cast<double>(to - from) / 1e6;
+    };
+    const int64_t start = monotonicNanoseconds(spawned);
+    phases.start = milliseconds(start, entered);
+    phases.kernels = milliseconds(entered, kernelsReady);
+    phases.load = milliseconds(kernelsReady, documentReady);
+    phases.search = milliseconds(documentReady, found);
+    phases.total = milliseconds(start, found);
+    return true;
+}
+
+static int benchmarkStartup(int argc, char** argv, const Options& options) {
+    const std::string documentPath(argc > 3 ? argv[3] : DEFAULT_PATH);
+    std::vector<std::string> documentLines;
+    if (!readAllLines(documentPath, documentLines)) {
+        std::cout << "Could not open source file: " << documentPath
+            << std::endl;
         return 1;
     }
-    if (argv[DOCUMENT_FLAG_INDEX] != std::string("-d")) {
-        std::cout << "Missing \"-d\" flag." << std::endl;
-        printUsage();
+    std::error_code error;
+    const std::string executable =
+        std::filesystem::read_symlink("/proc/self/exe", error).string();
+    if (error) {
+        std::cout << "Could not find this program to start it again"
+            << std::endl;
         return 1;
     }
-    const std::string wordSetFlag(argv[WORD_SET_FLAG_INDEX]);
-    if (wordSetFlag != "-i" && wordSetFlag != "-c") {
-        std::cout << "Missing \"-i\" or \"-c\" flag." << std::endl;
-        printUsage();
+    const std::filesystem::path directory =
+        std::filesystem::temp_directory_path() /
+        ("linefuzzyfinder-startup-" + std::to_string(::getpid()));
+    std::filesystem::create_directories(directory, error);
+    auto fail = [&](const char* message) {
+        std::cout << message << std::endl;
+        std::filesystem::remove_all(directory, error);
         return 1;
+    };
+
+    // The words of a line from the middle backwards, so the search can't
+    // stop early on a perfect match
+    std::string wordSetLine;
+    {
+        std::istringstream words(documentLines[documentLines.size() / 2]);
+        for (std::string word; words >> word;) {
+            wordSetLine = word + (wordSetLine.empty() ? "" : " ") + wordSetLine;
+        }
     }
 
-    // Parameter validation (files present and input is readable)
+    std::vector<BenchmarkResult> results;
+    std::cout << "Startup (milliseconds, median of " << options.repetitions
+        << " runs)\n";
+    size_t lastCopies = 0;
+    for (size_t targetLines : { 0, 4000, 40000 }) {
+        // Repeat the document to about the size, saving it as text and as an
+        // index, where sizes the document is already past are skipped
+        const size_t copies =
+            std::max<size_t>(1, targetLines / documentLines.size());
+        if (copies <= lastCopies) {
+            continue;
+        }
+        lastCopies = copies;
+        std::vector<std::string> lines;
+        for (size_t i = 0; i < copies; ++i) {
+            lines.insert(lines.end(), documentLines.begin(),
+                documentLines.end());
+        }
+        const std::string textPath =
+            (directory / ("document" + std::to_string(copies) + ".txt")).string();
+        const std::string indexPath = textPath + DOCUMENT_INDEX_EXTENSION;
+        {
+            std::ofstream stream(textPath, std::ios::trunc);
+            for (auto&& line : lines) {
+                stream << line << '\n';
+            }
+        }
+        if (!saveDocumentIndex(indexPath, lines, Document(lines))) {
+            return fail("Could not write document index file");
+        }
+
+        for (const std::string& path : { textPath, indexPath }) {
+            for (bool cold : { true, false }) {
+                std::vector<std::string> arguments = { executable };
+                if (!options.tuningPath.empty()) {
+                    arguments.insert(arguments.end(),
+                        { "--tuning", options.tuningPath });
+                }
+                if (!options.simdLevel.empty()) {
+                    arguments.insert(arguments.end(),
+                        { "--simd", options.simdLevel });
+                }
+                arguments.insert(arguments.end(),
+                    { "--startup-probe", path, wordSetLine });
+                // A warm cache is what the run before leaves behind
+                StartupPhases phases;
+                size_t documentLineIndex = 0;
+                std::vector<StartupPhases> runs;
+                bool failed = !cold &&
+                    !runStartupProbe(arguments, phases, documentLineIndex);
+                for (size_t run = 0; run < options.repetitions && !failed;
+                    ++run) {
+                    if (cold) {
+                        dropFromPageCache(path);
+                    }
+                    failed = !runStartupProbe(arguments, phases,
+                        documentLineIndex);
+                    runs.push_back(phases);
+                }
+                if (failed) {
+                    return fail("Startup probe failed");
+                }
+                const std::string name = std::to_string(lines.size()) +
+                    " lines " + (path == textPath ? "text" : "index") + ' ' +
+                    (cold ? "cold" : "warm");
+                std::cout << name << ':';
+                const std::pair<const char*, double StartupPhases::*>
+                    phaseNames[] = {
+                        { "start", &StartupPhases::start },
+                        { "kernels", &StartupPhases::kernels },
+                        { "load", &StartupPhases::load },
+                        { "search", &StartupPhases::search },
+                        { "total", &StartupPhases::total },
+                    };
+                for (auto&& phase : phaseNames) {
+                    std::vector<double> samples;
+                    for (auto&& run : runs) {
+                        samples.push_back(run.*phase.second);
+                    }
+                    results.push_back(summarizeBenchmark("startup/" + name +
+                        '/' + phase.first, "ms", samples));
+                    std::cout << ' ' << phase.first << '='
+                        << results.back().median;
+                }
+                std::cout << std::endl;
+            }
+        }
+    }
+    std::filesystem::remove_all(directory, error);
+    return finishBenchmarks(results, options);
+}
+
+// How many queries of each kind --benchmark approximate makes from the
+// document's lines
+#define APPROXIMATE_BENCHMARK_QUERIES 200
+
+static int benchmarkApproximate(int argc, char** argv,
+    const Options& options) {
+    const std::string documentPath(argc > 3 ? argv[3] : DEFAULT_PATH);
     std::vector<std::string> documentLines;
-    if (!readAllLines(argv[DOCUMENT_ARGUMENT_INDEX], documentLines)) {
-        std::cout << "Could not open source file" << std::endl;
-        printUsage();
+    if (!readAllLines(documentPath, documentLines)) {
+        std::cout << "Could not open source file: " << documentPath
+            << std::endl;
         return 1;
     }
-    std::vector<std::string> wordSetLines;
-    if (wordSetFlag == std::string("-i")) {
-        // Get input word sets from a file
-        if (!readAllLines(argv[WORD_SET_ARGUMENT_INDEX], wordSetLines)) {
-            std::cout << "Could not open input word set file" << std::endl;
-            printUsage();
+    prepareRunKernels(options);
+
+    // The first half of the queries are each a line with one of its words
+    // dropped and two others swapped, so it's near its line without matching
+    // it perfectly. The second half are each two to five words from lines
+    // anywhere in the document, like word sets usually are, which no one
+    // line has to be near
+    std::vector<std::string> queries;
+    {
+        std::vector<const std::string*> nonEmpty;
+        for (auto&& line : documentLines) {
+            if (!line.empty()) {
+                nonEmpty.push_back(&line);
+            }
+        }
+        if (nonEmpty.empty()) {
+            std::cout << "No lines to make queries from in source file: "
+                << documentPath << std::endl;
             return 1;
         }
-    }
-    else {
-        // Get input word sets from the command line
-        for (int i = WORD_SET_ARGUMENT_INDEX; i < argc; ++i) {
-            wordSetLines.push_back(argv[i]);
+        std::mt19937 random(12345);
+        auto pick = [&random](size_t count) {
+            return std::uniform_int_distribution<size_t>(0, count - 1)(random);
+        };
+        for (size_t i = 0; i < APPROXIMATE_BENCHMARK_QUERIES; ++i) {
+            std::istringstream stream(*nonEmpty[pick(nonEmpty.size())]);
+            std::vector<std::string> words;
+            for (std::string word; stream >> word;) {
+                words.push_back(word);
+            }
+            if (words.size() > 1) {
+                words.erase(words.begin() +
+                    static_cast<std::ptrdiff_t>(pick(words.size())));
+            }
+            if (words.size() > 2) {
+                std::swap(words[pick(words.size())], words[pick(words.size())]);
+            }
+            std::string query;
+            for (auto&& word : words) {
+                query += (query.empty() ? "" : " ") + word;
+            }
+            queries.push_back(query);
+        }
+        for (size_t i = 0; i < APPROXIMATE_BENCHMARK_QUERIES; ++i) {
+            const size_t wordCount = 2 + pick(4);
+            std::string query;
+            for (size_t j = 0; j < wordCount; ++j) {
+                std::istringstream stream(*nonEmpty[pick(nonEmpty.size())]);
+                std::vector<std::string> words;
+                for (std::string word; stream >> word;) {
+                    words.push_back(word);
+                }
+                if (!words.empty()) {
+                    query += (query.empty() ? "" : " ") +
+                        words[pick(words.size())];
+                }
+            }
+            queries.push_back(query);
         }
     }
+    std::vector<WordSet> wordSets(queries.begin(), queries.end());
 
-    // Preprocess the data set once so we don't have to do it on each search
-    Document document(documentLines);
+    // Every repetition builds the graph again from the same document
+    const Document exact(documentLines, 0, SIZE_MAX, options.threads);
+    std::vector<double> exactScores(wordSets.size());
+    std::vector<double> buildSamples, searchSamples, exhaustiveSamples;
+    size_t graphBytes = 0;
+    // Of the queries near lines, then of the word sets
+    std::array<size_t, 2> matches = {};
+    auto microseconds = [](std::chrono::steady_clock::duration time) {
+        return std::chrono::duration<double, std::micro>(time).count();
+    };
+    for (size_t repetition = 0; repetition < options.repetitions;
+        ++repetition) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < wordSets.size(); ++i) {
+            exact.fuzzyFind(wordSets[i], exactScores[i]);
+        }
+        exhaustiveSamples.push_back(microseconds(
+            std::chrono::steady_clock::now() - start) /
+            static_cast<double>(wordSets.size()));
 
-    // Process the data and input
-    for (auto&& wordSetLine : wordSetLines) {
-        std::cout << "Searching for word set: \"" << wordSetLine << "\"\n";
-        size_t documentLineIndex = document.fuzzyFind(WordSet(wordSetLine));
-        std::cout << "Found line " << documentLineIndex << ": \""
-            << documentLines[documentLineIndex] << "\"" << std::endl;
+        Document approximate(documentLines, 0, SIZE_MAX, options.threads);
+        const size_t bytesBefore = approximate.memoryBytes();
+        start = std::chrono::steady_clock::now();
+        approximate.searchApproximately(options.threads);
+        buildSamples.push_back(microseconds(
+            std::chrono::steady_clock::now() - start) / 1000);
+        graphBytes = approximate.memoryBytes() - bytesBefore;
+
+        // Found when the line has the best score, even if it's another line
+        // with the same score
+        matches = {};
+        start = std::chrono::steady_clock::now();
+        std::vector<double> scores(wordSets.size());
+        for (size_t i = 0; i < wordSets.size(); ++i) {
+            approximate.fuzzyFind(wordSets[i], scores[i]);
+        }
+        searchSamples.push_back(microseconds(
+            std::chrono::steady_clock::now() - start) /
+            static_cast<double>(wordSets.size()));
+        for (size_t i = 0; i < wordSets.size(); ++i) {
+            matches[i / APPROXIMATE_BENCHMARK_QUERIES] +=
+                scores[i] == exactScores[i] ? 1 : 0;
+        }
     }
-    return 0;
+
+    std::vector<BenchmarkResult> results;
+    results.push_back(summarizeBenchmark("approximate/build", "ms",
+        buildSamples));
+    results.push_back(summarizeBenchmark("approximate/search", "us/query",
+        searchSamples));
+    results.push_back(summarizeBenchmark("approximate/exhaustive", "us/query",
+        exhaustiveSamples));
+    const size_t lineCount = std::max<size_t>(exact.nonEmptyLineCount(), 1);
+    std::cout << "Nearest neighbor graph over " << exact.nonEmptyLineCount()
+        << " lines (median of " << options.repetitions << " runs)\n"
+        << "build: " << results[0].median << " ms on " << options.threads
+        << " threads\n"
+        << "memory: " << graphBytes << " bytes, " << graphBytes / lineCount
+        << " per line\n"
+        << "search: " << results[1].median << " us per query, against "
+        << results[2].median << " us searching every line\n"
+        << "recall: " << 100.0 * static_cast<double>(matches[0]) /
+            APPROXIMATE_BENCHMARK_QUERIES << "% of "
+        << APPROXIMATE_BENCHMARK_QUERIES << " queries near lines and "
+        << 100.0 * static_cast<double>(matches[1]) /
+            APPROXIMATE_BENCHMARK_QUERIES << "% of "
+        << APPROXIMATE_BENCHMARK_QUERIES
+        << " word sets found a line with the best score" << std::endl;
+    return finishBenchmarks(results, options);
 }